@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,75 +8,1215 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <linux/io_uring.h>
+#include <fnmatch.h>
+#include <ctype.h>
+#include <spawn.h>
+#include <dlfcn.h>
+#include <termios.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/prctl.h>
+#include <linux/sched.h>
+#include "shell.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef SHELL_LIBRARY
+// Embedded, the shell prints through a FILE of its own on the library
+// thread's fd 1, never into the host's stdout buffer
+FILE *shell_stdout;
+#undef stdout
+#define stdout shell_stdout
+#define printf(...) fprintf(shell_stdout, __VA_ARGS__)
+#endif
 
 #define MAX_LEN 512
-#define MAXARGS 10
 #define HISTORY_SIZE 10
-#define MAXVARS 20  // Max number of variables
+#define MAX_JOBS 64
+#define MAX_STAGES 16
+#define MAX_SESSIONS 32
+#define MAX_WORKERS 16
+#define FRAME_MAX 65536
+#define TRACE_CAP 8192
+#define HIST_SUB_BITS 5      // 32 sub-buckets per power of two, ~3% precision
+#define HIST_MAX_BITS 40     // values up to 2^40 ns (~18 minutes)
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
+#define METRICS_INTERVAL 15  // seconds between Prometheus file updates
+#define MAX_REPLAY_SHELLS 64
+#define VAR_BITS 5           // hash bits used per level of the variable trie
+#define MAX_LOCALS 64        // local variables in one function call
 #define PROMPT "PUCITshell:- "
+#define MAX_DEADLINES 64
+#define WHEEL_SLOTS 512
+#define WHEEL_TICK_MS 10
+#define TIMEOUT_STATUS 124  // same as coreutils timeout(1)
+#define INPUT_BUF 4096
+#define LOOKAHEAD_MAX 32        // SHELL_LOOKAHEAD: lines looked at ahead, and overlapped at once
+#define ARENA_BLOCK 4096
+#define CAPTURE_BUF 65536
+#define MAX_NEST 16          // loops nested in one program
+#define MAX_BREAKS 32        // break statements per loop
+#define MAX_BRANCHES 32      // if/elif branches
+#define MAX_FUNCS 64
+#define MAX_CALL_DEPTH 256
+#define MAX_PATH_DIRS 64     // one bit each in a trie node
+#define LIST_MAX 100         // completions shown at once
+#define HISTORY_MAX (1 << 20)         // entries the search index keeps, a power of two
+#define HISTORY_BYTES (64 << 20)      // and at most this much text
+#define TRIGRAM_BUCKETS (1 << 16)
+#define SEARCH_BUDGET_NS 5000000      // one frame for each Ctrl-R keystroke
+#define SEARCH_SCAN 256               // matches looked at before ranking
+#define SEARCH_MATCHES 32
+#define SPAWN_MSG (128 * 1024)        // one spawn request, argv and environment packed
+#define MAX_BUILTINS 128
+#define BUILTIN_PURE 1               // safe to run in the shell for $(...)
+#define BUILTIN_SCOPED 2             // only changes variables or the cwd, or prints:
+                                     // a ( ) subshell may run it in the shell
+#define BUILTIN_DECLINE -1           // run() leaves the command to the real program
+#define FD_CACHE_MAX 64         // redirection fds kept open by fdcache
+#define MAX_WATCHES 1024
+#define DEBOUNCE_MS 100
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB \
+                    | IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF)
+#define COMPILE_INCOMPLETE 1 // ran out of input inside a compound command
+#define COMPILE_SYNTAX 2
+
+// IR opcodes
+#define OP_CMD 1             // run text as a command line
+#define OP_ASSIGN 2          // name = expanded text
+#define OP_JUMP 3
+#define OP_IF_FAIL 4         // jump when $? != 0
+#define OP_IF_OK 5           // jump when $? == 0
+#define OP_NOT 6
+#define OP_STATUS 7          // $? = target
+#define OP_LOOP_INIT 8       // fresh frame for slot, words from text for a for loop
+#define OP_FOR_NEXT 9        // name = next word, jump to target when out of words
+#define OP_LOOP_SAVE 10      // remember the body's status
+#define OP_LOOP_END 11       // $? = last body status, release the frame
+#define OP_DEFUN 12
+#define OP_RETURN 13
+#define OP_SUBSHELL 14       // ( body ), in the shell when it can be undone, else forked
+#define FILTER_BUF 65536
+#define RING_DEPTH 16             // most reads/writes in flight per copy
+#define RING_BUF (256 * 1024)     // one registered buffer
+#define RING_MIN (1024 * 1024)    // smaller files aren't worth a ring
 
+// epoll event tags: kind in the high 32 bits, table index in the low ones
+#define EV_TIMER 1
+#define EV_DEADLINE 2
+#define EV_JOB 3
+#define EV_INPUT 4
+#define EV_LISTEN 5
+#define EV_CLIENT 6
+#define EV_METRICS 7
+#define EV_FILTER 8
+#define EV_PATH 9
+#define EV_WATCH 10          // on-change: idx WATCH_INOTIFY, WATCH_TIMER or WATCH_CHILD
+#define WATCH_INOTIFY 0
+#define WATCH_TIMER 1
+#define WATCH_CHILD 2
+#define EV_LIBRARY 11        // a host thread handed the library thread a call
+#define EV_TAG(kind, idx) (((uint64_t)(kind) << 32) | (uint32_t)(idx))
+
+// A background job; its job number is the slot index + 1, pid 0 marks a free slot
 typedef struct {
     pid_t pid;
+    int pidfd;
     char command[MAX_LEN];
+    int status;
+    int done;
+    int timed_out;  // 0 = no, 1 = sent SIGTERM, 2 = sent SIGKILL
+    void *owner;    // session that started it, NULL in a plain shell
+    int disowned;   // its session closed, dropped once reaped
 } Job;
 
-struct var {
+// Frames between the shell and a worker agent: 1 type byte, 4 length bytes
+#define FRAME_LOAD 'L'   // worker -> shell on connect: running task count
+#define FRAME_CMD 'C'    // shell -> worker: argv, each word NUL-terminated
+#define FRAME_OUT 'O'    // worker -> shell: stdout bytes
+#define FRAME_ERR 'E'    // worker -> shell: stderr bytes
+#define FRAME_EXIT 'X'   // worker -> shell: exit status, last frame
+
+// Who collects the exit status of a process tracked by a Deadline
+#define DL_FOREGROUND 1  // wait_with_deadline()
+#define DL_JOB 2         // reap_job() through the job table
+#define DL_REAP 3        // nobody, run_events() reaps it on exit
+
+// In-process filter stages
+#define FILTER_HEAD 1
+#define FILTER_WC 2
+#define FILTER_GREP 3
+#define FILTER_CUT 4
+#define FILTER_CAT 5
+#define FILTER_REPLICA 6     // "@N cmd": N copies of cmd over chunks of the stream
+#define FILTER_INFLATE 7     // "<z file" in front of a program: inflates into its stdin
+#define FILTER_SORT 8
+#define GZ_BUF (256 * 1024)  // compressed bytes read at a time
+// The zlib constants "<z" uses, so building needs no zlib headers
+#define Z_OK 0
+#define Z_STREAM_END 1
+#define Z_NO_FLUSH 0
+#define Z_BUF_ERROR (-5)
+#define MAX_WBITS 15
+#define ZLIB_VERSION "1"     // inflateInit2_ only compares the major version
+#define SORT_BUDGET (256L * 1024 * 1024)  // input and line index held before a run is spilled
+#define SORT_MAX_THREADS 8
+#define SORT_PARALLEL_MIN 65536           // fewer lines are sorted on one thread
+#define SORT_RUN_BUF (1024 * 1024)        // read buffer per spilled run while merging
+#define MAX_REPLICAS 64
+#define REPLICA_CHUNK (1024 * 1024)   // input per copy, cut back to a line end
+#define WC_LINES 1
+#define WC_WORDS 2
+#define WC_BYTES 4
+#define GREP_INVERT 1
+#define GREP_COUNT 2
+#define SORT_NUMERIC 1
+#define SORT_REVERSE 2
+#define SORT_FOLD 4
+#define SORT_UNIQUE 8
+#define SORT_STABLE 16
+#define SORT_OWN 32          // the -k key has modifiers of its own
+
+// A pending deadline for a process group, kept in a hashed timer wheel
+typedef struct deadline {
+    pid_t pid;           // process group leader
+    int pidfd;
+    int in_use;
+    int armed;           // currently linked into the wheel
+    int mode;            // DL_FOREGROUND, DL_JOB or DL_REAP
+    int exited;
+    int timed_out;
+    int rounds;          // full wheel turns left before it fires
+    int slot;
+    long kill_after_ms;
+    struct deadline *next;
+} Deadline;
+
+// Variables live in a persistent hash trie: a change copies only the path
+// from the root down to its entry, and every older root stays valid. Saving
+// the variables for a scope is taking one more reference to the root.
+typedef struct VarNode VarNode;
+struct VarNode {
+    int refs;
+    int leaf;
+    uint64_t hash;       // leaf: one variable
+    char *name, *value;
+    int global;          // 0 for local, 1 for global
+    VarNode *next;       // leaf: another name with the same whole hash
+    uint32_t bitmap;     // inner: which of the 32 slots are in use
+    VarNode *kids[];     // inner: one per set bit, in slot order
+};
+
+// Environment entry to put back when a scope ends
+typedef struct EnvSave {
     char *name;
-    char *value;
-    int global;  // 0 for local, 1 for global
+    char *value;         // NULL when it wasn't set
+    struct EnvSave *next;
+} EnvSave;
+
+// What an in-process ( ) subshell restores when it ends
+typedef struct {
+    VarNode *vars;
+    int cwd_fd;
+    EnvSave *env;        // env_saved when the scope began
+} VarScope;
+
+// Variables a function call made local, with what they were before
+typedef struct LocalFrame {
+    VarNode *saved[MAX_LOCALS];
+    char *names[MAX_LOCALS];
+    int count;
+    struct LocalFrame *up;
+} LocalFrame;
+
+typedef struct {
+    VarNode **leaves;
+    int count, cap;
+} VarList;
+
+// An io_uring instance driven through the raw syscalls, with depth
+// registered buffers. Block k of a file always uses slot k % depth.
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    char *bufs;
+    int depth;
+    unsigned queued;            // SQEs written but not yet submitted
+    int inflight;               // submitted without a CQE yet
+    off_t base, end;            // byte range being read
+    long blocks;                // blocks in [base, end)
+    long blk[RING_DEPTH];       // block held by each slot
+    int got[RING_DEPTH];        // bytes read into the slot, -1 while reading
+    size_t done[RING_DEPTH];    // bytes of the slot written or consumed
+    long next;                  // read-ahead: next block handed to the reader
+} Ring;
+
+// zlib's z_stream, laid out as in zlib.h; its size is checked by
+// inflateInit2_
+typedef struct {
+    const unsigned char *next_in;
+    unsigned avail_in;
+    unsigned long total_in;
+    unsigned char *next_out;
+    unsigned avail_out;
+    unsigned long total_out;
+    const char *msg;
+    void *state;
+    void *(*zalloc)(void *opaque, unsigned items, unsigned size);
+    void (*zfree)(void *opaque, void *address);
+    void *opaque;
+    int data_type;
+    unsigned long adler;
+    unsigned long reserved;
+} z_stream;
+
+// Input side of "<z": gzip members are inflated as they are read, input
+// without the gzip magic passes through unchanged
+typedef struct {
+    z_stream zs;
+    int plain;
+    int eof;                    // nothing more to read from the file
+    int member_end;             // a gzip member ended, another may follow
+    unsigned char in[GZ_BUF];
+} GzReader;
+
+// zlib is opened on first use of "<z", so the shell doesn't link against it
+typedef struct {
+    int (*init)(z_stream *strm, int window_bits, const char *version, int stream_size);
+    int (*inflate)(z_stream *strm, int flush);
+    int (*reset)(z_stream *strm);
+    int (*end)(z_stream *strm);
+} Zlib;
+
+// A cat/head/wc/grep -F/cut/sort stage run on a thread inside the shell.
+// The thread owns in_fd and out_fd and closes both when it finishes.
+typedef struct {
+    int kind;
+    char **files;               // cat operands
+    Ring *ring;                 // read-ahead when in_fd is a large file
+    long count;                 // head: lines to copy
+    int flags;                  // WC_*, GREP_* or SORT_*
+    char *pattern;              // grep needle
+    size_t pattern_len;
+    char delim;                 // cut -d, tab by default; sort -t, 0 for blanks
+    int by_field;               // cut -f rather than -c
+    unsigned char pick[256];    // cut: selected fields/columns, 1-based
+    int pick_from;              // cut: "N-" selects N onwards, 0 if unused
+    char **argv;                // replica: the replicated command
+    int copies;                 // replica: copies running at once
+    int ordered;                // replica: merge in input order
+    int inflate;                // input came through "<z"
+    int front;                  // an inflate stage feeding a program through a pipe
+    GzReader *gz;
+    int key_from, key_to;       // sort -k: fields, 0 when unused or to the end
+    int key_flags;              // SORT_* used on the key
+    size_t budget;              // sort -S
+    int in_fd, out_fd;
+    int status;
+    int done;
+    pthread_t thread;
+} Filter;
+
+// One line being sorted and where its key is. prefix orders keys the way
+// the full comparison does as far as it goes; only equal prefixes need a
+// look at the text.
+typedef struct {
+    const char *s;
+    uint32_t len;
+    uint32_t key, key_len;
+    uint64_t prefix;
+} SortLine;
+
+// A sorted stream for the merge: part of the chunk in memory, or (fd >= 0)
+// a run spilled to a temporary file and read back a block at a time
+typedef struct {
+    SortLine *lines;
+    size_t next, count;
+    int fd;
+    char *buf;
+    size_t start, end, cap;
+    int eof;
+    SortLine cur;
+} SortSource;
+
+typedef struct {
+    Filter *f;
+    SortLine *lines;
+    size_t count;
+} SortPart;
+
+// sort -n operand: sign, integer digits without leading zeros, fraction
+// digits without trailing ones
+typedef struct {
+    int neg;
+    const char *ip, *fp;
+    size_t ilen, flen;
+} SortNum;
+
+// One running copy of a replicated stage and the chunk it was given
+typedef struct {
+    pid_t pid;                  // 0 for a free slot
+    int in, out;                // pipes to its stdin and from its stdout, -1 once closed
+    uint64_t seq;               // chunk number
+    char *input;
+    size_t in_len, in_off;
+    char *output;               // held until the chunk's turn comes
+    size_t out_len, out_cap;
+    int finished;               // output complete, waiting to be merged
+} Replica;
+
+// Buffered writer for filter output
+typedef struct {
+    int fd;
+    int failed;                 // the reader went away
+    size_t len;
+    char buf[FILTER_BUF];
+} OutBuf;
+
+// Bump allocator holding the words of one command line, freed in one go
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, size;
+    _Alignas(max_align_t) char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+// Words of a command line while it's being expanded. The word in progress
+// is always the last thing in the arena's head block.
+typedef struct {
+    Arena *arena;
+    char *word;          // NULL until something (even "") starts a word
+    size_t len;
+    int join;            // one word: no splitting, blanks are literal
+    char **argv;
+    int argc, cap;
+} Words;
+
+typedef struct Relay Relay;
+
+// Foreground children of the last pipeline, collected together. Filter
+// stages have pid 0 and no deadline; their argv lives in arena.
+typedef struct {
+    pid_t pids[MAX_STAGES];
+    Deadline *deadlines[MAX_STAGES];
+    Filter *filters[MAX_STAGES];
+    int count;
+    Relay *relay;        // pipestat's, NULL otherwise
+    Arena *arena;
+} Foreground;
+
+typedef struct {
+    char name[32];
+    char addr[108];      // unix socket path or host:port
+} RemoteWorker;
+
+// One pipe link relayed through the shell by pipestat
+typedef struct {
+    int in_fd;               // read end of the producer's pipe
+    int out_fd;              // write end of the consumer's pipe
+    int waiting_out;         // holding data the consumer hasn't taken yet
+    long long bytes;
+    long long wait_in_ns;    // relay idle because the producer had nothing
+    long long wait_out_ns;   // relay stalled because the consumer's pipe was full
+    long long queue_area;    // consumer queue depth integrated over time
+    char from[32], to[32];
+} PipeLink;
+
+// pipestat's links, relayed on a thread of their own so the shell's loop,
+// and other server sessions, keep going meanwhile
+struct Relay {
+    PipeLink links[MAX_STAGES];
+    int count;
+    int err_fd;              // the report goes to the stderr the pipeline had
+    pthread_t thread;
+    int done;                // set by the thread when the report is out
+};
+
+// One finished span; seq becomes index + 1 once the writer is done with it
+typedef struct {
+    uint64_t seq;
+    char name[12];
+    char detail[36];
+    long long start, dur;    // ns, CLOCK_MONOTONIC
+    int pid, job, stage;
+} TraceSpan;
+
+// Shared with forked children so they can record their own spans. Writers
+// claim slots by CAS on tail, only the shell advances head when flushing.
+typedef struct {
+    uint64_t head, tail, dropped;
+    TraceSpan spans[TRACE_CAP];
+} TraceBuffer;
+
+// Log-linear latency histogram in nanoseconds, fixed size so recording
+// never allocates
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total, sum_ns, max_ns;
+} Histogram;
+
+// Shared with forked children, which record their own fork-to-exec time
+typedef struct {
+    Histogram launch, wall, parse, queue;
+    uint64_t forks, execs, builtins, failures;
+} Metrics;
+
+// One recorded command line
+typedef struct {
+    long gap_us;             // time since the previous command arrived
+    int status;
+    char cwd[PATH_MAX];
+    char cmd[MAX_LEN];
+} ReplayEntry;
+
+// Shared by the replay drivers
+typedef struct {
+    Histogram latency;
+    uint64_t commands, mismatches, errors;
+} ReplayStats;
+
+// Executables on $PATH as a prefix trie. Children hang off a node as a
+// sorted sibling list; dirs has a bit for every PATH entry holding the
+// name that ends at the node, so a name shadowed in two directories
+// survives losing one of them.
+typedef struct {
+    char c;
+    int child, next;     // node indexes, 0 for none (node 0 is the root)
+    uint64_t dirs;
+} TrieNode;
+
+typedef struct {
+    TrieNode *nodes;
+    int count, cap;
+    char *path;          // the $PATH it was built from
+    char *dirs[MAX_PATH_DIRS];
+    int wd[MAX_PATH_DIRS];
+    int ndirs;
+    int inotify_fd;
+    int exact;           // every $PATH entry absolute and watched: lookups match execvp
+} PathTrie;
+
+typedef struct {
+    Arena arena;
+    char **items;
+    int count, cap;
+} Completions;
+
+// Entry ids of one trigram bucket, ascending; ids below first are evicted
+typedef struct {
+    uint32_t *ids;
+    uint32_t start, count, cap;
+} Posting;
+
+// Long-term history for search and up/down: a ring of lines indexed by
+// trigram. Ids only grow, id & (HISTORY_MAX - 1) is the ring slot.
+typedef struct {
+    char **lines;
+    uint32_t first, next;    // live ids
+    size_t bytes;
+    Posting *postings;
+    int fd;                  // $HISTFILE, appended to
+} HistoryIndex;
+
+typedef struct {
+    uint32_t id;
+    int score;
+} SearchHit;
+
+// Spawn helper protocol: the request is followed by argc argv strings and
+// envc environment strings, NUL terminated, then the program's path when
+// the shell resolved it. It carries stdin, stdout, stderr and the working
+// directory as SCM_RIGHTS. The reply carries the pidfd.
+typedef struct {
+    int argc, envc;
+    int new_pgrp;            // own process group, for timeout
+    long long fork_start;    // for the launch latency histogram
+    int resolved;            // a path to execve follows the environment
+} SpawnRequest;
+
+typedef struct {
+    pid_t pid;
+    int err;
+} SpawnReply;
+
+// Line being edited at the terminal
+typedef struct {
+    char *buf;
+    int len, pos, cap;
+    char *prompt;
+    uint32_t history_at; // id shown by up/down, hist.next for the new line
+    char *saved;         // the new line while browsing history
+} LineEdit;
+
+// Stable ABI for builtins loaded with "enable -f LIB NAME": LIB exports
+// "struct shell_builtin NAME_builtin". run gets the expanded words and
+// returns the exit status; it writes to stdout/stderr through stdio.
+#define SHELL_BUILTIN_ABI 1
+#define SHELL_BUILTIN_PURE 1     // only prints, may run inside $(...)
+struct shell_builtin {
+    int abi;                 // SHELL_BUILTIN_ABI
+    int (*run)(int argc, char **argv);
+    int flags;
+};
+
+typedef struct {
+    const char *name;
+    int (*run)(char* arglist[]);   // status, or BUILTIN_DECLINE
+    int flags;
+    struct shell_builtin *ext;     // loaded with enable -f
+    int core_flags;                // flags of the core one ext stands in for
+} Builtin;
+
+// State of a running on-change; run_events() only sets the flags
+typedef struct {
+    int inotify_fd, timer_fd, pidfd;
+    int wd[MAX_WATCHES];         // -1 while the path is gone
+    int parent_wd[MAX_WATCHES];  // meanwhile its directory's, for the name to come back
+    char *dirs[MAX_WATCHES];     // path of each watched file or directory
+    int nwatches;
+    int recursive;
+    int changed, fired, exited;  // set by run_events
+    long long last_change;       // newest event of the current burst
+    int events;                  // events in the burst
+} Watch;
+
+typedef struct Program Program;
+
+// One IR instruction. Command text stays unexpanded and is expanded each
+// time the instruction runs; only the control structure is parsed once.
+typedef struct {
+    int op;
+    int target;          // jump target, or the status for OP_STATUS
+    int slot;            // loop frame
+    int builtin;         // OP_CMD: plain builtin, skips the pipeline code
+    char *name;          // variable, function, or the command's first word
+    char *text;
+    Program *body;       // OP_DEFUN
+} Insn;
+
+struct Program {
+    Insn *code;
+    int count, cap;
+    int slots;           // deepest loop nesting
+    int error;           // COMPILE_*
+    int defined;         // owned by the function table
+    char *source;        // function body as written, NULL otherwise
+    char msg[64];
 };
 
-Job jobs[HISTORY_SIZE];
+// Runtime state of one active loop
+typedef struct {
+    Arena arena;
+    char **words;        // for loop word list
+    int next;
+    int status;          // last body status
+} LoopFrame;
+
+typedef struct {
+    char *name;
+    Program *body;
+} Function;
+
+typedef struct {
+    const char *p, *end;
+    Program *prog;
+    int depth;                          // enclosing loops
+    int loop_start[MAX_NEST];           // continue target
+    int breaks[MAX_NEST][MAX_BREAKS];   // jumps to patch at the loop end
+    int nbreaks[MAX_NEST];
+    int parens;                         // inside ( ): ) also ends a command
+} Compiler;
+
+// A redirection target the fd cache keeps open, found again by path and
+// checked against the inode it was opened on
+typedef struct {
+    char *path;
+    int how;             // O_RDONLY for <, O_APPEND for >>
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    long long used;      // LRU clock
+    long long stamp;     // pipeline that last took it
+    long long hits;
+} FdEntry;
+
+// Per-connection state in server mode, swapped into the globals while one
+// of its commands is being started
+typedef struct {
+    int fd;              // -1 for a free slot
+    int busy;            // waiting on pending before replying; fd not polled meanwhile
+    int exiting;         // ran exit, close after the reply
+    VarNode *vars;
+    char* history[HISTORY_SIZE];
+    int history_count;
+    int last_status;
+    int cwd_fd;
+    char **env;          // its exports, never set in the server's environment
+    Function functions[MAX_FUNCS];
+    int function_count;
+    long long started;   // when the pending command arrived
+    Foreground pending;
+    int state_fd;        // pending is a forked copy running a script: what it leaves behind, else -1
+} Session;
+
+// One shell.h call, handed to the library thread and carried out there
+typedef struct LibraryCall {
+    void (*run)(struct LibraryCall *call);
+    ShellSession *s;
+    const char *cmdline, *name, *value;
+    char *buf;           // shell_capture's, cap bytes; len gets the full size
+    size_t cap, len;
+    int status;
+    pid_t pid;
+    char *copy;          // shell_get_var's result
+    int out;             // capture memfd while the pipeline runs, else -1
+    int started;
+    int done;
+    struct LibraryCall *next;
+} LibraryCall;
+
+Job jobs[MAX_JOBS];
 int job_count = 0;
 
 char* history[HISTORY_SIZE];
 int history_count = 0;
 
-struct var var_table[MAXVARS];
-int var_count = 0;
+VarNode *vars = NULL;
+EnvSave *env_saved = NULL;   // undo log for exports inside scopes
+int scope_depth = 0;
+LocalFrame *local_frame = NULL;
+
+int last_status = 0;
+Foreground fg;
+
+int server_mode = 0;
+int session_exit = 0;
+int library_mode = 0;   // embedded through shell.h, exit must not end the host
+int library_wake_fd = -1;   // host threads post calls here; made before the fd tables split
+int listen_fd = -1;
+int saved_stdio[3];
+int server_cwd_fd = -1;
+Session sessions[MAX_SESSIONS];
+Session *current_session = NULL;   // the one swapped in, whose jobs jobs lists
+char **shell_env = NULL;           // its environment; NULL: the process's own
+
+FdEntry fd_cache[FD_CACHE_MAX];
+int fd_cache_count = 0;
+int fd_cache_limit = 0;        // 0: off, every redirection opens its file
+int fd_cache_inputs = 0;       // < may be cached: a foreground pipeline in a plain shell
+long long fd_cache_clock = 0, fd_cache_stamp = 0, fd_cache_misses = 0;
+
+TraceBuffer *trace_buf = NULL;
+FILE *trace_file = NULL;
+pid_t trace_owner = 0;
+int trace_written = 0;
+long long child_start = 0;   // set in a forked child, start of its exec span
+int current_stage = 0;
+int current_job = 0;         // job number of the pipeline being started, 0 in the foreground
+
+Metrics *metrics = NULL;
+char *metrics_path = NULL;
+int metrics_fd = -1;
+long long cmd_ready_ns = 0;  // when the current command line arrived
+long long fork_start = 0;    // inherited by the child for its launch latency
+
+FILE *record_file = NULL;
+long long record_last = 0;
+
+Function functions[MAX_FUNCS];
+int function_count = 0;
+char **pos_args = NULL;      // $1... of the running function
+int pos_count = 0;
+int func_return = 0;         // return ran, unwind to the call
+int expand_failed = 0;       // a bad ${...} or an unset ${NAME?}: the command doesn't run
+int call_depth = 0;
+
+PathTrie path_trie = { .inotify_fd = -1 };
+HistoryIndex hist = { .fd = -1 };
+int spawn_fd = -1;           // socket to the spawn helper, -1 to fork directly
+Zlib zlib;
+int zlib_state = 0;          // 1 loaded, -1 unavailable, 0 not tried yet
+Watch *active_watch = NULL;
+volatile sig_atomic_t watch_stop = 0;
+
+
+RemoteWorker workers[MAX_WORKERS];
+int worker_count = 0;
+int worker_running = 0;
+
+Deadline deadline_pool[MAX_DEADLINES];
+Deadline *wheel[WHEEL_SLOTS];
+int wheel_pos = 0;
+int wheel_count = 0;
+int timer_fd = -1;
+int loop_epfd = -1;
+int filter_event_fd = -1;   // filter threads post here when they finish
+int builtin_status = 0;     // set by a builtin that failed
+char *builtin_text = NULL;  // the running builtin's command as typed, NULL in $(...)
+
+// Redirection operators come out of tokenize() as these exact pointers, so a
+// quoted "<" stays an ordinary word
+char redir_in[] = "<", redir_out[] = ">", redir_append[] = ">>", redir_gz[] = "<z";
+
+char in_buf[INPUT_BUF];
+int in_start = 0, in_end = 0, in_eof = 0;
+int in_reads = 0;                  // bumped whenever in_buf is refilled
+int lookahead_depth = 0;           // 0: lines are only looked at when they run
+int ahead_reads = -1, ahead_pos = 0;   // how far into in_buf lookahead_prepare got
+int input_ready = 0;
 
 // Function Prototypes
-void sigchld_handler(int sig);
 void add_to_history(char* cmd);
-void add_job(pid_t pid, char* command);
+int add_job(pid_t pid, char* command);
 void remove_job(pid_t pid);
-void list_jobs();
+void reap_job(int slot);
+void notify_jobs();
+void list_jobs(int reap);
+int status_code(int status);
 void set_var(char *name, char *value, int global);
+long parse_duration(char *s);
+int parse_timeout_args(char* arglist[], long *timeout_ms, long *kill_after_ms);
+void event_loop_init();
+Deadline* add_deadline(pid_t pid, int pidfd, long timeout_ms, long kill_after_ms, int mode);
+void release_deadline(Deadline *d);
+void wheel_insert(Deadline *d, long ms);
+void wheel_remove(Deadline *d);
+void wheel_tick();
+void fire_deadline(Deadline *d);
+int run_events(int timeout_ms);
+int wait_with_deadline(Deadline *d, pid_t pid);
+int foreground_done(Foreground *f);
+Filter* filter_stage(char* arglist[]);
+int replica_count(char *word, int *ordered);
+int run_replicas(char **argv, int copies, int ordered, int in_fd, int out_fd);
+pid_t replica_start(Replica *r, char **argv);
+void replica_output(Replica *r, int out_fd, int direct, int *failed);
+int write_all(int fd, const char *buf, size_t len);
+int zlib_load();
+GzReader* gz_open(Filter *f);
+ssize_t gz_read(Filter *f, char *buf, size_t len);
+ssize_t gz_fail(Filter *f, const char *msg);
+void gz_close(GzReader *g);
+void run_inflate(Filter *f, OutBuf *o);
+ssize_t stage_read_raw(Filter *f, char *buf, size_t len);
+int parse_list(Filter *f, char *list);
+int start_filter(Filter *f, int in_fd, char *infile, char *outfile, int append, int out_pipe);
+void* filter_main(void *arg);
+void run_cat(Filter *f);
+void run_sort(Filter *f, OutBuf *o);
+int sort_collates_bytes();
+int parse_sort_key(Filter *f, char *spec);
+long parse_size(const char *text);
+void sort_key(Filter *f, SortLine *l);
+uint64_t sort_prefix(Filter *f, SortLine *l);
+int sort_compare(Filter *f, const SortLine *a, const SortLine *b, int last_resort);
+void sort_lines(Filter *f, SortLine *a, size_t n, SortLine *tmp);
+int compare_text(const char *a, size_t alen, const char *b, size_t blen, int fold);
+int compare_numeric(const char *a, size_t alen, const char *b, size_t blen);
+void parse_number(const char *p, size_t len, SortNum *n);
+void* sort_part(void *arg);
+int sort_parts(Filter *f, SortLine *lines, size_t count, SortSource *src);
+int sort_source_next(Filter *f, SortSource *s);
+int sort_less(Filter *f, SortSource *src, int a, int b);
+void sort_merge(Filter *f, SortSource *src, int n, OutBuf *o, int unique);
+int sort_tmpfile();
+int cp_builtin(char* arglist[]);
+ssize_t stage_read(Filter *f, char *buf, size_t len);
+int bulk_copy(int in_fd, int out_fd);
+int ring_open(Ring *r, int depth);
+void ring_close(Ring *r);
+void ring_prep(Ring *r, int fd, int slot, size_t skip, size_t len, off_t off, int flags, int write);
+int ring_reap(Ring *r, int *slot, int *write, int *res);
+void ring_read_block(Ring *r, int fd, long blk, int flags);
+int ring_copy(Ring *r, int in_fd, int out_fd, off_t out_off, int stream);
+void run_head(Filter *f, OutBuf *o);
+void run_wc(Filter *f, OutBuf *o);
+void run_lines(Filter *f, OutBuf *o);
+long grep_region(Filter *f, const char *p, size_t n, OutBuf *o);
+void cut_line(Filter *f, const char *p, size_t n, OutBuf *o);
+size_t count_newlines(const char *p, size_t n);
+const char* skip_lines(const char *p, size_t n, long *k);
+const char* find_substr(const char *h, size_t n, const char *s, size_t m);
+void out_write(OutBuf *o, const char *p, size_t n);
+void out_flush(OutBuf *o);
+int wait_foreground(Foreground *f);
+int run_server(char *path);
+void server_accept();
+void server_request(int idx);
+void server_collect();
+void session_enter(Session *sess);
+void session_leave(Session *sess);
+void session_close(Session *sess);
+void session_free(Session *sess);
+void session_fork(Session *sess, Program *prog);
+int script_in_process(Program *prog);
+void session_send_state(Session *sess, int fd);
+void session_take_state(Session *sess);
+void library_init();
+void* library_main(void *arg);
+void library_call(LibraryCall *call);
+void library_new(LibraryCall *call);
+void library_free(LibraryCall *call);
+void library_run(LibraryCall *call);
+void library_finish(LibraryCall *call);
+void library_spawn(LibraryCall *call);
+void library_get_var(LibraryCall *call);
+void library_set_var(LibraryCall *call);
+int run_client(char *path, char* cmds[], int count);
+int connect_session(char *path);
+int send_command(int fd, char *cmd, int fds[3]);
+void record_builtin(char* arglist[]);
+void record_command(char *cmd, char *cwd, long long arrived, int status);
+int run_replay(int argc, char* argv[]);
+void replay_driver(char *path, ReplayEntry *entries, int count, double speed, ReplayStats *stats);
+long long now_ns();
+void relay_pipeline(Relay *r);
+void start_relay(PipeLink links[], int count);
+void* relay_main(void *arg);
+double consumer_share(PipeLink *l);
+int trace_start(char *path);
+void trace_stop();
+void trace_span(const char *name, const char *detail, long long start, pid_t pid, int job, int stage);
+void trace_flush();
+void trace_builtin(char* arglist[]);
+void metrics_init();
+int hist_index(uint64_t v);
+uint64_t hist_value(int idx);
+void hist_record(Histogram *h, long long ns);
+uint64_t hist_percentile(Histogram *h, double p);
+void record_queue_wait();
+void stats_builtin(char* arglist[]);
+void print_hist(FILE *out, const char *name, Histogram *h);
+void metrics_export(int interval);
+char* metrics_file(const char *path);
+void write_metrics();
+int connect_addr(char *addr);
+int listen_addr(char *addr);
+int send_frame(int fd, int type, const void *buf, uint32_t len);
+int recv_frame(int fd, int *type, char *buf, uint32_t *len);
+int probe_worker(char *addr, int *load);
+void remote_execute(char* arglist[]);
+void worker_builtin(char* arglist[]);
+int run_worker(char *addr);
+void worker_serve(int conn);
+void wait_for_input(int fd);
 char* get_var(char *name);
 void list_vars();
+uint64_t var_hash(const char *name);
+VarNode* var_leaf(const char *name, const char *value, int global, uint64_t hash);
+VarNode* var_inner(uint32_t bitmap);
+VarNode* var_ref(VarNode *node);
+void var_unref(VarNode *node);
+VarNode* var_find(VarNode *node, const char *name);
+VarNode* var_insert(VarNode *node, VarNode *leaf, int shift);
+VarNode* var_remove(VarNode *node, const char *name, uint64_t hash, int shift);
+VarNode* var_chain_without(VarNode *chain, const char *name);
+void var_each(VarNode *node, void (*fn)(VarNode *leaf, void *arg), void *arg);
+void collect_var(VarNode *leaf, void *arg);
+int compare_vars(const void *a, const void *b);
+void unset_var(char *name);
+void save_env(char *name);
+char* env_get(char *name);
+void env_set(char *name, char *value);
+char** env_list();
+char** env_copy(char **env);
+void env_free(char **env);
+char* env_which(char *name, char *buf, size_t len);
+int scope_enter(VarScope *scope);
+void scope_leave(VarScope *scope);
+void run_subshell(Program *body);
+int subshell_in_process(Program *prog);
+int builtin_local(char* arglist[]);
+void restore_locals(LocalFrame *frame);
 int handle_builtin(char* arglist[]);
+int builtin_set(char* arglist[]);
+int builtin_export(char* arglist[]);
+int builtin_cd(char* arglist[]);
+int builtin_exit(char* arglist[]);
+int builtin_jobs(char* arglist[]);
+int builtin_worker(char* arglist[]);
+int builtin_trace(char* arglist[]);
+int builtin_stats(char* arglist[]);
+int builtin_record(char* arglist[]);
+int builtin_true(char* arglist[]);
+int builtin_false(char* arglist[]);
+int builtin_echo(char* arglist[]);
+int builtin_basename(char* arglist[]);
+int builtin_cp(char* arglist[]);
+int builtin_enable(char* arglist[]);
+void builtin_table_build();
+uint32_t builtin_hash(const char *name, uint32_t seed);
+Builtin* find_builtin(char *name);
+int load_builtin(char *path, char *name);
+int builtin_on_change(char* arglist[]);
+int watch_add(Watch *w, char *path);
+void watch_read(Watch *w);
+void watch_lost(Watch *w, int k);
+char* text_after_dashes(const char *line);
+pid_t watch_start(char *cmd, long long changed_at, int run, int events);
+void watch_interrupt(int sig);
+void subshell_init();
 char* read_cmd(char* prompt, FILE* fp);
-char** tokenize(char* cmdline);
+char** tokenize(char* cmdline, Arena *arena);
+char* expand_word(char *text, Arena *arena);
+int expansion_failed();
+void lex(Words *w, const char *p, const char *end, int quote);
+const char* expand_param(Words *w, const char *p, const char *end, int quoted);
+void emit_value(Words *w, const char *v, size_t len, int quoted);
+void word_add(Words *w, const char *p, size_t n);
+void word_end(Words *w);
+void word_push(Words *w, char *word);
+char* next_stage(char **rest);
+const char* find_unquoted(const char *p, const char *end, const char *set);
+void substitute(Words *w, const char *body, size_t len, int quoted);
+char* command_output(char *body, size_t *len, int *status);
+int pure_builtin(char *name);
+char* read_all(int fd, size_t *len);
+void* arena_alloc(Arena *a, size_t n);
+void arena_free(Arena *a);
 int execute(char* arglist[], int background);
 int handle_redirection_and_pipes(char* cmdline);
 void parse_and_execute(char* cmdline);
+int is_script(char *text);
+int script_incomplete(char *text);
+Program* compile(const char *text);
+void free_program(Program *prog);
+int compile_list(Compiler *c, const char *stops[]);
+void compile_andor(Compiler *c);
+void compile_command(Compiler *c);
+void compile_if(Compiler *c);
+void compile_while(Compiler *c, int until);
+void compile_for(Compiler *c);
+void compile_function(Compiler *c, char *name);
+void compile_subshell(Compiler *c);
+void compile_error(Compiler *c, int error, const char *msg);
+void enter_loop(Compiler *c, int start);
+void leave_loop(Compiler *c, int exit_jump);
+int emit(Compiler *c, int op, int slot, char *name, char *text);
+int keyword(Compiler *c, const char *kw, int consume);
+void skip_space(Compiler *c, int separators);
+char* command_text(Compiler *c);
+int run_program(Program *prog);
+void run_command_insn(Insn *in);
+Function* find_function(char *name);
+void define_function(char *name, Program *body);
+void call_function(Function *fn, char **argv);
+int is_builtin_name(char *name);
+int test_builtin(char* arglist[]);
+char* edit_line(char *prompt, int fd);
+int next_key(int fd);
+void edit_refresh(LineEdit *e);
+void edit_insert(LineEdit *e, const char *s, int n);
+void edit_delete(LineEdit *e, int from, int to);
+void edit_history(LineEdit *e, int dir);
+void edit_complete(LineEdit *e);
+void list_completions(LineEdit *e, Completions *c);
+int compare_strings(const void *a, const void *b);
+void add_completion(Completions *c, const char *s, int n, const char *suffix);
+void complete_commands(Completions *c, const char *prefix, int n);
+void complete_files(Completions *c, const char *word, int n);
+void complete_vars(Completions *c, const char *prefix, int n);
+void path_trie_build();
+void path_trie_free();
+void path_trie_update();
+void path_trie_check(int dir, const char *name);
+void trie_set(PathTrie *t, const char *name, int dir, int on);
+int trie_find(PathTrie *t, const char *s, int n);
+void trie_collect(PathTrie *t, int node, char *name, int len, Completions *c);
+void trie_clear_dir(PathTrie *t, int dir);
+char* path_resolve(char *name, char *buf, size_t len, int build);
+void lookahead_prepare();
+void lookahead_line(char *line);
+int overlap_ok(char *line);
+void run_overlapped(char *first);
+void overlap_output(int from, int to);
+int edit_search(LineEdit *e, int fd);
+void hist_load(char *path);
+void hist_add(char *line);
+int hist_search(char *query, SearchHit *hits, int max);
+int hist_match(char *line, char *query, int *score);
+uint32_t trigram_bucket(const char *p);
+int posting_has(Posting *list, uint32_t id);
+void spawn_helper_start();
+void spawn_helper_main(int sock);
+void spawn_helper_request(int sock, char *buf, ssize_t len, int *fds, int nfds);
+pid_t spawn_stage(char **arglist, int in_fd, char *infile, char *outfile, int append, int out_fd, int new_pgrp, int *pidfd);
+int redir_open(char *path, int how, int *cached);
+void fd_cache_drop(int i);
+void fd_cache_trim(int keep);
+int builtin_fdcache(char* arglist[]);
+pid_t zygote_spawn(char **argv, int fds[3], int new_pgrp, int *pidfd);
+
+// Every builtin; find_builtin() reaches them through a perfect hash
+// rebuilt whenever the list changes
+Builtin builtins[MAX_BUILTINS] = {
+    { "set", builtin_set, BUILTIN_PURE | BUILTIN_SCOPED },
+    { "export", builtin_export, BUILTIN_SCOPED },
+    { "cd", builtin_cd, BUILTIN_SCOPED },
+    { "exit", builtin_exit, 0 },
+    { "jobs", builtin_jobs, BUILTIN_PURE },
+    { "worker", builtin_worker, 0 },
+    { "trace", builtin_trace, 0 },
+    { "stats", builtin_stats, 0 },
+    { "record", builtin_record, 0 },
+    { "echo", builtin_echo, BUILTIN_PURE | BUILTIN_SCOPED },
+    { "basename", builtin_basename, BUILTIN_PURE | BUILTIN_SCOPED },
+    { "dirname", builtin_basename, BUILTIN_PURE | BUILTIN_SCOPED },
+    { "cp", builtin_cp, 0 },
+    { "true", builtin_true, BUILTIN_PURE | BUILTIN_SCOPED },
+    { ":", builtin_true, BUILTIN_PURE | BUILTIN_SCOPED },
+    { "false", builtin_false, BUILTIN_PURE | BUILTIN_SCOPED },
+    { "test", test_builtin, BUILTIN_PURE | BUILTIN_SCOPED },
+    { "[", test_builtin, BUILTIN_PURE | BUILTIN_SCOPED },
+    { "enable", builtin_enable, 0 },
+    { "on-change", builtin_on_change, 0 },
+    { "local", builtin_local, BUILTIN_SCOPED },
+    { "fdcache", builtin_fdcache, 0 },
+};
+int builtin_count = 22;
+int *builtin_slots = NULL;   // hash slot -> index into builtins, -1 if empty
+uint32_t builtin_seed, builtin_mask;
 
-int main() {
+#ifndef SHELL_LIBRARY
+int main(int argc, char* argv[]) {
     for (int i = 0; i < HISTORY_SIZE; i++) {
         history[i] = NULL;
+    }
+    for (int i = 0; i < MAX_JOBS; i++) {
         jobs[i].pid = 0;
+        jobs[i].pidfd = -1;
     }
 
-    signal(SIGCHLD, sigchld_handler);
+    event_loop_init();
+    metrics_init();
+    // Forked while the shell is still small; later launches go through it
+    if ((argc < 2 || strcmp(argv[1], "--server") == 0) && getenv("SHELL_NO_SPAWN_HELPER") == NULL) {
+        spawn_helper_start();
+    }
+    if (getenv("SHELL_METRICS_FILE") != NULL) {
+        metrics_path = metrics_file(getenv("SHELL_METRICS_FILE"));
+        metrics_export(METRICS_INTERVAL);
+    }
+    if (getenv("SHELL_TRACE") != NULL) trace_start(getenv("SHELL_TRACE"));
+    if (getenv("SHELL_FD_CACHE") != NULL) {
+        fd_cache_limit = atoi(getenv("SHELL_FD_CACHE"));
+        if (fd_cache_limit < 0) fd_cache_limit = 0;
+        if (fd_cache_limit > FD_CACHE_MAX) fd_cache_limit = FD_CACHE_MAX;
+    }
+    atexit(trace_stop);
+
+    if (argc >= 3 && strcmp(argv[1], "--server") == 0) {
+        return run_server(argv[2]);
+    } else if (argc >= 3 && strcmp(argv[1], "--client") == 0) {
+        return run_client(argv[2], argv + 3, argc - 3);
+    } else if (argc >= 3 && strcmp(argv[1], "--worker") == 0) {
+        return run_worker(argv[2]);
+    } else if (argc >= 3 && strcmp(argv[1], "--replay") == 0) {
+        return run_replay(argc, argv);
+    }
+
+    if (getenv("HISTFILE") != NULL) hist_load(getenv("HISTFILE"));
+    if (getenv("SHELL_LOOKAHEAD") != NULL && !isatty(STDIN_FILENO)) {
+        lookahead_depth = atoi(getenv("SHELL_LOOKAHEAD"));
+        if (lookahead_depth < 0) lookahead_depth = 0;
+        if (lookahead_depth > LOOKAHEAD_MAX) lookahead_depth = LOOKAHEAD_MAX;
+    }
 
     char *cmdline;
+    long long t = now_ns();
     while ((cmdline = read_cmd(PROMPT, stdin)) != NULL) {
-        parse_and_execute(cmdline);
+        // An open if/while/for/function keeps reading lines
+        char *more;
+        while (script_incomplete(cmdline) && (more = read_cmd("> ", stdin)) != NULL) {
+            size_t n = strlen(cmdline);
+            cmdline = realloc(cmdline, n + strlen(more) + 2);
+            cmdline[n] = '\n';
+            strcpy(cmdline + n + 1, more);
+            free(more);
+        }
+        trace_span("read", "", t, getpid(), current_job, -1);
+        cmd_ready_ns = now_ns();
+        long long arrived = cmd_ready_ns;
+        char *recorded = NULL, cwd[PATH_MAX] = "";
+        if (record_file != NULL) {
+            recorded = strdup(cmdline);
+            if (getcwd(cwd, sizeof(cwd)) == NULL) cwd[0] = '\0';
+        }
+        if (lookahead_depth > 0 && record_file == NULL && overlap_ok(cmdline)) run_overlapped(cmdline);
+        else parse_and_execute(cmdline);
+        if (recorded != NULL) {
+            record_command(recorded, cwd, arrived, last_status);
+            free(recorded);
+        }
         free(cmdline);
+        trace_flush();
+        t = now_ns();
     }
     printf("\n");
     return 0;
 }
+#endif
 
 void parse_and_execute(char* cmdline) {
     add_to_history(cmdline);
+    // Without lookahead an "overlap" line just runs in its turn
+    if (strncmp(cmdline, "overlap ", 8) == 0) cmdline += 8;
+
+    if (is_script(cmdline)) {
+        Program *prog = compile(cmdline);
+        if (prog->error == COMPILE_INCOMPLETE) {
+            fprintf(stderr, "syntax error: unexpected end of input\n");
+            last_status = 2;
+        } else if (prog->error) {
+            fprintf(stderr, "syntax error: %s\n", prog->msg);
+            last_status = 2;
+        } else if (current_session != NULL && !script_in_process(prog)) {
+            session_fork(current_session, prog);
+        } else {
+            run_program(prog);
+            func_return = 0;
+        }
+        free_program(prog);
+        return;
+    }
 
-    char *equals_sign = strchr(cmdline, '=');
-    if (equals_sign) {
-        *equals_sign = '\0';
-        char *name = cmdline;
-        char *value = equals_sign + 1;
-        set_var(name, value, 0);  // Local variable by default
+    // NAME=value is an assignment, anything else a command
+    size_t name_len = 0;
+    while (cmdline[name_len] == '_' || isalnum((unsigned char)cmdline[name_len])) name_len++;
+    if (name_len > 0 && !isdigit((unsigned char)cmdline[0]) && cmdline[name_len] == '=') {
+        Arena arena = { NULL };
+        cmdline[name_len] = '\0';
+        last_status = 0;
+        char *value = expand_word(cmdline + name_len + 1, &arena);
+        if (!expansion_failed()) set_var(cmdline, value, 0);  // Local variable by default
+        arena_free(&arena);
     } else {
         if (handle_redirection_and_pipes(cmdline) != 0) {
             printf("Error executing command\n");
@@ -83,233 +1224,6888 @@ void parse_and_execute(char* cmdline) {
     }
 }
 
-void sigchld_handler(int sig) {
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+// Lines that need the compiler: compound commands, function definitions
+// and calls, and lists joined by ; && || or newlines
+int is_script(char *text) {
+    static const char *words[] = { "if", "while", "until", "for", "{", "!", "function",
+                                   "break", "continue", "return", NULL };
+    const char *p = text + strspn(text, " \t");
+    if (*p == '(') return 1;
+    for (int i = 0; words[i] != NULL; i++) {
+        size_t n = strlen(words[i]);
+        if (strncmp(p, words[i], n) == 0 && (p[n] == '\0' || strchr(" \t\n;", p[n]) != NULL)) return 1;
+    }
+    const char *q = p;
+    while (*q == '_' || isalnum((unsigned char)*q)) q++;
+    if (q > p && q[strspn(q, " \t")] == '(') return 1;
+    if (function_count > 0 && q > p) {
+        char name[64];
+        snprintf(name, sizeof(name), "%.*s", (int)(q - p), p);
+        if ((*q == '\0' || *q == ' ' || *q == '\t') && find_function(name) != NULL) return 1;
+    }
+    const char *end = text + strlen(text);
+    for (q = find_unquoted(text, end, ";\n&|"); q < end; q = find_unquoted(q + 1, end, ";\n&|")) {
+        if (*q == ';' || *q == '\n' || (q + 1 < end && q[1] == *q)) return 1;
+    }
+    return 0;
 }
 
-char* read_cmd(char* prompt, FILE* fp) {
-    printf("%s", prompt);
-    int c, pos = 0;
-    char* cmdline = (char*)malloc(sizeof(char) * MAX_LEN);
-    while ((c = getc(fp)) != EOF) {
-        if (c == '\n') break;
-        cmdline[pos++] = c;
-    }
-    if (c == EOF && pos == 0) return NULL;
-    cmdline[pos] = '\0';
-    return cmdline;
+int script_incomplete(char *text) {
+    if (!is_script(text)) return 0;
+    Program *prog = compile(text);
+    int incomplete = prog->error == COMPILE_INCOMPLETE;
+    free_program(prog);
+    return incomplete;
 }
 
-char** tokenize(char* cmdline) {
-    char** arglist = (char**)malloc(sizeof(char*) * (MAXARGS + 1));
-    for (int j = 0; j < MAXARGS + 1; j++) {
-        arglist[j] = (char*)malloc(sizeof(char) * 30);
-        bzero(arglist[j], 30);
-    }
-    int argnum = 0;
-    char* cp = cmdline;
-    char* start;
-    int len;
-    while (*cp != '\0') {
-        while (*cp == ' ' || *cp == '\t') cp++;
-        start = cp;
-        len = 1;
-        while (*++cp != '\0' && !(*cp == ' ' || *cp == '\t')) len++;
-        strncpy(arglist[argnum], start, len);
-        arglist[argnum][len] = '\0';
-        argnum++;
+// Parses text into one flat instruction array. Function bodies become
+// programs of their own, hung off OP_DEFUN.
+Program* compile(const char *text) {
+    Compiler c = { .p = text, .end = text + strlen(text) };
+    c.prog = calloc(1, sizeof(Program));
+    compile_list(&c, NULL);
+    return c.prog;
+}
+
+// Function bodies that were defined belong to the function table
+void free_program(Program *prog) {
+    for (int i = 0; i < prog->count; i++) {
+        if (prog->code[i].body != NULL && !prog->code[i].body->defined) free_program(prog->code[i].body);
+        free(prog->code[i].name);
+        free(prog->code[i].text);
     }
-    arglist[argnum] = NULL;
-    return arglist;
+    free(prog->code);
+    free(prog->source);
+    free(prog);
 }
 
-void add_to_history(char* cmd) {
-    if (history_count == HISTORY_SIZE) {
-        free(history[0]);
-        for (int i = 1; i < HISTORY_SIZE; i++) {
-            history[i - 1] = history[i];
+// Compiles commands until one of stops (left unconsumed) starts a command.
+// Returns its index, or -1 at the end of input or on an error.
+int compile_list(Compiler *c, const char *stops[]) {
+    int commands = 0;
+    while (!c->prog->error) {
+        skip_space(c, 1);
+        if (c->p >= c->end) {
+            if (stops != NULL) c->prog->error = COMPILE_INCOMPLETE;
+            return -1;
         }
-        history_count--;
+        for (int i = 0; stops != NULL && stops[i] != NULL; i++) {
+            if (!keyword(c, stops[i], 0)) continue;
+            if (commands > 0) return i;
+            char msg[48];
+            snprintf(msg, sizeof(msg), "unexpected '%s'", stops[i]);
+            compile_error(c, COMPILE_SYNTAX, msg);
+            return -1;
+        }
+        compile_andor(c);
+        commands++;
     }
-    history[history_count++] = strdup(cmd);
+    return -1;
 }
 
-void add_job(pid_t pid, char* command) {
-    if (job_count < HISTORY_SIZE) {
-        jobs[job_count].pid = pid;
-        strncpy(jobs[job_count].command, command, MAX_LEN);
-        job_count++;
+// cmd && cmd || cmd, left to right
+void compile_andor(Compiler *c) {
+    compile_command(c);
+    while (!c->prog->error) {
+        skip_space(c, 0);
+        if (c->end - c->p < 2 || c->p[0] != c->p[1] || (c->p[0] != '&' && c->p[0] != '|')) return;
+        int jump = emit(c, c->p[0] == '&' ? OP_IF_FAIL : OP_IF_OK, 0, NULL, NULL);
+        c->p += 2;
+        skip_space(c, 1);
+        if (c->p >= c->end) {
+            c->prog->error = COMPILE_INCOMPLETE;
+            return;
+        }
+        compile_command(c);
+        c->prog->code[jump].target = c->prog->count;
     }
 }
 
-void remove_job(pid_t pid) {
-    for (int i = 0; i < job_count; i++) {
-        if (jobs[i].pid == pid) {
-            for (int j = i; j < job_count - 1; j++) {
-                jobs[j] = jobs[j + 1];
+void compile_command(Compiler *c) {
+    static const char *reserved[] = { "then", "do", "done", "fi", "else", "elif", "}", NULL };
+    const char *brace[] = { "}", NULL };
+    skip_space(c, 0);
+    if (keyword(c, "if", 1)) {
+        compile_if(c);
+    } else if (keyword(c, "while", 1)) {
+        compile_while(c, 0);
+    } else if (keyword(c, "until", 1)) {
+        compile_while(c, 1);
+    } else if (keyword(c, "for", 1)) {
+        compile_for(c);
+    } else if (keyword(c, "{", 1)) {
+        if (compile_list(c, brace) == 0) keyword(c, "}", 1);
+    } else if (c->p < c->end && *c->p == '(') {
+        c->p++;
+        compile_subshell(c);
+    } else if (keyword(c, "!", 1)) {
+        compile_command(c);
+        emit(c, OP_NOT, 0, NULL, NULL);
+    } else if (keyword(c, "break", 1) || keyword(c, "continue", 1)) {
+        int is_break = c->p[-1] == 'k';
+        free(command_text(c));
+        if (c->depth == 0) return;
+        int jump = emit(c, OP_JUMP, 0, NULL, NULL);
+        int loop = c->depth - 1;
+        if (!is_break) c->prog->code[jump].target = c->loop_start[loop];
+        else if (c->nbreaks[loop] < MAX_BREAKS) c->breaks[loop][c->nbreaks[loop]++] = jump;
+        else compile_error(c, COMPILE_SYNTAX, "too many breaks in one loop");
+    } else if (keyword(c, "return", 1)) {
+        emit(c, OP_RETURN, 0, NULL, command_text(c));
+    } else if (keyword(c, "function", 1)) {
+        skip_space(c, 0);
+        const char *start = c->p;
+        while (c->p < c->end && (*c->p == '_' || isalnum((unsigned char)*c->p))) c->p++;
+        char *name = strndup(start, c->p - start);
+        skip_space(c, 0);
+        if (c->end - c->p >= 2 && c->p[0] == '(' && c->p[1] == ')') c->p += 2;
+        compile_function(c, name);
+    } else {
+        for (int i = 0; reserved[i] != NULL; i++) {
+            if (keyword(c, reserved[i], 0)) {
+                char msg[48];
+                snprintf(msg, sizeof(msg), "unexpected '%s'", reserved[i]);
+                compile_error(c, COMPILE_SYNTAX, msg);
+                return;
+            }
+        }
+        // name() starts a function definition
+        const char *q = c->p;
+        while (q < c->end && (*q == '_' || isalnum((unsigned char)*q))) q++;
+        const char *r = q;
+        while (r < c->end && (*r == ' ' || *r == '\t')) r++;
+        if (q > c->p && r < c->end && *r == '(') {
+            r++;
+            while (r < c->end && (*r == ' ' || *r == '\t')) r++;
+            if (r < c->end && *r == ')') {
+                char *name = strndup(c->p, q - c->p);
+                c->p = r + 1;
+                compile_function(c, name);
+                return;
             }
-            job_count--;
-            break;
         }
-    }
-}
 
-void list_jobs() {
-    for (int i = 0; i < job_count; i++) {
-        printf("[%d] %d %s\n", i + 1, jobs[i].pid, jobs[i].command);
+        const char *start = c->p;
+        char *text = command_text(c);
+        if (text[0] == '\0') {
+            free(text);
+            if (c->p == start) compile_error(c, COMPILE_SYNTAX, "missing command");
+            return;
+        }
+        size_t name_len = 0;
+        while (text[name_len] == '_' || isalnum((unsigned char)text[name_len])) name_len++;
+        if (name_len > 0 && !isdigit((unsigned char)text[0]) && text[name_len] == '=') {
+            emit(c, OP_ASSIGN, 0, strndup(text, name_len), strdup(text + name_len + 1));
+            free(text);
+            return;
+        }
+        // A literal first word is looked up once here: functions at run
+        // time, builtins now
+        size_t word_len = strcspn(text, " \t");
+        char *word = NULL;
+        if (strcspn(text, "$`'\"\\\\<>|&") >= word_len) word = strndup(text, word_len);
+        int at = emit(c, OP_CMD, 0, word, text);
+        c->prog->code[at].builtin = word != NULL && is_builtin_name(word)
+            && *find_unquoted(text, text + strlen(text), "|<>&") == '\0';
     }
 }
 
-void set_var(char *name, char *value, int global) {
-    for (int i = 0; i < var_count; i++) {
-        if (strcmp(var_table[i].name, name) == 0) {
-            free(var_table[i].value);
-            var_table[i].value = strdup(value);
-            var_table[i].global = global;
-            if (global) setenv(name, value, 1);
+// if list; then list; [elif list; then list;]... [else list;] fi
+void compile_if(Compiler *c) {
+    const char *then[] = { "then", NULL }, *branch[] = { "elif", "else", "fi", NULL }, *fi[] = { "fi", NULL };
+    int ends[MAX_BRANCHES], nends = 0;
+    while (1) {
+        if (compile_list(c, then) != 0) return;
+        keyword(c, "then", 1);
+        int skip = emit(c, OP_IF_FAIL, 0, NULL, NULL);
+        int r = compile_list(c, branch);
+        if (r < 0) return;
+        if (nends == MAX_BRANCHES) {
+            compile_error(c, COMPILE_SYNTAX, "too many elif branches");
             return;
         }
+        ends[nends++] = emit(c, OP_JUMP, 0, NULL, NULL);
+        c->prog->code[skip].target = c->prog->count;
+        if (r == 0) {
+            keyword(c, "elif", 1);
+            continue;
+        }
+        if (r == 1) {
+            keyword(c, "else", 1);
+            if (compile_list(c, fi) != 0) return;
+        } else {
+            emit(c, OP_STATUS, 0, NULL, NULL);  // no branch taken
+        }
+        keyword(c, "fi", 1);
+        break;
     }
-    if (var_count < MAXVARS) {
-        var_table[var_count].name = strdup(name);
-        var_table[var_count].value = strdup(value);
-        var_table[var_count].global = global;
-        if (global) setenv(name, value, 1);
-        var_count++;
-    } else {
-        printf("Variable limit reached.\n");
-    }
+    for (int i = 0; i < nends; i++) c->prog->code[ends[i]].target = c->prog->count;
 }
 
-char* get_var(char *name) {
-    for (int i = 0; i < var_count; i++) {
-        if (strcmp(var_table[i].name, name) == 0) {
-            return var_table[i].value;
-        }
+// while/until list; do list; done
+void compile_while(Compiler *c, int until) {
+    const char *do_[] = { "do", NULL }, *done[] = { "done", NULL };
+    if (c->depth == MAX_NEST) {
+        compile_error(c, COMPILE_SYNTAX, "loops nested too deeply");
+        return;
     }
-    return getenv(name);
+    int slot = c->depth;
+    emit(c, OP_LOOP_INIT, slot, NULL, NULL);
+    int top = c->prog->count;
+    if (compile_list(c, do_) != 0) return;
+    keyword(c, "do", 1);
+    int exit_jump = emit(c, until ? OP_IF_OK : OP_IF_FAIL, 0, NULL, NULL);
+    enter_loop(c, top);
+    if (compile_list(c, done) != 0) return;
+    keyword(c, "done", 1);
+    emit(c, OP_LOOP_SAVE, slot, NULL, NULL);
+    int back = emit(c, OP_JUMP, 0, NULL, NULL);
+    c->prog->code[back].target = top;
+    leave_loop(c, exit_jump);
 }
 
-void list_vars() {
-    printf("Local and environment variables:\n");
-    for (int i = 0; i < var_count; i++) {
-        printf("%s=%s (local)\n", var_table[i].name, var_table[i].value);
+// for NAME [in words]; do list; done
+void compile_for(Compiler *c) {
+    const char *done[] = { "done", NULL };
+    skip_space(c, 0);
+    const char *start = c->p;
+    while (c->p < c->end && (*c->p == '_' || isalnum((unsigned char)*c->p))) c->p++;
+    if (c->p == start) {
+        compile_error(c, COMPILE_SYNTAX, "for needs a variable name");
+        return;
     }
+    if (c->depth == MAX_NEST) {
+        compile_error(c, COMPILE_SYNTAX, "loops nested too deeply");
+        return;
+    }
+    char *name = strndup(start, c->p - start);
+    skip_space(c, 0);
+    char *words = keyword(c, "in", 1) ? command_text(c) : strdup("\"$@\"");
+    skip_space(c, 1);
+    if (!keyword(c, "do", 1)) {
+        compile_error(c, c->p >= c->end ? COMPILE_INCOMPLETE : COMPILE_SYNTAX, "expected 'do'");
+        free(name);
+        free(words);
+        return;
+    }
+    int slot = c->depth;
+    emit(c, OP_LOOP_INIT, slot, NULL, words);
+    int top = emit(c, OP_FOR_NEXT, slot, name, NULL);
+    enter_loop(c, top);
+    if (compile_list(c, done) != 0) return;
+    keyword(c, "done", 1);
+    emit(c, OP_LOOP_SAVE, slot, NULL, NULL);
+    int back = emit(c, OP_JUMP, 0, NULL, NULL);
+    c->prog->code[back].target = top;
+    leave_loop(c, top);
 }
 
-int handle_builtin(char* arglist[]) {
-    if (strcmp(arglist[0], "set") == 0) {
-        list_vars();
-        return 0;
-    } else if (strcmp(arglist[0], "export") == 0) {
-        if (arglist[1] != NULL) {
-            set_var(arglist[1], get_var(arglist[1]), 1);
-        } else {
-            printf("Usage: export <variable>\n");
-        }
-        return 0;
-    } else if (strcmp(arglist[0], "cd") == 0) {
-        if (arglist[1] != NULL) {
-            if (chdir(arglist[1]) != 0) perror("cd failed");
-        } else printf("cd: missing argument\n");
-        return 0;
-    } else if (strcmp(arglist[0], "exit") == 0) {
-        exit(0);
-    } else if (strcmp(arglist[0], "jobs") == 0) {
-        list_jobs();
-        return 0;
+// The body (normally a { } group) is compiled into its own program
+void compile_function(Compiler *c, char *name) {
+    Compiler sub = { .p = c->p, .end = c->end };
+    sub.prog = calloc(1, sizeof(Program));
+    skip_space(&sub, 1);
+    const char *body = sub.p;
+    if (sub.p >= sub.end) sub.prog->error = COMPILE_INCOMPLETE;
+    else compile_command(&sub);
+    c->p = sub.p;
+    sub.prog->source = strndup(body, sub.p - body);
+    if (sub.prog->error) {
+        c->prog->error = sub.prog->error;
+        memcpy(c->prog->msg, sub.prog->msg, sizeof(c->prog->msg));
+        free(name);
+        free_program(sub.prog);
+        return;
     }
-    return 1;
+    int at = emit(c, OP_DEFUN, 0, name, NULL);
+    c->prog->code[at].body = sub.prog;
 }
 
-int handle_redirection_and_pipes(char* cmdline) {
-    int pipefd[2];
-    pid_t pid;
-    int in_fd = 0;
-    char *command = strtok(cmdline, "|");
-
-    while (command != NULL) {
-        char *infile = NULL, *outfile = NULL;
-        char **arglist = tokenize(command);
-        
-        int background = 0;
-        int last_arg = 0;
-        while (arglist[last_arg] != NULL) last_arg++;
-        if (last_arg > 0 && strcmp(arglist[last_arg - 1], "&") == 0) {
-            background = 1;
-            free(arglist[last_arg - 1]);
-            arglist[last_arg - 1] = NULL;
-        }
-
-        for (int i = 0; arglist[i] != NULL; i++) {
-            if (strcmp(arglist[i], "<") == 0) {
-                infile = arglist[i + 1];
-                arglist[i] = NULL;
-            } else if (strcmp(arglist[i], ">") == 0) {
-                outfile = arglist[i + 1];
-                arglist[i] = NULL;
-            }
+// ( list ) becomes a program of its own, like a function body, so it can
+// run in a scope or in a forked shell
+void compile_subshell(Compiler *c) {
+    const char *close[] = { ")", NULL };
+    Compiler sub = { .p = c->p, .end = c->end, .parens = 1 };
+    sub.prog = calloc(1, sizeof(Program));
+    if (compile_list(&sub, close) == 0) keyword(&sub, ")", 1);
+    c->p = sub.p;
+    if (!sub.prog->error) {
+        // No redirections, pipes or & on the group yet
+        skip_space(c, 0);
+        if (c->p < c->end && strchr("\n;)", *c->p) == NULL
+                && !(c->end - c->p >= 2 && c->p[0] == c->p[1] && (*c->p == '&' || *c->p == '|'))) {
+            compile_error(&sub, COMPILE_SYNTAX, "only ; && || may follow ( )");
         }
+    }
+    if (sub.prog->error) {
+        c->prog->error = sub.prog->error;
+        memcpy(c->prog->msg, sub.prog->msg, sizeof(c->prog->msg));
+        free_program(sub.prog);
+        return;
+    }
+    int at = emit(c, OP_SUBSHELL, 0, NULL, NULL);
+    c->prog->code[at].body = sub.prog;
+}
 
-        if (pipe(pipefd) == -1) {
-            perror("Pipe failed");
-            exit(1);
-        }
+void compile_error(Compiler *c, int error, const char *msg) {
+    c->prog->error = error;
+    snprintf(c->prog->msg, sizeof(c->prog->msg), "%s", msg);
+}
 
-        pid = fork();
-        if (pid == -1) {
-            perror("Fork failed");
-            exit(1);
-        } else if (pid == 0) {
-            if (in_fd != 0) {
-                dup2(in_fd, 0);
-                close(in_fd);
-            }
+void enter_loop(Compiler *c, int start) {
+    c->loop_start[c->depth] = start;
+    c->nbreaks[c->depth] = 0;
+    c->depth++;
+    if (c->depth > c->prog->slots) c->prog->slots = c->depth;
+}
 
-            if (infile) {
-                int fd0 = open(infile, O_RDONLY);
-                if (fd0 < 0) {
-                    perror("Error opening input file");
-                    exit(1);
-                }
-                dup2(fd0, 0);
-                close(fd0);
-            }
+// Points the loop's exit and every break at a closing OP_LOOP_END
+void leave_loop(Compiler *c, int exit_jump) {
+    int loop = --c->depth;
+    int end = emit(c, OP_LOOP_END, loop, NULL, NULL);
+    c->prog->code[exit_jump].target = end;
+    for (int i = 0; i < c->nbreaks[loop]; i++) c->prog->code[c->breaks[loop][i]].target = end;
+}
 
-            if (outfile) {
-                int fd1 = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (fd1 < 0) {
-                    perror("Error opening output file");
-                    exit(1);
-                }
-                dup2(fd1, 1);
-                close(fd1);
-            }
+int emit(Compiler *c, int op, int slot, char *name, char *text) {
+    Program *prog = c->prog;
+    if (prog->count == prog->cap) {
+        prog->cap = prog->cap ? prog->cap * 2 : 32;
+        prog->code = realloc(prog->code, sizeof(Insn) * prog->cap);
+    }
+    Insn *in = &prog->code[prog->count];
+    memset(in, 0, sizeof(*in));
+    in->op = op;
+    in->slot = slot;
+    in->name = name;
+    in->text = text;
+    return prog->count++;
+}
 
-            if (command != NULL && strtok(NULL, "|") != NULL) {
-                dup2(pipefd[1], 1);
-                close(pipefd[1]);
-            }
+// Whether the next word is kw, consuming it if asked
+int keyword(Compiler *c, const char *kw, int consume) {
+    size_t n = strlen(kw);
+    if ((size_t)(c->end - c->p) < n || memcmp(c->p, kw, n) != 0) return 0;
+    if (c->p + n < c->end && strchr(" \t\n;&|)", c->p[n]) == NULL) return 0;
+    if (consume) c->p += n;
+    return 1;
+}
 
-            execute(arglist, background);
-            exit(1);
+// Blanks and comments, and with separators also newlines and semicolons
+void skip_space(Compiler *c, int separators) {
+    while (c->p < c->end) {
+        if (*c->p == ' ' || *c->p == '\t' || (separators && (*c->p == '\n' || *c->p == ';'))) {
+            c->p++;
+        } else if (*c->p == '#') {
+            while (c->p < c->end && *c->p != '\n') c->p++;
         } else {
-            if (!background) {
-                waitpid(pid, NULL, 0);
-            } else {
-                add_job(pid, command);
-                printf("[%d] %d\n", job_count, pid);
-            }
-            close(pipefd[1]);
-            in_fd = pipefd[0];
-            command = strtok(NULL, "|");
+            break;
         }
     }
+}
 
-    return 0;
+// A simple command runs to an unquoted ; newline && or ||. A single & or |
+// stays part of it for the pipeline code.
+char* command_text(Compiler *c) {
+    const char *start = c->p, *q = c->p;
+    while (1) {
+        q = find_unquoted(q, c->end, c->parens ? ";\n&|)" : ";\n&|");
+        if (q < c->end && (*q == '&' || *q == '|') && !(q + 1 < c->end && q[1] == *q)) {
+            q++;
+            continue;
+        }
+        break;
+    }
+    c->p = q;
+    while (q > start && (q[-1] == ' ' || q[-1] == '\t')) q--;
+    return strndup(start, q - start);
+}
+
+// Runs one compiled program; $? carries through every instruction
+int run_program(Program *prog) {
+    LoopFrame *frames = calloc(prog->slots + 1, sizeof(LoopFrame));
+    int pc = 0;
+    while (pc < prog->count && !func_return && !session_exit) {
+        Insn *in = &prog->code[pc++];
+        LoopFrame *frame = &frames[in->slot];
+        Arena arena = { NULL };
+        switch (in->op) {
+        case OP_CMD:
+            run_command_insn(in);
+            break;
+        case OP_ASSIGN:
+            last_status = 0;
+            char *value = expand_word(in->text, &arena);
+            if (!expansion_failed()) set_var(in->name, value, 0);
+            arena_free(&arena);
+            break;
+        case OP_JUMP:
+            pc = in->target;
+            break;
+        case OP_IF_FAIL:
+            if (last_status != 0) pc = in->target;
+            break;
+        case OP_IF_OK:
+            if (last_status == 0) pc = in->target;
+            break;
+        case OP_NOT:
+            last_status = !last_status;
+            break;
+        case OP_STATUS:
+            last_status = in->target;
+            break;
+        case OP_LOOP_INIT:
+            arena_free(&frame->arena);
+            frame->words = in->text != NULL ? tokenize(in->text, &frame->arena) : NULL;
+            frame->next = 0;
+            frame->status = 0;
+            break;
+        case OP_FOR_NEXT:
+            if (frame->words[frame->next] == NULL) pc = in->target;
+            else set_var(in->name, frame->words[frame->next++], 0);
+            break;
+        case OP_LOOP_SAVE:
+            frame->status = last_status;
+            break;
+        case OP_LOOP_END:
+            last_status = frame->status;
+            arena_free(&frame->arena);
+            frame->words = NULL;
+            break;
+        case OP_DEFUN:
+            define_function(in->name, in->body);
+            last_status = 0;
+            break;
+        case OP_SUBSHELL:
+            run_subshell(in->body);
+            break;
+        case OP_RETURN:
+            if (in->text[0] != '\0') last_status = atoi(expand_word(in->text, &arena));
+            arena_free(&arena);
+            func_return = 1;
+            break;
+        }
+    }
+    for (int i = 0; i <= prog->slots; i++) arena_free(&frames[i].arena);
+    free(frames);
+    return last_status;
+}
+
+// Function calls and plain builtins are expanded and run right here; the
+// rest goes through the pipeline code like a typed line
+void run_command_insn(Insn *in) {
+    if (in->builtin || (in->name != NULL && find_function(in->name) != NULL)) {
+        Arena arena = { NULL };
+        char **argv = tokenize(in->text, &arena);
+        if (expansion_failed()) {
+            arena_free(&arena);
+            return;
+        }
+        Function *fn = argv[0] != NULL ? find_function(argv[0]) : NULL;
+        int handled = 1;
+        builtin_text = in->text;
+        if (fn != NULL) {
+            call_function(fn, argv);
+        } else if (argv[0] != NULL && handle_builtin(argv) == 0) {
+            last_status = builtin_status;
+            builtin_status = 0;
+            metrics->builtins++;
+        } else {
+            handled = argv[0] == NULL;
+        }
+        arena_free(&arena);
+        if (handled) return;
+    }
+    char *line = strdup(in->text);
+    if (handle_redirection_and_pipes(line) != 0) printf("Error executing command\n");
+    free(line);
+    // A session leaves the pipeline to the caller, a script needs it done
+    if ((server_mode || library_mode) && fg.count > 0) last_status = wait_foreground(&fg);
+}
+
+Function* find_function(char *name) {
+    for (int i = 0; i < function_count; i++) {
+        if (strcmp(functions[i].name, name) == 0) return &functions[i];
+    }
+    return NULL;
+}
+
+// A redefinition may come from inside the old body, which is kept
+void define_function(char *name, Program *body) {
+    Function *fn = find_function(name);
+    if (fn == NULL && function_count == MAX_FUNCS) {
+        fprintf(stderr, "%s: too many functions\n", name);
+        return;
+    }
+    if (fn == NULL) {
+        fn = &functions[function_count++];
+        fn->name = strdup(name);
+    }
+    fn->body = body;
+    body->defined = 1;
+}
+
+void call_function(Function *fn, char **argv) {
+    if (call_depth == MAX_CALL_DEPTH) {
+        fprintf(stderr, "%s: maximum function nesting exceeded\n", fn->name);
+        last_status = 1;
+        return;
+    }
+    char **saved_args = pos_args;
+    int saved_count = pos_count;
+    pos_args = argv + 1;
+    for (pos_count = 0; pos_args[pos_count] != NULL; pos_count++) continue;
+    LocalFrame frame = { .up = local_frame };
+    local_frame = &frame;
+    call_depth++;
+    last_status = 0;
+    run_program(fn->body);
+    call_depth--;
+    func_return = 0;
+    restore_locals(&frame);
+    local_frame = frame.up;
+    pos_args = saved_args;
+    pos_count = saved_count;
+}
+
+int is_builtin_name(char *name) {
+    return find_builtin(name) != NULL;
+}
+
+// test / [ with the usual string, integer and file operators
+int test_builtin(char* arglist[]) {
+    int argc = 0, negate = 0, r;
+    struct stat st;
+    while (arglist[argc] != NULL) argc++;
+    if (strcmp(arglist[0], "[") == 0) {
+        if (strcmp(arglist[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        argc--;
+    }
+    char **a = arglist + 1;
+    int n = argc - 1;
+    if (n >= 2 && strcmp(a[0], "!") == 0) {
+        negate = 1;
+        a++;
+        n--;
+    }
+    if (n == 0) {
+        r = 0;
+    } else if (n == 1) {
+        r = a[0][0] != '\0';
+    } else if (n == 2) {
+        char *op = a[0];
+        if (strcmp(op, "-z") == 0) r = a[1][0] == '\0';
+        else if (strcmp(op, "-n") == 0) r = a[1][0] != '\0';
+        else if (strcmp(op, "-e") == 0) r = stat(a[1], &st) == 0;
+        else if (strcmp(op, "-f") == 0) r = stat(a[1], &st) == 0 && S_ISREG(st.st_mode);
+        else if (strcmp(op, "-d") == 0) r = stat(a[1], &st) == 0 && S_ISDIR(st.st_mode);
+        else if (strcmp(op, "-s") == 0) r = stat(a[1], &st) == 0 && st.st_size > 0;
+        else if (strcmp(op, "-r") == 0) r = access(a[1], R_OK) == 0;
+        else if (strcmp(op, "-w") == 0) r = access(a[1], W_OK) == 0;
+        else if (strcmp(op, "-x") == 0) r = access(a[1], X_OK) == 0;
+        else {
+            fprintf(stderr, "test: %s: unary operator expected\n", op);
+            return 2;
+        }
+    } else if (n == 3) {
+        char *op = a[1];
+        long x = atol(a[0]), y = atol(a[2]);
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) r = strcmp(a[0], a[2]) == 0;
+        else if (strcmp(op, "!=") == 0) r = strcmp(a[0], a[2]) != 0;
+        else if (strcmp(op, "-eq") == 0) r = x == y;
+        else if (strcmp(op, "-ne") == 0) r = x != y;
+        else if (strcmp(op, "-lt") == 0) r = x < y;
+        else if (strcmp(op, "-le") == 0) r = x <= y;
+        else if (strcmp(op, "-gt") == 0) r = x > y;
+        else if (strcmp(op, "-ge") == 0) r = x >= y;
+        else {
+            fprintf(stderr, "test: %s: binary operator expected\n", op);
+            return 2;
+        }
+    } else {
+        fprintf(stderr, "test: too many arguments\n");
+        return 2;
+    }
+    return (r ^ negate) ? 0 : 1;
+}
+
+int status_code(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 1;
+}
+
+// Lines come out of in_buf; the fd is only read once the event loop says
+// it is ready, so background jobs keep being reaped while the prompt waits.
+char* read_cmd(char* prompt, FILE* fp) {
+    int fd = fileno(fp);
+    notify_jobs();
+    if (!server_mode && isatty(fd) && isatty(STDOUT_FILENO)) return edit_line(prompt, fd);
+    printf("%s", prompt);
+    fflush(stdout);
+    int pos = 0, cap = MAX_LEN;
+    char* cmdline = (char*)malloc(sizeof(char) * cap);
+    while (1) {
+        while (in_start < in_end) {
+            char c = in_buf[in_start++];
+            if (c == '\n') {
+                cmdline[pos] = '\0';
+                return cmdline;
+            }
+            if (pos == cap - 1) cmdline = realloc(cmdline, cap *= 2);
+            cmdline[pos++] = c;
+        }
+        if (in_eof) break;
+        wait_for_input(fd);
+        ssize_t n = read(fd, in_buf, INPUT_BUF);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) in_eof = 1;
+        in_reads++;
+        in_start = 0;
+        in_end = n > 0 ? n : 0;
+    }
+    if (pos == 0) {
+        free(cmdline);
+        return NULL;
+    }
+    cmdline[pos] = '\0';
+    return cmdline;
+}
+
+// Raw-mode editor for a terminal: emacs keys, up/down through history and
+// tab completion. Bytes still come through in_buf and the event loop.
+char* edit_line(char *prompt, int fd) {
+    struct termios orig, raw;
+    if (tcgetattr(fd, &orig) != 0) return NULL;
+    raw = orig;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSADRAIN, &raw);
+
+    LineEdit e = { .cap = MAX_LEN, .prompt = prompt, .history_at = hist.next };
+    e.buf = malloc(e.cap);
+    e.buf[0] = '\0';
+    printf("%s", prompt);
+    fflush(stdout);
+    int c;
+    while ((c = next_key(fd)) >= 0) {
+        if (c == '\r' || c == '\n') break;
+        if (c == 4 && e.len == 0) {               // ^D on an empty line
+            free(e.buf);
+            e.buf = NULL;
+            break;
+        }
+        switch (c) {
+        case 1: e.pos = 0; break;                  // ^A
+        case 5: e.pos = e.len; break;              // ^E
+        case 2: if (e.pos > 0) e.pos--; break;     // ^B
+        case 6: if (e.pos < e.len) e.pos++; break; // ^F
+        case 4: edit_delete(&e, e.pos, e.pos + 1); break;
+        case 8: case 127: if (e.pos > 0) edit_delete(&e, e.pos - 1, e.pos); break;
+        case 11: edit_delete(&e, e.pos, e.len); break;
+        case 21: edit_delete(&e, 0, e.pos); break;
+        case 23: {                                 // ^W, back to the previous blank
+            int from = e.pos;
+            while (from > 0 && e.buf[from - 1] == ' ') from--;
+            while (from > 0 && e.buf[from - 1] != ' ') from--;
+            edit_delete(&e, from, e.pos);
+            break;
+        }
+        case 12: printf("\x1b[H\x1b[2J"); break;   // ^L
+        case 16: edit_history(&e, -1); break;      // ^P
+        case 14: edit_history(&e, 1); break;       // ^N
+        case 9: edit_complete(&e); break;
+        case 18:                                   // ^R
+            if (edit_search(&e, fd)) c = '\r';
+            break;
+        case 3:                                    // ^C drops the line
+            printf("^C\n%s", prompt);
+            e.len = e.pos = 0;
+            e.buf[0] = '\0';
+            e.history_at = hist.next;
+            last_status = 130;
+            break;
+        case 27: {                                 // ESC [ x, ESC O x
+            int a = next_key(fd), b = next_key(fd);
+            if (a != '[' && a != 'O') break;
+            if (b >= '0' && b <= '9') {
+                if (next_key(fd) != '~') break;
+                if (b == '3') edit_delete(&e, e.pos, e.pos + 1);
+                else if (b == '1' || b == '7') e.pos = 0;
+                else if (b == '4' || b == '8') e.pos = e.len;
+            } else if (b == 'A') {
+                edit_history(&e, -1);
+            } else if (b == 'B') {
+                edit_history(&e, 1);
+            } else if (b == 'C' && e.pos < e.len) {
+                e.pos++;
+            } else if (b == 'D' && e.pos > 0) {
+                e.pos--;
+            } else if (b == 'H') {
+                e.pos = 0;
+            } else if (b == 'F') {
+                e.pos = e.len;
+            }
+            break;
+        }
+        default:
+            if (c >= 32) {
+                char ch = c;
+                edit_insert(&e, &ch, 1);
+            }
+        }
+        if (c == '\r') break;
+        edit_refresh(&e);
+    }
+    if (c < 0 && e.buf != NULL && e.len == 0) {
+        free(e.buf);
+        e.buf = NULL;
+    }
+    printf("\n");
+    fflush(stdout);
+    tcsetattr(fd, TCSADRAIN, &orig);
+    free(e.saved);
+    return e.buf;
+}
+
+// One byte of terminal input, -1 at end of file
+int next_key(int fd) {
+    while (in_start == in_end) {
+        if (in_eof) return -1;
+        wait_for_input(fd);
+        ssize_t n = read(fd, in_buf, INPUT_BUF);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) in_eof = 1;
+        in_reads++;
+        in_start = 0;
+        in_end = n > 0 ? n : 0;
+    }
+    return (unsigned char)in_buf[in_start++];
+}
+
+void edit_refresh(LineEdit *e) {
+    printf("\r%s%.*s\x1b[K", e->prompt, e->len, e->buf);
+    if (e->len > e->pos) printf("\x1b[%dD", e->len - e->pos);
+    fflush(stdout);
+}
+
+void edit_insert(LineEdit *e, const char *s, int n) {
+    if (e->len + n + 1 > e->cap) {
+        while (e->len + n + 1 > e->cap) e->cap *= 2;
+        e->buf = realloc(e->buf, e->cap);
+    }
+    memmove(e->buf + e->pos + n, e->buf + e->pos, e->len - e->pos);
+    memcpy(e->buf + e->pos, s, n);
+    e->len += n;
+    e->pos += n;
+    e->buf[e->len] = '\0';
+}
+
+void edit_delete(LineEdit *e, int from, int to) {
+    if (to > e->len) to = e->len;
+    if (from >= to) return;
+    memmove(e->buf + from, e->buf + to, e->len - to);
+    e->len -= to - from;
+    e->pos = from;
+    e->buf[e->len] = '\0';
+}
+
+// dir -1 is older, 1 newer; the line being typed comes back past the end
+void edit_history(LineEdit *e, int dir) {
+    uint32_t at = e->history_at + dir;
+    if (e->history_at == hist.first && dir < 0) return;
+    if (at < hist.first || at > hist.next) return;
+    if (e->history_at == hist.next) {
+        free(e->saved);
+        e->saved = strdup(e->buf);
+    }
+    e->history_at = at;
+    char *line = at == hist.next ? e->saved : hist.lines[at & (HISTORY_MAX - 1)];
+    e->len = e->pos = 0;
+    edit_insert(e, line, strlen(line));
+}
+
+// Ctrl-R: ranked matches are recomputed as each key is typed, ^R steps
+// to the next one. Returns 1 when Enter should run the match. Any other
+// key takes the match into the line and is handled by the editor.
+int edit_search(LineEdit *e, int fd) {
+    char query[MAX_LEN] = "";
+    int qlen = 0, at = 0, count = 0, run = 0;
+    SearchHit hits[SEARCH_MATCHES];
+    while (1) {
+        char *match = at < count ? hist.lines[hits[at].id & (HISTORY_MAX - 1)] : "";
+        printf("\r(%sreverse-i-search)`%s': %s\x1b[K", count == 0 && qlen > 0 ? "failing " : "", query, match);
+        fflush(stdout);
+        int c = next_key(fd);
+        if (c == 18) {
+            if (at + 1 < count) at++;
+            continue;
+        }
+        if (c == 7 || c == 3) {                    // ^G, ^C: back to the line as it was
+            break;
+        } else if (c == 8 || c == 127) {
+            if (qlen > 0) query[--qlen] = '\0';
+        } else if (c >= 32 && qlen < MAX_LEN - 1) {
+            query[qlen++] = c;
+            query[qlen] = '\0';
+        } else {
+            if (c >= 0 && c != '\r' && c != '\n') in_start--;
+            run = c == '\r' || c == '\n';
+            if (at < count) {
+                e->len = e->pos = 0;
+                edit_insert(e, match, strlen(match));
+                e->history_at = hits[at].id;
+            }
+            break;
+        }
+        count = qlen > 0 ? hist_search(query, hits, SEARCH_MATCHES) : 0;
+        at = 0;
+    }
+    edit_refresh(e);
+    return run;
+}
+
+// Completes the word before the cursor: a command name in command
+// position, a variable after $, a file name anywhere else
+void edit_complete(LineEdit *e) {
+    int start = e->pos;
+    while (start > 0 && strchr(" \t|;&<>(`", e->buf[start - 1]) == NULL) start--;
+    char *word = e->buf + start;
+    int n = e->pos - start;
+    int before = start;
+    while (before > 0 && (e->buf[before - 1] == ' ' || e->buf[before - 1] == '\t')) before--;
+    int command = before == 0 || strchr("|;&(`", e->buf[before - 1]) != NULL;
+
+    Completions c = { { NULL } };
+    const char *slash = NULL;
+    for (int i = 0; i < n; i++) if (word[i] == '/') slash = word + i;
+    int skip = 0;                          // leading part of the word not completed
+    if (n > 0 && word[0] == '$') {
+        skip = n > 1 && word[1] == '{' ? 2 : 1;
+        complete_vars(&c, word + skip, n - skip);
+    } else if (command && slash == NULL) {
+        complete_commands(&c, word, n);
+    } else {
+        skip = slash != NULL ? slash + 1 - word : 0;
+        complete_files(&c, word, n);
+    }
+    // Sorted, and a builtin that is also on PATH listed once
+    qsort(c.items, c.count, sizeof(char*), compare_strings);
+    int unique = 0;
+    for (int i = 0; i < c.count; i++) {
+        if (unique == 0 || strcmp(c.items[i], c.items[unique - 1]) != 0) c.items[unique++] = c.items[i];
+    }
+    c.count = unique;
+
+    if (c.count == 1) {
+        char *item = c.items[0];
+        int len = strlen(item);
+        edit_insert(e, item + (n - skip), len - (n - skip));
+        if (len > 0 && item[len - 1] != '/') edit_insert(e, skip == 2 ? "} " : " ", skip == 2 ? 2 : 1);
+    } else if (c.count > 1) {
+        // Extend to the longest common prefix, list when that adds nothing
+        int common = strlen(c.items[0]);
+        for (int i = 1; i < c.count; i++) {
+            int k = 0;
+            while (k < common && c.items[i][k] == c.items[0][k]) k++;
+            common = k;
+        }
+        if (common > n - skip) edit_insert(e, c.items[0] + (n - skip), common - (n - skip));
+        else list_completions(e, &c);
+    } else {
+        printf("\a");
+    }
+    arena_free(&c.arena);
+    free(c.items);
+}
+
+// Candidates in columns under the line, then the line again
+void list_completions(LineEdit *e, Completions *c) {
+    struct winsize ws;
+    int width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    int shown = c->count < LIST_MAX ? c->count : LIST_MAX, widest = 0;
+    for (int i = 0; i < shown; i++) {
+        int len = strlen(c->items[i]);
+        if (len > widest) widest = len;
+    }
+    int cols = width / (widest + 2);
+    if (cols < 1) cols = 1;
+    int rows = (shown + cols - 1) / cols;
+    printf("\n");
+    for (int r = 0; r < rows; r++) {
+        for (int col = 0; col < cols; col++) {
+            int i = col * rows + r;
+            if (i < shown) printf("%-*s", widest + 2, c->items[i]);
+        }
+        printf("\n");
+    }
+    if (shown < c->count) printf("... %d more\n", c->count - shown);
+    edit_refresh(e);
+}
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+void add_completion(Completions *c, const char *s, int n, const char *suffix) {
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->items = realloc(c->items, sizeof(char*) * c->cap);
+    }
+    char *item = arena_alloc(&c->arena, n + strlen(suffix) + 1);
+    memcpy(item, s, n);
+    strcpy(item + n, suffix);
+    c->items[c->count++] = item;
+}
+
+// Builtins and functions, then the PATH trie
+void complete_commands(Completions *c, const char *prefix, int n) {
+    for (int i = 0; i < builtin_count; i++) {
+        if (strncmp(builtins[i].name, prefix, n) == 0) add_completion(c, builtins[i].name, strlen(builtins[i].name), "");
+    }
+    for (int i = 0; i < function_count; i++) {
+        if (strncmp(functions[i].name, prefix, n) == 0) add_completion(c, functions[i].name, strlen(functions[i].name), "");
+    }
+    path_trie_build();
+    int node = trie_find(&path_trie, prefix, n);
+    if (node < 0) return;
+    char name[NAME_MAX + 1];
+    memcpy(name, prefix, n);
+    if (path_trie.nodes[node].dirs) add_completion(c, name, n, "");
+    trie_collect(&path_trie, path_trie.nodes[node].child, name, n, c);
+}
+
+// Names in the word's directory; items are the part after the last '/'
+void complete_files(Completions *c, const char *word, int n) {
+    char dir[PATH_MAX];
+    const char *base = word;
+    for (int i = 0; i < n; i++) if (word[i] == '/') base = word + i + 1;
+    if (base == word) strcpy(dir, ".");
+    else snprintf(dir, sizeof(dir), "%.*s", (int)(base - word), word);
+    int len = n - (base - word);
+    DIR *d = opendir(dir);
+    if (d == NULL) return;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strncmp(ent->d_name, base, len) != 0) continue;
+        if (ent->d_name[0] == '.' && (len == 0 || strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)) continue;
+        int is_dir = ent->d_type == DT_DIR;
+        if (ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(d), ent->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        add_completion(c, ent->d_name, strlen(ent->d_name), is_dir ? "/" : "");
+    }
+    closedir(d);
+}
+
+void complete_vars(Completions *c, const char *prefix, int n) {
+    VarList list = { NULL };
+    var_each(vars, collect_var, &list);
+    for (int i = 0; i < list.count; i++) {
+        char *name = list.leaves[i]->name;
+        if (strncmp(name, prefix, n) == 0) add_completion(c, name, strlen(name), "");
+    }
+    free(list.leaves);
+}
+
+// Scans $PATH once, and again only if it changes; inotify keeps it current
+void path_trie_build() {
+    char *path = env_get("PATH");
+    if (path == NULL) path = "/usr/bin:/bin";
+    PathTrie *t = &path_trie;
+    if (t->path != NULL && strcmp(t->path, path) == 0) return;
+    path_trie_free();
+    t->path = strdup(path);
+    t->cap = 1024;
+    t->nodes = calloc(t->cap, sizeof(TrieNode));
+    t->count = 1;
+    t->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (t->inotify_fd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_TAG(EV_PATH, 0) };
+        epoll_ctl(loop_epfd, EPOLL_CTL_ADD, t->inotify_fd, &ev);
+    }
+    // An empty entry means the cwd to execvp, which strtok_r would skip
+    size_t plen = strlen(path);
+    t->exact = t->inotify_fd >= 0 && plen > 0 && path[0] != ':' && path[plen - 1] != ':'
+               && strstr(path, "::") == NULL;
+    char *copy = strdup(path), *save, *dir;
+    for (dir = strtok_r(copy, ":", &save); dir != NULL && t->ndirs < MAX_PATH_DIRS; dir = strtok_r(NULL, ":", &save)) {
+        int i = t->ndirs;
+        if (dir[0] != '/') t->exact = 0;
+        // Watch before scanning so nothing added in between is missed
+        t->wd[i] = t->inotify_fd < 0 ? -1 : inotify_add_watch(t->inotify_fd, dir,
+            IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF);
+        DIR *d = opendir(dir);
+        if (d == NULL || t->wd[i] < 0) t->exact = 0;
+        if (d == NULL) {
+            if (t->wd[i] >= 0) inotify_rm_watch(t->inotify_fd, t->wd[i]);
+            continue;
+        }
+        t->dirs[t->ndirs++] = strdup(dir);
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL) {
+            if (ent->d_name[0] == '.' || ent->d_type == DT_DIR) continue;
+            struct stat st;
+            if (fstatat(dirfd(d), ent->d_name, &st, 0) == 0 && S_ISREG(st.st_mode)
+                    && faccessat(dirfd(d), ent->d_name, X_OK, 0) == 0) {
+                trie_set(t, ent->d_name, i, 1);
+            }
+        }
+        closedir(d);
+    }
+    if (dir != NULL) t->exact = 0;
+    free(copy);
+}
+
+void path_trie_free() {
+    PathTrie *t = &path_trie;
+    if (t->inotify_fd >= 0) {
+        epoll_ctl(loop_epfd, EPOLL_CTL_DEL, t->inotify_fd, NULL);
+        close(t->inotify_fd);
+    }
+    for (int i = 0; i < t->ndirs; i++) free(t->dirs[i]);
+    free(t->nodes);
+    free(t->path);
+    memset(t, 0, sizeof(*t));
+    t->inotify_fd = -1;
+}
+
+// Applies queued inotify events to the trie
+void path_trie_update() {
+    PathTrie *t = &path_trie;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(t->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event *ev = (struct inotify_event*)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                free(t->path);           // rescan on the next completion
+                t->path = NULL;
+                return;
+            }
+            int dir = -1;
+            for (int i = 0; i < t->ndirs; i++) if (t->wd[i] == ev->wd) dir = i;
+            if (dir < 0) continue;
+            if (ev->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+                trie_clear_dir(t, dir);
+                t->wd[dir] = -1;
+            } else if (ev->len > 0 && (ev->mask & (IN_DELETE | IN_MOVED_FROM))) {
+                trie_set(t, ev->name, dir, 0);
+            } else if (ev->len > 0) {
+                path_trie_check(dir, ev->name);
+            }
+        }
+    }
+}
+
+// Created, renamed in or chmodded: the name counts if it is now executable
+void path_trie_check(int dir, const char *name) {
+    char file[PATH_MAX];
+    struct stat st;
+    snprintf(file, sizeof(file), "%s/%s", path_trie.dirs[dir], name);
+    int on = name[0] != '.' && stat(file, &st) == 0 && S_ISREG(st.st_mode) && access(file, X_OK) == 0;
+    trie_set(&path_trie, name, dir, on);
+}
+
+void trie_set(PathTrie *t, const char *name, int dir, int on) {
+    int node = 0;
+    for (const char *p = name; *p; p++) {
+        int prev = 0, cur = t->nodes[node].child;
+        while (cur != 0 && t->nodes[cur].c < *p) {
+            prev = cur;
+            cur = t->nodes[cur].next;
+        }
+        if (cur == 0 || t->nodes[cur].c != *p) {
+            if (!on) return;
+            if (t->count == t->cap) {
+                t->cap *= 2;
+                t->nodes = realloc(t->nodes, sizeof(TrieNode) * t->cap);
+            }
+            int fresh = t->count++;
+            t->nodes[fresh] = (TrieNode){ .c = *p, .next = cur };
+            if (prev == 0) t->nodes[node].child = fresh;
+            else t->nodes[prev].next = fresh;
+            cur = fresh;
+        }
+        node = cur;
+    }
+    if (on) t->nodes[node].dirs |= 1ULL << dir;
+    else t->nodes[node].dirs &= ~(1ULL << dir);
+}
+
+// Node for the prefix, -1 if no name starts with it
+int trie_find(PathTrie *t, const char *s, int n) {
+    int node = 0;
+    for (int i = 0; i < n; i++) {
+        int cur = t->nodes[node].child;
+        while (cur != 0 && t->nodes[cur].c < s[i]) cur = t->nodes[cur].next;
+        if (cur == 0 || t->nodes[cur].c != s[i]) return -1;
+        node = cur;
+    }
+    return node;
+}
+
+// Every name below a sibling list, in sorted order
+void trie_collect(PathTrie *t, int node, char *name, int len, Completions *c) {
+    for (; node != 0 && len < NAME_MAX; node = t->nodes[node].next) {
+        name[len] = t->nodes[node].c;
+        if (t->nodes[node].dirs) add_completion(c, name, len + 1, "");
+        trie_collect(t, t->nodes[node].child, name, len + 1, c);
+    }
+}
+
+void trie_clear_dir(PathTrie *t, int dir) {
+    for (int i = 0; i < t->count; i++) t->nodes[i].dirs &= ~(1ULL << dir);
+}
+
+// The file execvp would run for name, from the PATH trie once queued
+// inotify events are applied, so it is current as of this call. NULL when
+// the trie can't tell (a relative, empty or missing $PATH entry) or has no
+// such program; execvp then does its own search. Only lookahead builds the
+// trie, a launch doesn't wait for the scan.
+char* path_resolve(char *name, char *buf, size_t len, int build) {
+    if (lookahead_depth == 0 || name[0] == '\0' || strchr(name, '/') != NULL) return NULL;
+    PathTrie *t = &path_trie;
+    char *path = env_get("PATH");
+    if (!build && (t->path == NULL || strcmp(t->path, path != NULL ? path : "/usr/bin:/bin") != 0)) return NULL;
+    path_trie_build();
+    if (t->inotify_fd >= 0) path_trie_update();
+    path_trie_build();            // after a queue overflow
+    if (!t->exact) return NULL;
+    int node = trie_find(t, name, strlen(name));
+    if (node < 0 || t->nodes[node].dirs == 0) return NULL;
+    snprintf(buf, len, "%s/%s", t->dirs[__builtin_ctzll(t->nodes[node].dirs)], name);
+    return buf;
+}
+
+// Called while a foreground pipeline runs: looks over the next lines
+// already read into in_buf and gets their launches ready. Their programs
+// are looked up in the PATH trie, building it the first time, and "<"
+// files start coming into the page cache. Nothing here changes what the
+// lines do, and no more of stdin is read than the shell already has.
+void lookahead_prepare() {
+    if (ahead_reads != in_reads) {
+        ahead_reads = in_reads;
+        ahead_pos = 0;
+    }
+    char *p = in_buf + in_start, *end = in_buf + in_end, *nl;
+    for (int i = 0; i < lookahead_depth && (nl = memchr(p, '\n', end - p)) != NULL; i++, p = nl + 1) {
+        if (p - in_buf < ahead_pos) continue;
+        char *line = strndup(p, nl - p);
+        lookahead_line(line);
+        free(line);
+        ahead_pos = nl + 1 - in_buf;
+    }
+}
+
+// Expanding $ or ` could run something or depend on earlier lines, so
+// such lines are left alone
+void lookahead_line(char *line) {
+    if (strncmp(line, "overlap ", 8) == 0) line += 8;
+    if (strpbrk(line, "$`") != NULL || is_script(line)) return;
+    Arena arena = { NULL };
+    char *rest = line, *stage, path[PATH_MAX];
+    struct stat st;
+    while ((stage = next_stage(&rest)) != NULL) {
+        char **argv = tokenize(stage, &arena);
+        for (int i = 0; argv[i] != NULL; i++) {
+            if ((argv[i] != redir_in && argv[i] != redir_gz) || argv[i + 1] == NULL) continue;
+            if (stat(argv[i + 1], &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            int fd = open(argv[i + 1], O_RDONLY | O_CLOEXEC);
+            if (fd < 0) continue;
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+        if (argv[0] != NULL && argv[0] != redir_in && argv[0] != redir_out && argv[0] != redir_append
+                && argv[0] != redir_gz && strchr(argv[0], '=') == NULL
+                && !is_builtin_name(argv[0]) && find_function(argv[0]) == NULL) {
+            path_resolve(argv[0], path, sizeof(path), 1);
+        }
+    }
+    arena_free(&arena);
+}
+
+// "overlap CMD" where CMD is one pipeline of programs: nothing in it can
+// change the shell, read $? or go to the background
+int overlap_ok(char *line) {
+    if (strncmp(line, "overlap ", 8) != 0) return 0;
+    char *cmd = line + 8;
+    cmd += strspn(cmd, " \t");
+    if (*cmd == '\0' || is_script(cmd) || strstr(cmd, "$?") != NULL
+            || *find_unquoted(cmd, cmd + strlen(cmd), "&") != '\0') {
+        return 0;
+    }
+    size_t n = strspn(cmd, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-./+");
+    if (n == 0 || n >= NAME_MAX || (cmd[n] != '\0' && strchr(" \t|<>", cmd[n]) == NULL)) return 0;
+    char name[NAME_MAX];
+    snprintf(name, sizeof(name), "%.*s", (int)n, cmd);
+    return !is_builtin_name(name) && find_function(name) == NULL;
+}
+
+// Runs first, and the marked lines after it that are already read (up to
+// the lookahead depth), at the same time. Each gets a forked copy of the
+// shell with stdin from /dev/null and stdout and stderr in memfds. Those
+// are copied out in line order, with the prompts in between, so output
+// and $? come out as if the lines had run one by one.
+void run_overlapped(char *first) {
+    char *lines[LOOKAHEAD_MAX];
+    pid_t pids[LOOKAHEAD_MAX];
+    int outs[LOOKAHEAD_MAX], errs[LOOKAHEAD_MAX];
+    int count = 0;
+    lines[count++] = strdup(first);
+    char *nl;
+    while (count < lookahead_depth && (nl = memchr(in_buf + in_start, '\n', in_end - in_start)) != NULL) {
+        char *line = strndup(in_buf + in_start, nl - (in_buf + in_start));
+        if (!overlap_ok(line)) {
+            free(line);
+            break;
+        }
+        in_start = nl + 1 - in_buf;
+        lines[count++] = line;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    for (int i = 0; i < count; i++) {
+        pids[i] = -1;
+        outs[i] = memfd_create("overlap-out", MFD_CLOEXEC);
+        errs[i] = memfd_create("overlap-err", MFD_CLOEXEC);
+        if (null_fd < 0 || outs[i] < 0 || errs[i] < 0) continue;
+        metrics->forks++;
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            subshell_init();
+            dup2(null_fd, 0);
+            dup2(outs[i], 1);
+            dup2(errs[i], 2);
+            parse_and_execute(lines[i]);
+            fflush(stdout);
+            fflush(stderr);
+            _exit(last_status);
+        }
+    }
+    if (null_fd >= 0) close(null_fd);
+
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            printf("%s", PROMPT);
+            fflush(stdout);
+        }
+        // One that could not be started runs here, in its turn
+        if (pids[i] < 0) {
+            parse_and_execute(lines[i]);
+        } else {
+            int status;
+            add_to_history(lines[i]);
+            while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR);
+            last_status = status_code(status);
+            overlap_output(outs[i], STDOUT_FILENO);
+            overlap_output(errs[i], STDERR_FILENO);
+        }
+        if (outs[i] >= 0) close(outs[i]);
+        if (errs[i] >= 0) close(errs[i]);
+        free(lines[i]);
+    }
+}
+
+void overlap_output(int from, int to) {
+    char buf[FILTER_BUF];
+    off_t off = 0;
+    ssize_t n;
+    while ((n = pread(from, buf, sizeof(buf), off)) > 0) {
+        if (write_all(to, buf, n) != 0) return;
+        off += n;
+    }
+}
+
+// Splits a command line into words, expanding parameters on the way. The
+// "expansion" span covers $ and ` substitution too.
+char** tokenize(char* cmdline, Arena *arena) {
+    long long t = trace_buf != NULL ? now_ns() : 0;
+    Words w = { .arena = arena };
+    lex(&w, cmdline, cmdline + strlen(cmdline), 0);
+    word_end(&w);
+    char **argv = arena_alloc(arena, sizeof(char*) * (w.argc + 1));
+    memcpy(argv, w.argv, sizeof(char*) * w.argc);
+    argv[w.argc] = NULL;
+    free(w.argv);
+    if (trace_buf != NULL) trace_span("expansion", argv[0] != NULL ? argv[0] : "", t, getpid(), current_job, -1);
+    return argv;
+}
+
+// The value side of NAME=value: quotes removed and parameters expanded, but
+// kept as one word
+char* expand_word(char *text, Arena *arena) {
+    Words w = { .arena = arena, .join = 1 };
+    word_add(&w, "", 0);
+    lex(&w, text, text + strlen(text), 0);
+    word_end(&w);
+    char *word = w.argv[0];
+    free(w.argv);
+    return word;
+}
+
+// One left to right pass over [p, end): literal runs and variable values are
+// copied straight onto the word being built, nothing is scanned twice
+void lex(Words *w, const char *p, const char *end, int quote) {
+    while (p < end) {
+        char c = *p;
+        if (quote == '\'') {
+            const char *close = memchr(p, '\'', end - p);
+            if (close == NULL) close = end;
+            word_add(w, p, close - p);
+            p = close + (close < end);
+            quote = 0;
+        } else if (!quote && !w->join && (c == ' ' || c == '\t')) {
+            word_end(w);
+            p++;
+        } else if (!quote && !w->join && c == '<' && end - p >= 2 && p[1] == 'z'
+                   && (end - p == 2 || p[2] == ' ' || p[2] == '\t')) {
+            word_end(w);
+            word_push(w, redir_gz);
+            p += 2;
+        } else if (!quote && !w->join && c == '>' && end - p >= 2 && p[1] == '>') {
+            word_end(w);
+            word_push(w, redir_append);
+            p += 2;
+        } else if (!quote && !w->join && (c == '<' || c == '>')) {
+            word_end(w);
+            word_push(w, c == '<' ? redir_in : redir_out);
+            p++;
+        } else if (c == '\'' && !quote) {
+            word_add(w, "", 0);
+            quote = '\'';
+            p++;
+        } else if (c == '"') {
+            word_add(w, "", 0);
+            quote = quote ? 0 : '"';
+            p++;
+        } else if (c == '\\' && p + 1 < end && (!quote || strchr("$\"\\`", p[1]) != NULL)) {
+            word_add(w, p + 1, 1);
+            p += 2;
+        } else if (c == '$' && p + 1 < end && p[1] == '(') {
+            const char *close = find_unquoted(p + 2, end, ")");
+            substitute(w, p + 2, close - (p + 2), quote == '"');
+            p = close + (close < end);
+        } else if (c == '`') {
+            const char *close = p + 1;
+            while (close < end && *close != '`') close += (*close == '\\' && close + 1 < end) ? 2 : 1;
+            if (close > end) close = end;
+            substitute(w, p + 1, close - (p + 1), quote == '"');
+            p = close + (close < end);
+        } else if (c == '$') {
+            p = expand_param(w, p, end, quote == '"');
+        } else {
+            const char *run = p + 1;
+            while (run < end && strchr(quote ? "\"\\$`" : " \t<>'\"\\$`", *run) == NULL) run++;
+            word_add(w, p, run - p);
+            p = run;
+        }
+    }
+}
+
+// $NAME, $?, $$, ${NAME}, ${#NAME}, ${NAME-word}, ${NAME=word},
+// ${NAME+word}, ${NAME?word} (each also with :, which treats empty as
+// unset), ${NAME#prefix}, ${NAME##prefix}, ${NAME%suffix} and
+// ${NAME%%suffix}. Anything else is a bad substitution. Returns where the
+// reference ends.
+const char* expand_param(Words *w, const char *p, const char *end, int quoted) {
+    char name[64], num[32];
+    const char *q = p + 1;
+    int braced = q < end && *q == '{', length = 0;
+    if (braced) q++;
+    if (braced && q < end && *q == '#' && q + 1 < end && q[1] != '}') {
+        length = 1;
+        q++;
+    }
+
+    const char *start = q;
+    const char *value = NULL;
+    int named = 0;
+    if (q < end && (*q == '@' || *q == '*')) {
+        // Every positional parameter; "$@" keeps them as separate words
+        for (int i = 0; i < pos_count; i++) {
+            if (i > 0 && *q == '*' && quoted) word_add(w, " ", 1);
+            else if (i > 0) word_end(w);
+            emit_value(w, pos_args[i], strlen(pos_args[i]), quoted);
+        }
+        q++;
+        return braced && q < end && *q == '}' ? q + 1 : q;
+    } else if (q < end && isdigit((unsigned char)*q)) {
+        int n = *q++ - '0';
+        value = n == 0 ? "final_version" : n <= pos_count ? pos_args[n - 1] : NULL;
+    } else if (q < end && (*q == '?' || *q == '$' || *q == '#')) {
+        snprintf(num, sizeof(num), "%d", *q == '?' ? last_status : *q == '$' ? getpid() : pos_count);
+        value = num;
+        q++;
+    } else {
+        while (q < end && (*q == '_' || isalnum((unsigned char)*q)) && (q > start || !isdigit((unsigned char)*q))) q++;
+        if (q == start) {
+            word_add(w, p, 1);  // a lone $
+            return p + 1;
+        }
+        size_t n = q - start < (long)sizeof(name) ? (size_t)(q - start) : sizeof(name) - 1;
+        memcpy(name, start, n);
+        name[n] = '\0';
+        value = get_var(name);
+        named = 1;
+    }
+    if (!braced) {
+        if (value != NULL) emit_value(w, value, strlen(value), quoted);
+        return q;
+    }
+
+    // Operator text runs to the matching brace
+    const char *op = q, *close = q;
+    for (int depth = 1; close < end; close++) {
+        if (*close == '{') depth++;
+        else if (*close == '}' && --depth == 0) break;
+    }
+    size_t vlen = value != NULL ? strlen(value) : 0;
+    int colon = op < close && *op == ':';
+    char kind = op + colon < close ? op[colon] : '\0';
+    const char *arg = op + colon + (kind != '\0');
+    if (op == close) {
+        if (length) {
+            snprintf(num, sizeof(num), "%zu", vlen);
+            emit_value(w, num, strlen(num), quoted);
+        } else if (value != NULL) {
+            emit_value(w, value, vlen, quoted);
+        }
+    } else if (!length && kind != '\0' && strchr("-=+?", kind) != NULL && (kind != '=' || named)) {
+        int set = value != NULL && (!colon || vlen > 0);
+        if (kind == '+') {
+            if (set) lex(w, arg, close, quoted ? '"' : 0);
+        } else if (set) {
+            emit_value(w, value, vlen, quoted);
+        } else if (kind == '-') {
+            lex(w, arg, close, quoted ? '"' : 0);
+        } else {
+            // The word is expanded on its own: w's partial word must stay
+            // at the end of its arena block
+            Arena tmp = { NULL };
+            char *text = strndup(arg, close - arg);
+            char *word = expand_word(text, &tmp);
+            if (kind == '=') {
+                set_var(name, word, 0);
+                emit_value(w, word, strlen(word), quoted);
+            } else {
+                fprintf(stderr, "%.*s: %s\n", (int)(q - start), start,
+                        *word != '\0' ? word : "parameter null or not set");
+                expand_failed = 1;
+            }
+            free(text);
+            arena_free(&tmp);
+        }
+    } else if (!length && !colon && (kind == '#' || kind == '%')) {
+        int longest = arg < close && *arg == kind;
+        const char *pat = arg + longest;
+        size_t plen = close - pat;
+        char pattern[MAX_LEN];
+        if (plen >= sizeof(pattern)) plen = sizeof(pattern) - 1;
+        memcpy(pattern, pat, plen);
+        pattern[plen] = '\0';
+        size_t from = 0, to = vlen;         // the part of value kept
+        if (value == NULL) {
+            value = "";
+        } else if (strpbrk(pattern, "*?[") == NULL) {
+            // Literal text, shortest and longest match are the same
+            if (plen <= vlen && kind == '%' && memcmp(value + vlen - plen, pattern, plen) == 0) to = vlen - plen;
+            if (plen <= vlen && kind == '#' && memcmp(value, pattern, plen) == 0) from = plen;
+        } else if (kind == '%') {
+            for (size_t i = 0; i <= vlen; i++) {
+                size_t at = longest ? i : vlen - i;
+                if (fnmatch(pattern, value + at, 0) == 0) {
+                    to = at;
+                    break;
+                }
+            }
+        } else {
+            char *copy = strdup(value);
+            for (size_t i = 0; i <= vlen; i++) {
+                size_t at = longest ? vlen - i : i;
+                char c = copy[at];
+                copy[at] = '\0';
+                int match = fnmatch(pattern, copy, 0) == 0;
+                copy[at] = c;
+                if (match) {
+                    from = at;
+                    break;
+                }
+            }
+            free(copy);
+        }
+        emit_value(w, value + from, to - from, quoted);
+    } else {
+        fprintf(stderr, "%.*s: bad substitution\n", (int)(close + (close < end) - p), p);
+        expand_failed = 1;
+    }
+    return close + (close < end);
+}
+
+// After an expansion: a failed one leaves status 1, and the caller doesn't
+// run what it was expanding
+int expansion_failed() {
+    if (!expand_failed) return 0;
+    expand_failed = 0;
+    last_status = 1;
+    return 1;
+}
+
+// Unquoted values are split into fields on blanks and newlines
+void emit_value(Words *w, const char *v, size_t len, int quoted) {
+    if (quoted || w->join) {
+        if (len > 0 || quoted) word_add(w, v, len);
+        return;
+    }
+    const char *end = v + len;
+    while (v < end) {
+        const char *run = v;
+        while (run < end && *run != ' ' && *run != '\t' && *run != '\n') run++;
+        if (run > v) word_add(w, v, run - v);
+        if (run == end) break;
+        word_end(w);
+        v = run + 1;
+    }
+}
+
+void word_add(Words *w, const char *p, size_t n) {
+    ArenaBlock *b = w->arena->head;
+    if (w->word == NULL && (b == NULL || b->used == b->size)) {
+        arena_alloc(w->arena, 0);
+        b = w->arena->head;
+    }
+    if (w->word == NULL) w->word = b->data + b->used;
+    if (b->used + n + 1 > b->size) {
+        // Out of room: the partial word moves to a block at least twice its
+        // size, so each byte is copied a bounded number of times overall
+        size_t need = (w->len + n + 1) * 2;
+        char *old = w->word;
+        b->used -= w->len;
+        char *moved = arena_alloc(w->arena, need > ARENA_BLOCK ? need : ARENA_BLOCK);
+        memmove(moved, old, w->len);   // may land just past old in the same block
+        b = w->arena->head;
+        b->used = moved - b->data + w->len;
+        w->word = moved;
+    }
+    memcpy(b->data + b->used, p, n);
+    b->used += n;
+    w->len += n;
+}
+
+void word_end(Words *w) {
+    if (w->word == NULL) return;
+    ArenaBlock *b = w->arena->head;
+    b->data[b->used++] = '\0';
+    word_push(w, w->word);
+    w->word = NULL;
+    w->len = 0;
+}
+
+void word_push(Words *w, char *word) {
+    if (w->argc == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 16;
+        w->argv = realloc(w->argv, sizeof(char*) * w->cap);
+    }
+    w->argv[w->argc++] = word;
+}
+
+// Cuts the next pipeline stage out of *rest at an unquoted |
+char* next_stage(char **rest) {
+    char *start = *rest;
+    if (start == NULL) return NULL;
+    char *p = (char*)find_unquoted(start, start + strlen(start), "|");
+    *rest = *p == '|' ? p + 1 : NULL;
+    *p = '\0';
+    return start;
+}
+
+// First character from set that isn't quoted or inside (...) or `...`,
+// or end. Scanning from just after "$(" finds its closing paren.
+const char* find_unquoted(const char *p, const char *end, const char *set) {
+    int quote = 0, depth = 0;
+    for (; p < end; p++) {
+        char c = *p;
+        if (c == '\\' && quote != '\'' && p + 1 < end) {
+            p++;
+        } else if (quote == '"' && c == '$' && p + 1 < end && p[1] == '(') {
+            p = find_unquoted(p + 2, end, ")");
+            if (p == end) break;
+        } else if (quote) {
+            if (c == quote) quote = 0;
+        } else if (c == '\'' || c == '"' || c == '`') {
+            quote = c;
+        } else if (depth == 0 && strchr(set, c) != NULL) {
+            return p;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth--;
+        }
+    }
+    return end;
+}
+
+// $(body) or `body`: the output, minus trailing newlines, becomes part of
+// the word (split into fields when unquoted) and $? is the body's status
+void substitute(Words *w, const char *body, size_t len, int quoted) {
+    char *text = malloc(len + 1);
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        // Backticks may escape nested backticks
+        if (body[i] == '\\' && i + 1 < len && body[i + 1] == '`') i++;
+        text[n++] = body[i];
+    }
+    text[n] = '\0';
+    size_t out_len;
+    char *out = command_output(text, &out_len, &last_status);
+    while (out_len > 0 && out[out_len - 1] == '\n') out_len--;
+    emit_value(w, out, out_len, quoted);
+    free(out);
+    free(text);
+}
+
+// Runs a substitution body and collects its stdout. Builtins that only
+// print run right here with stdout swapped for a memory stream. A single
+// external command is started with posix_spawnp (vfork underneath) and read
+// in large blocks. Pipelines, redirections, function calls and assignments
+// go to a forked copy of the shell.
+char* command_output(char *body, size_t *len, int *status) {
+    char *out = NULL;
+    int fds[2];
+    pid_t pid;
+    int wstatus;
+    *len = 0;
+    *status = 0;
+
+    const char *end = body + strlen(body);
+    Arena arena = { NULL };
+    char **argv = find_unquoted(body, end, "|<>&;") == end ? tokenize(body, &arena) : NULL;
+    if (argv != NULL && expand_failed) {
+        expand_failed = 0;
+        *status = 1;
+        arena_free(&arena);
+        return calloc(1, 1);
+    }
+    // A function (they shadow builtins) or an assignment needs the shell
+    if (argv != NULL && argv[0] != NULL && (find_function(argv[0]) != NULL || strchr(argv[0], '=') != NULL)) {
+        arena_free(&arena);
+        argv = NULL;
+    }
+    if (argv != NULL) {
+        if (argv[0] == NULL) {
+            arena_free(&arena);
+            return calloc(1, 1);
+        }
+        if (pure_builtin(argv[0])) {
+            fflush(stdout);
+            FILE *saved = stdout;
+            stdout = open_memstream(&out, len);
+            builtin_text = NULL;
+            handle_builtin(argv);
+            fclose(stdout);
+            stdout = saved;
+            *status = builtin_status;
+            builtin_status = 0;
+            arena_free(&arena);
+            return out;
+        }
+
+        posix_spawn_file_actions_t actions;
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            arena_free(&arena);
+            return calloc(1, 1);
+        }
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+        metrics->forks++;
+        char path[PATH_MAX];
+        int err = posix_spawnp(&pid, env_which(argv[0], path, sizeof(path)), &actions, NULL, argv, env_list());
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[1]);
+        if (err != 0) {
+            errno = err;
+            perror("Command not found...");
+            close(fds[0]);
+            arena_free(&arena);
+            *status = 127;
+            return calloc(1, 1);
+        }
+        metrics->execs++;
+        arena_free(&arena);
+    } else {
+        if (pipe2(fds, O_CLOEXEC) != 0) return calloc(1, 1);
+        fflush(stdout);
+        metrics->forks++;
+        pid = fork();
+        if (pid == 0) {
+            dup2(fds[1], 1);
+            subshell_init();
+            parse_and_execute(body);
+            fflush(stdout);
+            _exit(last_status);
+        }
+        close(fds[1]);
+        if (pid < 0) {
+            close(fds[0]);
+            return calloc(1, 1);
+        }
+    }
+    out = read_all(fds[0], len);
+    close(fds[0]);
+    waitpid(pid, &wstatus, 0);
+    *status = status_code(wstatus);
+    return out;
+}
+
+// Builtins with no side effects besides their output, safe to run in the
+// shell for $(...)
+int pure_builtin(char *name) {
+    Builtin *b = find_builtin(name);
+    return b != NULL && (b->flags & BUILTIN_PURE);
+}
+
+// Reads fd to EOF into one buffer, doubling it as needed
+char* read_all(int fd, size_t *len) {
+    size_t cap = CAPTURE_BUF;
+    char *buf = malloc(cap);
+    *len = 0;
+    while (1) {
+        if (*len == cap) buf = realloc(buf, cap *= 2);
+        ssize_t n = read(fd, buf + *len, cap - *len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        *len += n;
+    }
+    return buf;
+}
+
+// Returns n bytes from the head block, or a fresh block when they don't
+// fit. arena_alloc(a, 0) just starts a new block. Words are packed in
+// unaligned, so the offset is rounded up here rather than relying on n.
+void* arena_alloc(Arena *a, size_t n) {
+    const size_t align = _Alignof(max_align_t);
+    n = (n + align - 1) & ~(align - 1);
+    ArenaBlock *b = a->head;
+    if (b != NULL) b->used = b->used + align - 1 < b->size ? (b->used + align - 1) & ~(align - 1) : b->size;
+    if (b == NULL || b->size - b->used < n || n == 0) {
+        size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        b = malloc(sizeof(ArenaBlock) + size);
+        b->next = a->head;
+        b->used = 0;
+        b->size = size;
+        a->head = b;
+    }
+    void *mem = b->data + b->used;
+    b->used += n;
+    return mem;
+}
+
+void arena_free(Arena *a) {
+    while (a->head != NULL) {
+        ArenaBlock *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
+
+void add_to_history(char* cmd) {
+    if (history_count == HISTORY_SIZE) {
+        free(history[0]);
+        for (int i = 1; i < HISTORY_SIZE; i++) {
+            history[i - 1] = history[i];
+        }
+        history_count--;
+    }
+    history[history_count++] = strdup(cmd);
+    if (!server_mode && !library_mode) hist_add(cmd);
+}
+
+// Reads $HISTFILE into the index and keeps it open for appending
+void hist_load(char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp != NULL) {
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t n;
+        while ((n = getline(&line, &cap, fp)) > 0) {
+            if (line[n - 1] == '\n') line[n - 1] = '\0';
+            hist_add(line);
+        }
+        free(line);
+        fclose(fp);
+    }
+    hist.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+void hist_add(char *line) {
+    size_t len = strlen(line);
+    if (len == 0) return;
+    if (hist.lines == NULL) {
+        hist.lines = calloc(HISTORY_MAX, sizeof(char*));
+        hist.postings = calloc(TRIGRAM_BUCKETS, sizeof(Posting));
+    }
+    if (hist.next > hist.first && strcmp(hist.lines[(hist.next - 1) & (HISTORY_MAX - 1)], line) == 0) return;
+    // A multi-line script wouldn't read back as one entry
+    if (hist.fd >= 0 && strchr(line, '\n') == NULL) dprintf(hist.fd, "%s\n", line);
+    while (hist.next - hist.first == HISTORY_MAX || (hist.bytes + len > HISTORY_BYTES && hist.next > hist.first)) {
+        char **old = &hist.lines[hist.first++ & (HISTORY_MAX - 1)];
+        hist.bytes -= strlen(*old) + 1;
+        free(*old);
+        *old = NULL;
+    }
+    uint32_t id = hist.next++;
+    hist.lines[id & (HISTORY_MAX - 1)] = strdup(line);
+    hist.bytes += len + 1;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        Posting *list = &hist.postings[trigram_bucket(line + i)];
+        if (list->count > list->start && list->ids[list->count - 1] == id) continue;
+        while (list->start < list->count && list->ids[list->start] < hist.first) list->start++;
+        if (list->count == list->cap) {
+            if (list->start > list->count / 2) {
+                // Mostly evicted ids: slide down instead of growing
+                memmove(list->ids, list->ids + list->start, sizeof(uint32_t) * (list->count - list->start));
+                list->count -= list->start;
+                list->start = 0;
+            } else {
+                list->cap = list->cap ? list->cap * 2 : 4;
+                list->ids = realloc(list->ids, sizeof(uint32_t) * list->cap);
+            }
+        }
+        list->ids[list->count++] = id;
+    }
+}
+
+// Entries holding every blank-separated word of the query, in any order
+// and any case, newest first. Each word of three or more characters
+// narrows the candidates through its trigram lists; the shortest list
+// drives, the others are binary searched. The scan stops after
+// SEARCH_SCAN matches or SEARCH_BUDGET_NS, whichever comes first, and
+// what it found is ranked.
+int hist_search(char *query, SearchHit *hits, int max) {
+    long long deadline = now_ns() + SEARCH_BUDGET_NS;
+    if (hist.next == hist.first) return 0;
+    Posting *lists[MAX_LEN], *driver = NULL;
+    int nlists = 0;
+    for (char *p = query; *p; p++) {
+        if (p[0] == ' ' || p[1] == '\0' || p[1] == ' ' || p[2] == '\0' || p[2] == ' ') continue;
+        Posting *list = &hist.postings[trigram_bucket(p)];
+        while (list->start < list->count && list->ids[list->start] < hist.first) list->start++;
+        if (driver == NULL || list->count - list->start < driver->count - driver->start) driver = list;
+        lists[nlists++] = list;
+    }
+
+    SearchHit found[SEARCH_SCAN];
+    int nfound = 0;
+    uint32_t i = driver != NULL ? driver->count : hist.next;
+    uint32_t stop = driver != NULL ? driver->start : hist.first;
+    for (int steps = 1; i > stop && nfound < SEARCH_SCAN; steps++) {
+        uint32_t id = driver != NULL ? driver->ids[--i] : --i;
+        if ((steps & 255) == 0 && now_ns() > deadline) break;
+        int k = 0;
+        while (k < nlists && (lists[k] == driver || posting_has(lists[k], id))) k++;
+        if (k < nlists) continue;
+        char *line = hist.lines[id & (HISTORY_MAX - 1)];
+        int score, dup = 0;
+        if (!hist_match(line, query, &score)) continue;
+        for (k = 0; k < nfound && !dup; k++) dup = strcmp(hist.lines[found[k].id & (HISTORY_MAX - 1)], line) == 0;
+        if (dup) continue;
+        found[nfound].id = id;
+        found[nfound].score = score - nfound;   // newer wins a tie
+        nfound++;
+    }
+
+    // Best first, a stable insertion sort keeps newer ahead
+    for (int a = 1; a < nfound; a++) {
+        SearchHit h = found[a];
+        int b = a;
+        while (b > 0 && found[b - 1].score < h.score) {
+            found[b] = found[b - 1];
+            b--;
+        }
+        found[b] = h;
+    }
+    if (nfound > max) nfound = max;
+    memcpy(hits, found, sizeof(SearchHit) * nfound);
+    return nfound;
+}
+
+// Whether every query word is in line. The score favours the whole query
+// appearing as typed, at the start of the line, and words that start
+// where a word of the line starts.
+int hist_match(char *line, char *query, int *score) {
+    char word[MAX_LEN];
+    int bonus = 0;
+    for (char *p = query; *p; ) {
+        while (*p == ' ') p++;
+        int n = strcspn(p, " ");
+        if (n == 0) break;
+        snprintf(word, sizeof(word), "%.*s", n, p);
+        char *at = strcasestr(line, word);
+        if (at == NULL) return 0;
+        if (at == line || at[-1] == ' ' || at[-1] == '/') bonus += 100;
+        p += n;
+    }
+    char *whole = strcasestr(line, query);
+    if (whole != NULL) bonus += whole == line ? 1500 : 1000;
+    *score = bonus;
+    return 1;
+}
+
+// Case-folded trigram to a bucket
+uint32_t trigram_bucket(const char *p) {
+    uint32_t t = (uint32_t)tolower((unsigned char)p[0]) << 16 | (uint32_t)tolower((unsigned char)p[1]) << 8
+        | (uint32_t)tolower((unsigned char)p[2]);
+    return (t * 2654435761u) >> 16 & (TRIGRAM_BUCKETS - 1);
+}
+
+int posting_has(Posting *list, uint32_t id) {
+    uint32_t lo = list->start, hi = list->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (list->ids[mid] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < list->count && list->ids[lo] == id;
+}
+
+// Returns the new job number, 0 if the table is full or the pid can't be watched
+int add_job(pid_t pid, char* command) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].pid != 0) continue;
+        int pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (pidfd < 0) return 0;
+        jobs[i].pid = pid;
+        jobs[i].pidfd = pidfd;
+        strncpy(jobs[i].command, command, MAX_LEN - 1);
+        jobs[i].command[MAX_LEN - 1] = '\0';
+        jobs[i].status = 0;
+        jobs[i].done = 0;
+        jobs[i].timed_out = 0;
+        jobs[i].owner = current_session;
+        jobs[i].disowned = 0;
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_TAG(EV_JOB, i) };
+        epoll_ctl(loop_epfd, EPOLL_CTL_ADD, pidfd, &ev);
+        job_count++;
+        return i + 1;
+    }
+    return 0;
+}
+
+void remove_job(pid_t pid) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].pid == pid) {
+            if (jobs[i].pidfd >= 0) {
+                epoll_ctl(loop_epfd, EPOLL_CTL_DEL, jobs[i].pidfd, NULL);
+                close(jobs[i].pidfd);
+                jobs[i].pidfd = -1;
+            }
+            jobs[i].pid = 0;
+            job_count--;
+            break;
+        }
+    }
+}
+
+// Called when the job's pidfd turns readable, so this never has to scan
+void reap_job(int slot) {
+    int status;
+    if (waitpid(jobs[slot].pid, &status, WNOHANG) != jobs[slot].pid) return;
+    jobs[slot].status = status_code(status);
+    if (jobs[slot].timed_out) jobs[slot].status = jobs[slot].timed_out == 2 ? 128 + SIGKILL : TIMEOUT_STATUS;
+    jobs[slot].done = 1;
+    if (jobs[slot].status != 0) metrics->failures++;
+    epoll_ctl(loop_epfd, EPOLL_CTL_DEL, jobs[slot].pidfd, NULL);
+    close(jobs[slot].pidfd);
+    jobs[slot].pidfd = -1;
+    if (jobs[slot].disowned) remove_job(jobs[slot].pid);
+}
+
+// Announces finished jobs; only called right before a prompt is printed
+void notify_jobs() {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].pid == 0 || !jobs[i].done || jobs[i].owner != current_session) continue;
+        if (jobs[i].timed_out) {
+            printf("[%d] Timeout  %s\n", i + 1, jobs[i].command);
+        } else if (jobs[i].status == 0) {
+            printf("[%d] Done  %s\n", i + 1, jobs[i].command);
+        } else {
+            printf("[%d] Exit %d  %s\n", i + 1, jobs[i].status, jobs[i].command);
+        }
+        remove_job(jobs[i].pid);
+    }
+}
+
+// Finished jobs are listed once and then dropped from the table. Sessions
+// share the table but each sees only its own jobs.
+// Finished jobs are dropped once listed, unless reap is 0
+void list_jobs(int reap) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].pid == 0 || jobs[i].owner != current_session) continue;
+        if (!jobs[i].done) {
+            printf("[%d] %d Running %s\n", i + 1, jobs[i].pid, jobs[i].command);
+        } else if (jobs[i].timed_out) {
+            printf("[%d] %d Timeout(%d) %s\n", i + 1, jobs[i].pid, jobs[i].status, jobs[i].command);
+        } else {
+            printf("[%d] %d Done(%d) %s\n", i + 1, jobs[i].pid, jobs[i].status, jobs[i].command);
+        }
+        if (jobs[i].done && reap) remove_job(jobs[i].pid);
+    }
+}
+
+// The new entry copies value before the old one is released, so value may
+// come from get_var(name)
+void set_var(char *name, char *value, int global) {
+    if (global) {
+        save_env(name);
+        env_set(name, value);
+    }
+    VarNode *root = var_insert(vars, var_leaf(name, value, global, var_hash(name)), 0);
+    var_unref(vars);
+    vars = root;
+}
+
+void unset_var(char *name) {
+    VarNode *old = var_find(vars, name);
+    if (old == NULL) return;
+    if (old->global) {
+        save_env(name);
+        env_set(name, NULL);
+    }
+    VarNode *root = var_remove(vars, name, old->hash, 0);
+    var_unref(vars);
+    vars = root;
+}
+
+char* get_var(char *name) {
+    VarNode *leaf = var_find(vars, name);
+    return leaf != NULL ? leaf->value : env_get(name);
+}
+
+// A session's environment is a list of its own, so what it exports never
+// shows up in the server's or the embedding host's; a plain shell uses
+// the real one
+char* env_get(char *name) {
+    if (shell_env == NULL) return getenv(name);
+    size_t n = strlen(name);
+    for (char **e = shell_env; *e != NULL; e++) {
+        if (strncmp(*e, name, n) == 0 && (*e)[n] == '=') return *e + n + 1;
+    }
+    return NULL;
+}
+
+// value NULL unsets
+void env_set(char *name, char *value) {
+    if (shell_env == NULL) {
+        if (value != NULL) setenv(name, value, 1);
+        else unsetenv(name);
+        return;
+    }
+    size_t n = strlen(name);
+    int i = 0;
+    while (shell_env[i] != NULL && !(strncmp(shell_env[i], name, n) == 0 && shell_env[i][n] == '=')) i++;
+    if (shell_env[i] == NULL) {
+        if (value == NULL) return;
+        shell_env = realloc(shell_env, sizeof(char*) * (i + 2));
+        shell_env[i + 1] = NULL;
+    } else {
+        free(shell_env[i]);
+        if (value == NULL) {
+            for (; shell_env[i] != NULL; i++) shell_env[i] = shell_env[i + 1];
+            return;
+        }
+    }
+    shell_env[i] = malloc(n + strlen(value) + 2);
+    sprintf(shell_env[i], "%s=%s", name, value);
+}
+
+// What a started program gets
+char** env_list() {
+    return shell_env != NULL ? shell_env : environ;
+}
+
+char** env_copy(char **env) {
+    int n = 0;
+    while (env[n] != NULL) n++;
+    char **copy = malloc(sizeof(char*) * (n + 1));
+    for (int i = 0; i < n; i++) copy[i] = strdup(env[i]);
+    copy[n] = NULL;
+    return copy;
+}
+
+void env_free(char **env) {
+    if (env == NULL) return;
+    for (int i = 0; env[i] != NULL; i++) free(env[i]);
+    free(env);
+}
+
+// posix_spawnp searches the process's $PATH, so a session's own is
+// searched here. Returns name when there is nothing to resolve, else a
+// path: the program, or the last miss so the spawn fails as execvp would.
+char* env_which(char *name, char *buf, size_t len) {
+    char *path = env_get("PATH");
+    if (shell_env == NULL || path == NULL || strchr(name, '/') != NULL) return name;
+    snprintf(buf, len, "./%s", name);
+    while (*path != '\0') {
+        size_t n = strcspn(path, ":");
+        snprintf(buf, len, "%.*s/%s", (int)n, n > 0 ? path : ".", name);
+        if (access(buf, X_OK) == 0) return buf;
+        path += n + (path[n] == ':');
+    }
+    return buf;
+}
+
+void collect_var(VarNode *leaf, void *arg) {
+    VarList *list = arg;
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 32;
+        list->leaves = realloc(list->leaves, sizeof(VarNode*) * list->cap);
+    }
+    list->leaves[list->count++] = leaf;
+}
+
+int compare_vars(const void *a, const void *b) {
+    return strcmp((*(VarNode**)a)->name, (*(VarNode**)b)->name);
+}
+
+void list_vars() {
+    VarList list = { NULL };
+    var_each(vars, collect_var, &list);
+    qsort(list.leaves, list.count, sizeof(VarNode*), compare_vars);
+    printf("Local and environment variables:\n");
+    for (int i = 0; i < list.count; i++) {
+        printf("%s=%s (local)\n", list.leaves[i]->name, list.leaves[i]->value);
+    }
+    free(list.leaves);
+}
+
+uint64_t var_hash(const char *name) {
+    uint64_t h = 14695981039346656037ull;
+    for (; *name; name++) {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+VarNode* var_leaf(const char *name, const char *value, int global, uint64_t hash) {
+    VarNode *leaf = calloc(1, sizeof(VarNode));
+    leaf->refs = 1;
+    leaf->leaf = 1;
+    leaf->hash = hash;
+    leaf->name = strdup(name);
+    leaf->value = strdup(value);
+    leaf->global = global;
+    return leaf;
+}
+
+VarNode* var_inner(uint32_t bitmap) {
+    VarNode *node = calloc(1, sizeof(VarNode) + sizeof(VarNode*) * __builtin_popcount(bitmap));
+    node->refs = 1;
+    node->bitmap = bitmap;
+    return node;
+}
+
+VarNode* var_ref(VarNode *node) {
+    if (node != NULL) node->refs++;
+    return node;
+}
+
+void var_unref(VarNode *node) {
+    if (node == NULL || --node->refs > 0) return;
+    if (node->leaf) {
+        free(node->name);
+        free(node->value);
+        var_unref(node->next);
+    } else {
+        for (int i = 0; i < __builtin_popcount(node->bitmap); i++) var_unref(node->kids[i]);
+    }
+    free(node);
+}
+
+VarNode* var_find(VarNode *node, const char *name) {
+    uint64_t h = var_hash(name);
+    for (int shift = 0; node != NULL && !node->leaf; shift += VAR_BITS) {
+        uint32_t bit = 1u << ((h >> shift) & 31);
+        if (!(node->bitmap & bit)) return NULL;
+        node = node->kids[__builtin_popcount(node->bitmap & (bit - 1))];
+    }
+    for (; node != NULL; node = node->next) {
+        if (node->hash == h && strcmp(node->name, name) == 0) return node;
+    }
+    return NULL;
+}
+
+// A new trie with leaf in place of any variable of the same name. node is
+// left as it was; leaf must be fresh, and its reference passes to the trie.
+VarNode* var_insert(VarNode *node, VarNode *leaf, int shift) {
+    if (node == NULL) return leaf;
+    if (node->leaf) {
+        if (node->hash == leaf->hash) {
+            leaf->next = var_chain_without(node, leaf->name);
+            return leaf;
+        }
+        uint32_t a = (node->hash >> shift) & 31, b = (leaf->hash >> shift) & 31;
+        VarNode *inner = var_inner((1u << a) | (1u << b));
+        if (a == b) {
+            inner->kids[0] = var_insert(node, leaf, shift + VAR_BITS);
+        } else {
+            inner->kids[a < b ? 0 : 1] = var_ref(node);
+            inner->kids[a < b ? 1 : 0] = leaf;
+        }
+        return inner;
+    }
+    uint32_t bit = 1u << ((leaf->hash >> shift) & 31);
+    int at = __builtin_popcount(node->bitmap & (bit - 1)), n = __builtin_popcount(node->bitmap);
+    int present = (node->bitmap & bit) != 0;
+    VarNode *copy = var_inner(node->bitmap | bit);
+    for (int i = 0, j = 0; i < n; i++, j++) {
+        if (i == at && !present) j++;
+        if (i != at || !present) copy->kids[j] = var_ref(node->kids[i]);
+    }
+    copy->kids[at] = present ? var_insert(node->kids[at], leaf, shift + VAR_BITS) : leaf;
+    return copy;
+}
+
+// A new trie without name (NULL when nothing is left), or node with one
+// more reference when name isn't in it
+VarNode* var_remove(VarNode *node, const char *name, uint64_t hash, int shift) {
+    if (node == NULL) return NULL;
+    if (node->leaf) {
+        VarNode *leaf = node;
+        while (leaf != NULL && (leaf->hash != hash || strcmp(leaf->name, name) != 0)) leaf = leaf->next;
+        return leaf != NULL ? var_chain_without(node, name) : var_ref(node);
+    }
+    uint32_t bit = 1u << ((hash >> shift) & 31);
+    if (!(node->bitmap & bit)) return var_ref(node);
+    int at = __builtin_popcount(node->bitmap & (bit - 1)), n = __builtin_popcount(node->bitmap);
+    VarNode *kid = var_remove(node->kids[at], name, hash, shift + VAR_BITS);
+    if (kid == node->kids[at]) {
+        var_unref(kid);
+        return var_ref(node);
+    }
+    if (kid == NULL && n == 1) return NULL;
+    VarNode *copy = var_inner(kid != NULL ? node->bitmap : node->bitmap & ~bit);
+    for (int i = 0, j = 0; i < n; i++) {
+        if (i != at) copy->kids[j++] = var_ref(node->kids[i]);
+        else if (kid != NULL) copy->kids[j++] = kid;
+    }
+    return copy;
+}
+
+// Copies a collision chain up to name and shares the rest after it
+VarNode* var_chain_without(VarNode *chain, const char *name) {
+    if (chain == NULL) return NULL;
+    if (strcmp(chain->name, name) == 0) return var_ref(chain->next);
+    VarNode *copy = var_leaf(chain->name, chain->value, chain->global, chain->hash);
+    copy->next = var_chain_without(chain->next, name);
+    return copy;
+}
+
+void var_each(VarNode *node, void (*fn)(VarNode *leaf, void *arg), void *arg) {
+    if (node == NULL) return;
+    if (!node->leaf) {
+        for (int i = 0; i < __builtin_popcount(node->bitmap); i++) var_each(node->kids[i], fn, arg);
+        return;
+    }
+    for (; node != NULL; node = node->next) fn(node, arg);
+}
+
+// Inside a scope the environment is shared with the rest of the shell, so
+// an export first records what it replaces
+void save_env(char *name) {
+    if (scope_depth == 0) return;
+    EnvSave *e = malloc(sizeof(EnvSave));
+    char *old = env_get(name);
+    e->name = strdup(name);
+    e->value = old != NULL ? strdup(old) : NULL;
+    e->next = env_saved;
+    env_saved = e;
+}
+
+int scope_enter(VarScope *scope) {
+    scope->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (scope->cwd_fd < 0) return -1;
+    scope->vars = var_ref(vars);
+    scope->env = env_saved;
+    scope_depth++;
+    return 0;
+}
+
+void scope_leave(VarScope *scope) {
+    var_unref(vars);
+    vars = scope->vars;
+    if (fchdir(scope->cwd_fd) != 0) perror("subshell: cwd");
+    close(scope->cwd_fd);
+    while (env_saved != scope->env) {
+        EnvSave *e = env_saved;
+        env_set(e->name, e->value);
+        env_saved = e->next;
+        free(e->name);
+        free(e->value);
+        free(e);
+    }
+    scope_depth--;
+}
+
+// ( body ) whose commands only touch what a scope restores runs right in
+// the shell; anything else gets a forked copy of the shell
+void run_subshell(Program *body) {
+    VarScope scope;
+    if (subshell_in_process(body) && scope_enter(&scope) == 0) {
+        run_program(body);
+        scope_leave(&scope);
+        return;
+    }
+    fflush(stdout);
+    metrics->forks++;
+    pid_t pid = fork();
+    if (pid == 0) {
+        subshell_init();
+        run_program(body);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (pid < 0) {
+        perror("fork");
+        last_status = 1;
+        return;
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    last_status = status_code(status);
+}
+
+int subshell_in_process(Program *prog) {
+    for (int i = 0; i < prog->count; i++) {
+        Insn *in = &prog->code[i];
+        if (in->op == OP_DEFUN || in->op == OP_RETURN) return 0;
+        if (in->op == OP_SUBSHELL && !subshell_in_process(in->body)) return 0;
+        if (in->op != OP_CMD) continue;
+        if (!in->builtin || find_function(in->name) != NULL) return 0;
+        Builtin *b = find_builtin(in->name);
+        if (b == NULL || !(b->flags & BUILTIN_SCOPED)) return 0;
+    }
+    return 1;
+}
+
+// local NAME[=value]...: the names get their old values back when the
+// function returns
+int builtin_local(char* arglist[]) {
+    if (local_frame == NULL) {
+        fprintf(stderr, "local: can only be used in a function\n");
+        return 1;
+    }
+    int status = 0;
+    for (int i = 1; arglist[i] != NULL; i++) {
+        char *eq = strchr(arglist[i], '=');
+        char *name = eq != NULL ? strndup(arglist[i], eq - arglist[i]) : strdup(arglist[i]);
+        int seen = 0;
+        for (int k = 0; k < local_frame->count; k++) seen |= strcmp(local_frame->names[k], name) == 0;
+        if (!seen && local_frame->count == MAX_LOCALS) {
+            fprintf(stderr, "local: too many local variables\n");
+            free(name);
+            status = 1;
+            continue;
+        }
+        if (!seen) {
+            local_frame->saved[local_frame->count] = var_ref(var_find(vars, name));
+            local_frame->names[local_frame->count++] = strdup(name);
+        }
+        if (eq != NULL) set_var(name, eq + 1, 0);
+        else unset_var(name);
+        free(name);
+    }
+    return status;
+}
+
+void restore_locals(LocalFrame *frame) {
+    for (int i = frame->count - 1; i >= 0; i--) {
+        VarNode *old = frame->saved[i];
+        if (old != NULL) set_var(old->name, old->value, old->global);
+        else unset_var(frame->names[i]);
+        var_unref(old);
+        free(frame->names[i]);
+    }
+}
+
+// Runs arglist[0] if it is a builtin; returns 1 when it isn't (or declines,
+// like cp with options) so the caller runs the real command
+int handle_builtin(char* arglist[]) {
+    Builtin *b = find_builtin(arglist[0]);
+    if (b == NULL) return 1;
+    int status;
+    if (b->ext != NULL) {
+        int argc = 0;
+        while (arglist[argc] != NULL) argc++;
+        status = b->ext->run(argc, arglist);
+        fflush(stdout);
+    } else {
+        status = b->run(arglist);
+    }
+    if (status == BUILTIN_DECLINE) return 1;
+    builtin_status = status;
+    return 0;
+}
+
+int builtin_set(char* arglist[]) {
+    list_vars();
+    return 0;
+}
+
+int builtin_export(char* arglist[]) {
+    if (arglist[1] == NULL) {
+        printf("Usage: export <variable>[=value]...\n");
+        return 0;
+    }
+    for (int i = 1; arglist[i] != NULL; i++) {
+        char *eq = strchr(arglist[i], '=');
+        if (eq != NULL) {
+            *eq = '\0';
+            set_var(arglist[i], eq + 1, 1);
+        } else {
+            char *value = get_var(arglist[i]);
+            set_var(arglist[i], value != NULL ? value : "", 1);
+        }
+    }
+    return 0;
+}
+
+int builtin_cd(char* arglist[]) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "cd: missing argument\n");
+        return 1;
+    }
+    if (chdir(arglist[1]) != 0) {
+        perror("cd failed");
+        return 1;
+    }
+    return 0;
+}
+
+// exit [N]: N defaults to the last command's status
+int builtin_exit(char* arglist[]) {
+    int status = last_status;
+    if (arglist[1] != NULL) {
+        char *end;
+        long n = strtol(arglist[1], &end, 10);
+        if (end == arglist[1] || *end != '\0') {
+            fprintf(stderr, "exit: %s: numeric argument required\n", arglist[1]);
+            n = 2;
+        }
+        status = n & 0xff;
+    }
+    // A session, or the forked copy running its script, ends after the reply
+    if (current_session != NULL) {
+        session_exit = 1;
+        return status;
+    }
+    exit(status);
+}
+
+int builtin_jobs(char* arglist[]) {
+    // Inside $(...) it runs in the shell, but like a subshell it must
+    // leave the finished jobs for the next jobs to report
+    list_jobs(builtin_text != NULL);
+    return 0;
+}
+
+// worker, trace, stats and record report through builtin_status themselves
+int builtin_worker(char* arglist[]) {
+    worker_builtin(arglist);
+    return builtin_status;
+}
+
+int builtin_trace(char* arglist[]) {
+    trace_builtin(arglist);
+    return builtin_status;
+}
+
+int builtin_stats(char* arglist[]) {
+    stats_builtin(arglist);
+    return builtin_status;
+}
+
+int builtin_record(char* arglist[]) {
+    record_builtin(arglist);
+    return builtin_status;
+}
+
+int builtin_true(char* arglist[]) {
+    return 0;
+}
+
+int builtin_false(char* arglist[]) {
+    return 1;
+}
+
+int builtin_echo(char* arglist[]) {
+    int newline = arglist[1] == NULL || strcmp(arglist[1], "-n") != 0;
+    for (int i = newline ? 1 : 2; arglist[i] != NULL; i++) {
+        printf(arglist[i + 1] != NULL ? "%s " : "%s", arglist[i]);
+    }
+    if (newline) printf("\n");
+    return 0;
+}
+
+int builtin_basename(char* arglist[]) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "%s: missing operand\n", arglist[0]);
+        return 1;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", arglist[1]);
+    size_t n = strlen(path);
+    while (n > 1 && path[n - 1] == '/') path[--n] = '\0';
+    char *slash = strrchr(path, '/');
+    if (arglist[0][0] == 'b') {
+        char *base = slash != NULL && slash[1] != '\0' ? slash + 1 : path;
+        size_t blen = strlen(base), slen = arglist[2] != NULL ? strlen(arglist[2]) : 0;
+        if (slen > 0 && slen < blen && strcmp(base + blen - slen, arglist[2]) == 0) base[blen - slen] = '\0';
+        printf("%s\n", base);
+    } else if (slash == NULL) {
+        printf(".\n");
+    } else {
+        while (slash > path && slash[-1] == '/') slash--;
+        if (slash == path) slash++;
+        *slash = '\0';
+        printf("%s\n", path);
+    }
+    return 0;
+}
+
+// Plain "cp SRC DST" only, anything with options is the real cp
+int builtin_cp(char* arglist[]) {
+    if (arglist[1] == NULL || arglist[1][0] == '-' || arglist[2] == NULL || arglist[2][0] == '-'
+            || arglist[3] != NULL) {
+        return BUILTIN_DECLINE;
+    }
+    return cp_builtin(arglist);
+}
+
+// enable               list builtins, loaded ones marked
+// enable -f LIB NAME.. load NAME_builtin from the shared object LIB
+// enable -d NAME..     drop loaded builtins
+int builtin_enable(char* arglist[]) {
+    if (arglist[1] == NULL) {
+        for (int i = 0; i < builtin_count; i++) {
+            printf("enable %s%s\n", builtins[i].name, builtins[i].ext != NULL ? " (loaded)" : "");
+        }
+        return 0;
+    }
+    int status = 0;
+    if (strcmp(arglist[1], "-f") == 0 && arglist[2] != NULL && arglist[3] != NULL) {
+        for (int i = 3; arglist[i] != NULL; i++) {
+            if (load_builtin(arglist[2], arglist[i]) != 0) status = 1;
+        }
+    } else if (strcmp(arglist[1], "-d") == 0 && arglist[2] != NULL) {
+        for (int i = 2; arglist[i] != NULL; i++) {
+            Builtin *b = find_builtin(arglist[i]);
+            if (b == NULL || b->ext == NULL) {
+                fprintf(stderr, "enable: %s: not a loaded builtin\n", arglist[i]);
+                status = 1;
+                continue;
+            }
+            // The library stays mapped, a running script may still be in it.
+            // A core builtin it stood in for comes back.
+            if (b->run != NULL) {
+                b->flags = b->core_flags;
+                b->ext = NULL;
+                continue;
+            }
+            free((char*)b->name);
+            *b = builtins[--builtin_count];
+            builtin_table_build();
+        }
+    } else {
+        fprintf(stderr, "Usage: enable [-f LIBRARY NAME... | -d NAME...]\n");
+        status = 2;
+    }
+    return status;
+}
+
+// The table is rebuilt as a perfect hash: a seed is searched for until
+// every name lands in its own slot, so a lookup is one hash and one strcmp
+// however many builtins there are
+void builtin_table_build() {
+    int size = 16;
+    while (size < builtin_count * 4) size *= 2;
+    while (1) {
+        int *slots = malloc(sizeof(int) * size);
+        for (uint32_t seed = 1; seed < 100000; seed++) {
+            int i;
+            memset(slots, -1, sizeof(int) * size);
+            for (i = 0; i < builtin_count; i++) {
+                uint32_t h = builtin_hash(builtins[i].name, seed) & (size - 1);
+                if (slots[h] >= 0) break;
+                slots[h] = i;
+            }
+            if (i < builtin_count) continue;
+            free(builtin_slots);
+            builtin_slots = slots;
+            builtin_seed = seed;
+            builtin_mask = size - 1;
+            return;
+        }
+        free(slots);
+        size *= 2;
+    }
+}
+
+uint32_t builtin_hash(const char *name, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (; *name; name++) {
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+Builtin* find_builtin(char *name) {
+    if (builtin_slots == NULL) builtin_table_build();
+    int i = builtin_slots[builtin_hash(name, builtin_seed) & builtin_mask];
+    return i >= 0 && strcmp(builtins[i].name, name) == 0 ? &builtins[i] : NULL;
+}
+
+int load_builtin(char *path, char *name) {
+    char symbol[128];
+    void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (lib == NULL) {
+        fprintf(stderr, "enable: %s\n", dlerror());
+        return 1;
+    }
+    snprintf(symbol, sizeof(symbol), "%s_builtin", name);
+    struct shell_builtin *ext = dlsym(lib, symbol);
+    if (ext == NULL || ext->abi != SHELL_BUILTIN_ABI || ext->run == NULL) {
+        fprintf(stderr, "enable: %s: %s\n", path, ext == NULL ? "no such builtin" : "incompatible builtin");
+        dlclose(lib);
+        return 1;
+    }
+    Builtin *b = find_builtin(name);
+    if (b == NULL) {
+        if (builtin_count == MAX_BUILTINS) {
+            fprintf(stderr, "enable: too many builtins\n");
+            return 1;
+        }
+        b = &builtins[builtin_count++];
+        b->name = strdup(name);
+        b->run = NULL;
+    } else if (b->run != NULL && b->ext == NULL) {
+        // Over a core builtin: it is kept for enable -d
+        b->core_flags = b->flags;
+    }
+    b->flags = ext->flags & SHELL_BUILTIN_PURE ? BUILTIN_PURE : 0;
+    b->ext = ext;
+    builtin_table_build();
+    return 0;
+}
+
+// on-change [-d MS] [-p queue|cancel] [-r] PATH... -- CMD...
+// Runs CMD whenever something under the paths changes, once a burst of
+// events has been quiet for MS (100 by default). A change during a run
+// queues one more run afterwards, or with -p cancel stops the run and
+// starts over. -r watches directories recursively. Ends on ^C.
+int builtin_on_change(char* arglist[]) {
+    long debounce = DEBOUNCE_MS;
+    int cancel = 0, i = 1;
+    Watch w;
+    memset(&w, 0, sizeof(w));
+    for (; arglist[i] != NULL && arglist[i][0] == '-' && strcmp(arglist[i], "--") != 0; i++) {
+        if (strcmp(arglist[i], "-d") == 0 && arglist[i + 1] != NULL) debounce = atol(arglist[++i]);
+        else if (strcmp(arglist[i], "-p") == 0 && arglist[i + 1] != NULL) cancel = strcmp(arglist[++i], "cancel") == 0;
+        else if (strcmp(arglist[i], "-r") == 0) w.recursive = 1;
+        else break;
+    }
+    int paths = i;
+    while (arglist[i] != NULL && strcmp(arglist[i], "--") != 0) i++;
+    if (i == paths || arglist[i] == NULL || arglist[i + 1] == NULL || debounce < 0) {
+        fprintf(stderr, "Usage: on-change [-d MS] [-p queue|cancel] [-r] PATH... -- COMMAND\n");
+        return 2;
+    }
+    if (server_mode || active_watch != NULL) {
+        fprintf(stderr, "on-change: only one, and not in server mode\n");
+        return 1;
+    }
+
+    // The command is kept as typed, so its quotes and $ are taken at each
+    // run. Without the text, as in $(...), the words go back into a line.
+    char *cmd = builtin_text != NULL ? text_after_dashes(builtin_text) : NULL;
+    if (cmd == NULL) {
+        size_t len = 0;
+        for (int k = i + 1; arglist[k] != NULL; k++) len += strlen(arglist[k]) + 1;
+        cmd = malloc(len + 1);
+        cmd[0] = '\0';
+        for (int k = i + 1; arglist[k] != NULL; k++) {
+            strcat(cmd, arglist[k]);
+            if (arglist[k + 1] != NULL) strcat(cmd, " ");
+        }
+    }
+
+    w.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    w.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    w.pidfd = -1;
+    int status = 0;
+    for (int k = paths; k < i && status == 0; k++) {
+        if (watch_add(&w, arglist[k]) != 0) status = 1;
+    }
+    if (w.inotify_fd < 0 || w.timer_fd < 0) status = 1;
+    if (status == 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_TAG(EV_WATCH, WATCH_INOTIFY) };
+        epoll_ctl(loop_epfd, EPOLL_CTL_ADD, w.inotify_fd, &ev);
+        ev.data.u64 = EV_TAG(EV_WATCH, WATCH_TIMER);
+        epoll_ctl(loop_epfd, EPOLL_CTL_ADD, w.timer_fd, &ev);
+    }
+
+    struct sigaction stop = { .sa_handler = watch_interrupt }, old_int;
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, &old_int);
+    watch_stop = 0;
+    active_watch = &w;
+    pid_t running = 0;
+    int runs = 0, pending = 0;
+    long long pending_change = 0;
+    int pending_events = 0;
+    while (status == 0 && !watch_stop) {
+        run_events(-1);
+        if (w.changed) {
+            w.changed = 0;
+            int before = w.events;
+            watch_read(&w);
+            if (w.events > before) {
+                // Every change pushes the deadline back: the run waits for quiet
+                struct itimerspec its = { .it_value = { debounce / 1000, (debounce % 1000) * 1000000L } };
+                if (debounce == 0) its.it_value.tv_nsec = 1;
+                timerfd_settime(w.timer_fd, 0, &its, NULL);
+            }
+        }
+        if (w.fired) {
+            uint64_t expirations;
+            w.fired = 0;
+            if (read(w.timer_fd, &expirations, sizeof(expirations)) < 0) continue;
+            pending = 1;
+            pending_change = w.last_change;
+            pending_events += w.events;
+            w.events = 0;
+            if (running > 0 && cancel) kill(-running, SIGTERM);
+        }
+        if (w.exited) {
+            int wstatus;
+            w.exited = 0;
+            waitpid(running, &wstatus, 0);
+            epoll_ctl(loop_epfd, EPOLL_CTL_DEL, w.pidfd, NULL);
+            close(w.pidfd);
+            w.pidfd = -1;
+            running = 0;
+            printf("on-change: run %d %s %d\n", runs, WIFSIGNALED(wstatus) ? "stopped by signal" : "exited",
+                   WIFSIGNALED(wstatus) ? WTERMSIG(wstatus) : WEXITSTATUS(wstatus));
+            fflush(stdout);
+        }
+        if (pending && running == 0) {
+            pending = 0;
+            running = watch_start(cmd, pending_change, ++runs, pending_events);
+            pending_events = 0;
+            if (running > 0) {
+                w.pidfd = syscall(SYS_pidfd_open, running, 0);
+                struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_TAG(EV_WATCH, WATCH_CHILD) };
+                epoll_ctl(loop_epfd, EPOLL_CTL_ADD, w.pidfd, &ev);
+            }
+        }
+    }
+
+    if (running > 0) {
+        kill(-running, SIGTERM);
+        waitpid(running, NULL, 0);
+        epoll_ctl(loop_epfd, EPOLL_CTL_DEL, w.pidfd, NULL);
+        close(w.pidfd);
+    }
+    active_watch = NULL;
+    sigaction(SIGINT, &old_int, NULL);
+    if (w.inotify_fd >= 0) {
+        epoll_ctl(loop_epfd, EPOLL_CTL_DEL, w.inotify_fd, NULL);
+        close(w.inotify_fd);
+    }
+    if (w.timer_fd >= 0) {
+        epoll_ctl(loop_epfd, EPOLL_CTL_DEL, w.timer_fd, NULL);
+        close(w.timer_fd);
+    }
+    for (int k = 0; k < w.nwatches; k++) free(w.dirs[k]);
+    free(cmd);
+    if (watch_stop) printf("\n");
+    return status;
+}
+
+// Watches path, and with -r every directory below it
+int watch_add(Watch *w, char *path) {
+    if (w->nwatches == MAX_WATCHES) {
+        fprintf(stderr, "on-change: too many directories\n");
+        return 1;
+    }
+    int wd = inotify_add_watch(w->inotify_fd, path, WATCH_MASK);
+    if (wd < 0) {
+        fprintf(stderr, "on-change: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    w->wd[w->nwatches] = wd;
+    w->parent_wd[w->nwatches] = -1;
+    w->dirs[w->nwatches++] = strdup(path);
+    struct stat st;
+    if (!w->recursive || stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) return 0;
+    DIR *d = opendir(path);
+    if (d == NULL) return 0;
+    struct dirent *ent;
+    int status = 0;
+    while (status == 0 && (ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.' || ent->d_type != DT_DIR) continue;
+        char sub[PATH_MAX];
+        snprintf(sub, sizeof(sub), "%s/%s", path, ent->d_name);
+        status = watch_add(w, sub);
+    }
+    closedir(d);
+    return status;
+}
+
+// Counts the queued events; new directories join a recursive watch. A
+// path that is deleted or renamed away, as editors do when they save over
+// it, is watched again.
+void watch_read(Watch *w) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(w->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event *ev = (struct inotify_event*)p;
+            int ours = 0;
+            for (int k = 0; k < w->nwatches; k++) {
+                if (w->wd[k] == ev->wd) {
+                    ours = 1;
+                    // A moved inode keeps its watch, the path needs a new one
+                    if (ev->mask & IN_MOVE_SELF) inotify_rm_watch(w->inotify_fd, ev->wd);
+                    if (ev->mask & (IN_IGNORED | IN_MOVE_SELF)) watch_lost(w, k);
+                } else if (w->wd[k] < 0 && w->parent_wd[k] == ev->wd && (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                           && strcmp(ev->name, strrchr(w->dirs[k], '/') != NULL ? strrchr(w->dirs[k], '/') + 1 : w->dirs[k]) == 0) {
+                    ours = 1;
+                    watch_lost(w, k);
+                }
+            }
+            // IN_IGNORED follows the delete that was already counted
+            if (!ours || (ev->mask & IN_IGNORED)) continue;
+            if (w->recursive && (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && ev->name[0] != '.') {
+                for (int k = 0; k < w->nwatches; k++) {
+                    if (w->wd[k] != ev->wd) continue;
+                    char sub[PATH_MAX];
+                    snprintf(sub, sizeof(sub), "%s/%s", w->dirs[k], ev->name);
+                    watch_add(w, sub);
+                    break;
+                }
+            }
+            w->events++;
+            w->last_change = now_ns();
+        }
+    }
+}
+
+// One run: a copy of the shell in its own process group, so cancelling
+// also stops whatever the command started
+pid_t watch_start(char *cmd, long long changed_at, int run, int events) {
+    fflush(stdout);
+    metrics->forks++;
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL);
+        // A cancelled run still shows what it printed
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        subshell_init();
+        parse_and_execute(cmd);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (pid < 0) {
+        perror("on-change");
+        return 0;
+    }
+    setpgid(pid, pid);
+    printf("on-change: run %d after %d change%s, started %.1f ms after the last one\n", run, events,
+           events == 1 ? "" : "s", (now_ns() - changed_at) / 1e6);
+    fflush(stdout);
+    return pid;
+}
+
+void watch_interrupt(int sig) {
+    watch_stop = 1;
+}
+
+// Watches path k again, or while nothing is there, its directory for the
+// name to reappear. IN_MASK_ADD keeps a watch the directory already has.
+void watch_lost(Watch *w, int k) {
+    w->wd[k] = inotify_add_watch(w->inotify_fd, w->dirs[k], WATCH_MASK);
+    if (w->wd[k] >= 0 || w->parent_wd[k] >= 0) return;
+    char dir[PATH_MAX];
+    char *slash = strrchr(w->dirs[k], '/');
+    if (slash == NULL) snprintf(dir, sizeof(dir), ".");
+    else snprintf(dir, sizeof(dir), "%.*s", slash == w->dirs[k] ? 1 : (int)(slash - w->dirs[k]), w->dirs[k]);
+    w->parent_wd[k] = inotify_add_watch(w->inotify_fd, dir, IN_MASK_ADD | IN_CREATE | IN_MOVED_TO);
+}
+
+// The text after the first unquoted "--" word of line, NULL if none
+char* text_after_dashes(const char *line) {
+    const char *p = line, *end = line + strlen(line);
+    while (p < end) {
+        p += strspn(p, " \t");
+        const char *word = find_unquoted(p, end, " \t");
+        if (word - p == 2 && p[0] == '-' && p[1] == '-') return strdup(word + strspn(word, " \t"));
+        p = word;
+    }
+    return NULL;
+}
+
+// A forked copy of the shell that runs command lines itself: its own event
+// loop, and no helper or history file, which belong to the parent
+void subshell_init() {
+    close(loop_epfd);
+    close(timer_fd);
+    close(filter_event_fd);
+    event_loop_init();
+    server_mode = 0;
+    library_mode = 0;
+    // The helper's clones would be the parent shell's children
+    if (spawn_fd >= 0) close(spawn_fd);
+    spawn_fd = -1;
+    if (hist.fd >= 0) close(hist.fd);
+    hist.fd = -1;
+    // A cached < fd would share its offset with the parent
+    fd_cache_trim(0);
+    // Reading the PATH trie's inotify queue would take the parent's events
+    path_trie_free();
+}
+
+// Starts every stage of the pipeline before waiting on any of them. In
+// server mode the foreground stages are left in fg for the caller.
+int handle_redirection_and_pipes(char* cmdline) {
+    int pipefd[2];
+    pid_t pid;
+    int in_fd = 0;
+    int background = 0;
+    int instrument = 0;
+    PipeLink links[MAX_STAGES];
+    int link_count = 0;
+    char job_cmd[MAX_LEN];
+    long long cmd_start = now_ns();
+
+    int len = strlen(cmdline);
+    while (len > 0 && (cmdline[len - 1] == ' ' || cmdline[len - 1] == '\t')) len--;
+    if (len > 0 && cmdline[len - 1] == '&') {
+        background = 1;
+        len--;
+        while (len > 0 && (cmdline[len - 1] == ' ' || cmdline[len - 1] == '\t')) len--;
+    }
+    cmdline[len] = '\0';
+    if (strncmp(cmdline, "pipestat", 8) == 0 && (cmdline[8] == ' ' || cmdline[8] == '\t')) {
+        if (background) {
+            fprintf(stderr, "pipestat: cannot run in the background\n");
+            return 1;
+        }
+        instrument = 1;
+        cmdline += 9;
+    }
+    strncpy(job_cmd, cmdline, MAX_LEN - 1);
+    job_cmd[MAX_LEN - 1] = '\0';
+
+    if (background && job_count == MAX_JOBS) {
+        fprintf(stderr, "Too many background jobs\n");
+        return 1;
+    }
+
+    if (cmdline[strspn(cmdline, " \t")] == '\0') return 0;
+    // The number add_job will hand out, so every stage's spans carry it
+    // from the fork on
+    for (int i = 0; background && current_job == 0 && i < MAX_JOBS; i++) {
+        if (jobs[i].pid == 0) current_job = i + 1;
+    }
+    // A script's builtin output so far goes out before any stage's own:
+    // filter threads write to fd 1 directly, and a forked stage would
+    // print the buffer again
+    fflush(stdout);
+    // A cached < fd shares its offset with whoever holds it, so only a
+    // pipeline the shell waits for gets one
+    fd_cache_stamp++;
+    fd_cache_inputs = !background && !server_mode;
+
+    // Every word of the pipeline is expanded into one arena, released once
+    // the last stage is collected
+    Arena *arena = calloc(1, sizeof(Arena));
+    fg.count = 0;
+    char *rest = cmdline;
+    char *command = next_stage(&rest);
+
+    while (command != NULL) {
+        char *infile = NULL, *outfile = NULL;
+        int inflate = 0, append = 0;
+        long long t = now_ns();
+        char **arglist = tokenize(command, arena);
+        if (expand_failed) {
+            command = NULL;
+            break;
+        }
+        char *next = next_stage(&rest);
+        long timeout_ms = 0, kill_after_ms = 0;
+
+        for (int i = 0; arglist[i] != NULL; i++) {
+            if (arglist[i] == redir_in || arglist[i] == redir_gz) {
+                inflate = arglist[i] == redir_gz;
+                infile = arglist[i + 1];
+                arglist[i] = NULL;
+            } else if (arglist[i] == redir_out || arglist[i] == redir_append) {
+                append = arglist[i] == redir_append;
+                outfile = arglist[i + 1];
+                arglist[i] = NULL;
+            }
+        }
+
+        if (arglist[0] == NULL || fg.count == MAX_STAGES) break;
+        trace_span("parse", arglist[0], t, getpid(), current_job, fg.count);
+        hist_record(&metrics->parse, now_ns() - t);
+        record_queue_wait();
+
+        t = now_ns();
+        builtin_text = command;
+        if (in_fd == 0 && next == NULL && !background && !infile && !outfile
+                && handle_builtin(arglist) == 0) {
+            trace_span("builtin", arglist[0], t, getpid(), current_job, 0);
+            metrics->builtins++;
+            hist_record(&metrics->wall, now_ns() - cmd_start);
+            last_status = builtin_status;
+            builtin_status = 0;
+            arena_free(arena);
+            free(arena);
+            return 0;
+        }
+
+        if (strcmp(arglist[0], "timeout") == 0
+                && parse_timeout_args(arglist, &timeout_ms, &kill_after_ms) != 0) {
+            break;
+        }
+
+        Filter *filter = NULL;
+        if (!background && !instrument && timeout_ms == 0) filter = filter_stage(arglist);
+
+        if (inflate && infile != NULL && zlib_load() != 0) {
+            fprintf(stderr, "<z: libz.so.1 is not available\n");
+            free(filter);
+            break;
+        }
+        // "<z" inflates on a shell thread. A filter stage inflates in its own
+        // reads and "cat" becomes the inflater, so neither needs a pipe;
+        // anything else reads the output of an inflate stage through one.
+        if (inflate && infile != NULL && filter != NULL && filter->kind == FILTER_CAT && filter->files[0] == NULL) {
+            filter->kind = FILTER_INFLATE;
+            filter->inflate = 1;
+        } else if (inflate && infile != NULL && filter != NULL && filter->kind != FILTER_CAT
+                   && filter->kind != FILTER_REPLICA) {
+            filter->inflate = 1;
+        } else if (inflate && infile != NULL) {
+            int zfd[2];
+            if (fg.count + 1 == MAX_STAGES || pipe(zfd) == -1) {
+                fprintf(stderr, "<z: cannot start the inflate stage\n");
+                free(filter);
+                break;
+            }
+            fcntl(zfd[1], F_SETPIPE_SZ, 1024 * 1024);
+            Filter *z = calloc(1, sizeof(Filter));
+            z->kind = FILTER_INFLATE;
+            z->inflate = 1;
+            z->front = 1;
+            if (background) {
+                // A background job may outlive the shell and its threads, so
+                // it gets an inflating copy of the shell instead
+                metrics->forks++;
+                pid_t zpid = fork();
+                if (zpid == 0) {
+                    close(zfd[0]);
+                    if (in_fd != 0) close(in_fd);
+                    z->in_fd = open(infile, O_RDONLY | O_CLOEXEC);
+                    z->out_fd = zfd[1];
+                    if (z->in_fd < 0) {
+                        perror("Error opening input file");
+                        _exit(1);
+                    }
+                    filter_main(z);
+                    _exit(z->status);
+                }
+                free(z);
+                close(zfd[1]);
+                if (zpid > 0) add_deadline(zpid, -1, 0, 0, DL_REAP);
+            } else if (start_filter(z, in_fd, infile, NULL, 0, zfd[1]) != 0) {
+                close(zfd[0]);
+                close(zfd[1]);
+                free(filter);
+                in_fd = 0;
+                break;
+            } else {
+                fg.pids[fg.count] = 0;
+                fg.deadlines[fg.count] = NULL;
+                fg.filters[fg.count++] = z;
+            }
+            if (in_fd != 0 && background) close(in_fd);
+            in_fd = zfd[0];
+            infile = NULL;
+        }
+
+        if (next != NULL && pipe(pipefd) == -1) {
+            perror("Pipe failed");
+            free(filter);
+            break;
+        }
+
+        if (filter != NULL) {
+            if (start_filter(filter, in_fd, infile, outfile, append, next != NULL ? pipefd[1] : -1) != 0) {
+                if (next != NULL) close(pipefd[0]);
+                in_fd = 0;
+                break;
+            }
+            fg.pids[fg.count] = 0;
+            fg.deadlines[fg.count] = NULL;
+            fg.filters[fg.count] = filter;
+            trace_span("builtin", arglist[0], t, getpid(), current_job, fg.count);
+            metrics->builtins++;
+            fg.count++;
+            in_fd = next != NULL ? pipefd[0] : 0;
+            command = next;
+            continue;
+        }
+
+        if (link_count > 0 && links[link_count - 1].to[0] == '\0') {
+            strncpy(links[link_count - 1].to, arglist[0], sizeof(links[0].to) - 1);
+        }
+
+        // pipestat puts the shell between the stages: producer -> pipefd ->
+        // relay -> linkfd -> consumer
+        int linkfd[2];
+        if (instrument && next != NULL) {
+            if (pipe(linkfd) == -1) {
+                perror("Pipe failed");
+                break;
+            }
+            PipeLink *l = &links[link_count++];
+            memset(l, 0, sizeof(*l));
+            l->in_fd = pipefd[0];
+            l->out_fd = linkfd[1];
+            strncpy(l->from, arglist[0], sizeof(l->from) - 1);
+            fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+            fcntl(linkfd[1], F_SETFD, FD_CLOEXEC);
+        }
+
+        current_stage = fg.count;
+        t = now_ns();
+        fork_start = t;
+        // The helper launches plain commands; pipestat, remote stages, loaded
+        // builtins and traced sessions (the exec span is written by the
+        // child) still fork
+        int pidfd = -1;
+        pid = -1;
+        Builtin *loaded = find_builtin(arglist[0]);
+        if (loaded != NULL && loaded->ext == NULL) loaded = NULL;
+        if (spawn_fd >= 0 && !instrument && arglist[0][0] != '@' && trace_buf == NULL && loaded == NULL) {
+            pid = spawn_stage(arglist, in_fd, infile, outfile, append, next != NULL ? pipefd[1] : -1, timeout_ms > 0, &pidfd);
+        }
+        if (pid < 0) {
+            metrics->forks++;
+            pid = fork();
+        }
+        if (pid == -1) {
+            perror("Fork failed");
+            exit(1);
+        } else if (pid == 0) {
+            child_start = now_ns();
+            signal(SIGPIPE, SIG_DFL);
+            if (timeout_ms > 0) setpgid(0, 0);
+            for (int i = 0; i < link_count; i++) {
+                close(links[i].in_fd);
+                close(links[i].out_fd);
+            }
+            if (instrument && next != NULL) close(linkfd[0]);
+
+            if (in_fd != 0) {
+                dup2(in_fd, 0);
+                close(in_fd);
+            }
+
+            int cached;
+            if (infile) {
+                int fd0 = redir_open(infile, O_RDONLY, &cached);
+                if (fd0 < 0) {
+                    perror("Error opening input file");
+                    exit(1);
+                }
+                dup2(fd0, 0);
+                if (!cached) close(fd0);
+            }
+
+            if (outfile) {
+                int fd1 = redir_open(outfile, append ? O_APPEND : O_TRUNC, &cached);
+                if (fd1 < 0) {
+                    perror("Error opening output file");
+                    exit(1);
+                }
+                dup2(fd1, 1);
+                if (!cached) close(fd1);
+            }
+
+            if (next != NULL) {
+                close(pipefd[0]);
+                dup2(pipefd[1], 1);
+                close(pipefd[1]);
+            }
+
+            // A loaded builtin runs in the forked shell, no exec
+            if (loaded != NULL) {
+                int argc = 0;
+                while (arglist[argc] != NULL) argc++;
+                int status = loaded->ext->run(argc, arglist);
+                fflush(stdout);
+                exit(status);
+            }
+            int copies, ordered;
+            if ((copies = replica_count(arglist[0], &ordered)) > 0 && arglist[1] != NULL) {
+                signal(SIGPIPE, SIG_IGN);
+                exit(run_replicas(arglist + 1, copies, ordered, 0, 1));
+            }
+            execute(arglist, background);
+            exit(1);
+        } else {
+            // Foreground children are waited for through the event loop too, so
+            // background jobs and deadlines keep being serviced meanwhile
+            if (timeout_ms > 0) setpgid(pid, pid);
+            if (!background) {
+                fg.pids[fg.count] = pid;
+                fg.deadlines[fg.count] = add_deadline(pid, pidfd, timeout_ms, kill_after_ms, DL_FOREGROUND);
+                fg.filters[fg.count] = NULL;
+                fg.count++;
+            } else if (next != NULL) {
+                add_deadline(pid, pidfd, timeout_ms, kill_after_ms, DL_REAP);
+            } else {
+                if (timeout_ms > 0) add_deadline(pid, pidfd, timeout_ms, kill_after_ms, DL_JOB);
+                else if (pidfd >= 0) close(pidfd);
+                int job = add_job(pid, job_cmd);
+                printf("[%d] %d\n", job, pid);
+                trace_span("spawn", arglist[0], t, pid, job, current_stage);
+            }
+            if (!background || next != NULL) trace_span("spawn", arglist[0], t, pid, current_job, current_stage);
+            if (in_fd != 0) close(in_fd);
+            in_fd = 0;
+            if (next != NULL) {
+                close(pipefd[1]);
+                in_fd = instrument ? linkfd[0] : pipefd[0];
+            }
+            command = next;
+        }
+    }
+    if (in_fd != 0) close(in_fd);
+
+    if (link_count > 0) start_relay(links, link_count);
+    if (background) last_status = 0;
+    if (fg.count > 0) {
+        fg.arena = arena;
+    } else {
+        arena_free(arena);
+        free(arena);
+    }
+    if (!server_mode && !library_mode && fg.count > 0) {
+        if (lookahead_depth > 0) lookahead_prepare();
+        last_status = wait_foreground(&fg);
+        if (last_status != 0) metrics->failures++;
+        hist_record(&metrics->wall, now_ns() - cmd_start);
+    }
+    expansion_failed();
+    current_job = 0;
+    return command == NULL ? 0 : 1;
+}
+
+// timeout DURATION [-k|--kill-after D] cmd...; strips itself off arglist
+int parse_timeout_args(char* arglist[], long *timeout_ms, long *kill_after_ms) {
+    int i = 1;
+    *timeout_ms = -1;
+    *kill_after_ms = 0;
+    while (arglist[i] != NULL) {
+        if (strcmp(arglist[i], "-k") == 0 || strcmp(arglist[i], "--kill-after") == 0) {
+            if (arglist[i + 1] == NULL || (*kill_after_ms = parse_duration(arglist[i + 1])) < 0) break;
+            i += 2;
+        } else if (strncmp(arglist[i], "--kill-after=", 13) == 0) {
+            if ((*kill_after_ms = parse_duration(arglist[i] + 13)) < 0) break;
+            i++;
+        } else if (*timeout_ms < 0) {
+            if ((*timeout_ms = parse_duration(arglist[i])) < 0) break;
+            i++;
+        } else {
+            break;
+        }
+    }
+    if (*timeout_ms < 0 || *kill_after_ms < 0 || arglist[i] == NULL) {
+        fprintf(stderr, "Usage: timeout DURATION [--kill-after DURATION] command [args]\n");
+        return 1;
+    }
+    int j = 0;
+    while (arglist[i] != NULL) arglist[j++] = arglist[i++];
+    arglist[j] = NULL;
+    return 0;
+}
+
+// "1.5", "30s", "2m", "1h", "1d" -> milliseconds, -1 if malformed
+long parse_duration(char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || v < 0) return -1;
+    if (*end == '\0' || strcmp(end, "s") == 0) v *= 1000;
+    else if (strcmp(end, "m") == 0) v *= 60 * 1000;
+    else if (strcmp(end, "h") == 0) v *= 3600 * 1000;
+    else if (strcmp(end, "d") == 0) v *= 86400 * 1000;
+    else return -1;
+    return (long)v;
+}
+
+// One epoll set carries the deadline timer, every child pidfd and stdin
+void event_loop_init() {
+    loop_epfd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop_epfd < 0 || timer_fd < 0) {
+        perror("event loop");
+        exit(1);
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_TAG(EV_TIMER, 0) };
+    epoll_ctl(loop_epfd, EPOLL_CTL_ADD, timer_fd, &ev);
+    filter_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.data.u64 = EV_TAG(EV_FILTER, 0);
+    epoll_ctl(loop_epfd, EPOLL_CTL_ADD, filter_event_fd, &ev);
+}
+
+// pidfd is the one the spawn helper returned, -1 to open one here
+Deadline* add_deadline(pid_t pid, int pidfd, long timeout_ms, long kill_after_ms, int mode) {
+    Deadline *d = NULL;
+    for (int i = 0; i < MAX_DEADLINES; i++) {
+        if (!deadline_pool[i].in_use) {
+            d = &deadline_pool[i];
+            break;
+        }
+    }
+    if (pidfd < 0) pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (d == NULL || pidfd < 0) {
+        fprintf(stderr, "cannot track process %d\n", pid);
+        if (pidfd >= 0) close(pidfd);
+        return NULL;
+    }
+    memset(d, 0, sizeof(*d));
+    d->in_use = 1;
+    d->pid = pid;
+    d->pidfd = pidfd;
+    d->kill_after_ms = kill_after_ms;
+    d->mode = mode;
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_TAG(EV_DEADLINE, d - deadline_pool) };
+    epoll_ctl(loop_epfd, EPOLL_CTL_ADD, pidfd, &ev);
+    if (timeout_ms > 0) wheel_insert(d, timeout_ms);
+    return d;
+}
+
+void release_deadline(Deadline *d) {
+    if (d->armed) wheel_remove(d);
+    epoll_ctl(loop_epfd, EPOLL_CTL_DEL, d->pidfd, NULL);
+    close(d->pidfd);
+    d->in_use = 0;
+}
+
+void wheel_insert(Deadline *d, long ms) {
+    long ticks = (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if (ticks < 1) ticks = 1;
+    d->slot = (wheel_pos + (ticks - 1) % WHEEL_SLOTS + 1) % WHEEL_SLOTS;
+    d->rounds = (ticks - 1) / WHEEL_SLOTS;
+    d->next = wheel[d->slot];
+    wheel[d->slot] = d;
+    d->armed = 1;
+    if (wheel_count++ == 0) {
+        struct itimerspec its = {
+            .it_interval = { 0, WHEEL_TICK_MS * 1000000L },
+            .it_value = { 0, WHEEL_TICK_MS * 1000000L },
+        };
+        timerfd_settime(timer_fd, 0, &its, NULL);
+    }
+}
+
+void wheel_remove(Deadline *d) {
+    for (Deadline **pp = &wheel[d->slot]; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == d) {
+            *pp = d->next;
+            break;
+        }
+    }
+    d->armed = 0;
+    if (--wheel_count == 0) {
+        struct itimerspec off = { 0 };
+        timerfd_settime(timer_fd, 0, &off, NULL);
+    }
+}
+
+void wheel_tick() {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    while (expirations-- > 0 && wheel_count > 0) {
+        wheel_pos = (wheel_pos + 1) % WHEEL_SLOTS;
+        Deadline *d = wheel[wheel_pos];
+        while (d != NULL) {
+            Deadline *next = d->next;
+            if (d->rounds > 0) {
+                d->rounds--;
+            } else {
+                wheel_remove(d);
+                fire_deadline(d);
+            }
+            d = next;
+        }
+    }
+}
+
+// SIGTERM the whole group first, then SIGKILL once kill_after runs out
+void fire_deadline(Deadline *d) {
+    if (d->timed_out == 0) {
+        d->timed_out = 1;
+        kill(-d->pid, SIGTERM);
+        kill(-d->pid, SIGCONT);
+        if (d->kill_after_ms > 0) wheel_insert(d, d->kill_after_ms);
+    } else {
+        d->timed_out = 2;
+        kill(-d->pid, SIGKILL);
+    }
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].pid == d->pid) jobs[i].timed_out = d->timed_out;
+    }
+}
+
+// One pass of the event loop. Only DL_FOREGROUND deadlines outlive their
+// process here, wait_with_deadline() collects those.
+int run_events(int timeout_ms) {
+    struct epoll_event events[16];
+    int n = epoll_wait(loop_epfd, events, 16, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        int kind = events[i].data.u64 >> 32;
+        int idx = (uint32_t)events[i].data.u64;
+        if (kind == EV_TIMER) {
+            wheel_tick();
+        } else if (kind == EV_JOB) {
+            reap_job(idx);
+        } else if (kind == EV_INPUT) {
+            input_ready = 1;
+        } else if (kind == EV_DEADLINE) {
+            Deadline *d = &deadline_pool[idx];
+            d->exited = 1;
+            if (d->armed) wheel_remove(d);
+            if (d->mode == DL_REAP) waitpid(d->pid, NULL, WNOHANG);
+            if (d->mode != DL_FOREGROUND) release_deadline(d);
+        } else if (kind == EV_LISTEN) {
+            server_accept();
+        } else if (kind == EV_CLIENT) {
+            server_request(idx);
+        } else if (kind == EV_METRICS) {
+            uint64_t expirations;
+            if (read(metrics_fd, &expirations, sizeof(expirations)) > 0) write_metrics();
+        } else if (kind == EV_WATCH && active_watch != NULL) {
+            if (idx == WATCH_INOTIFY) active_watch->changed = 1;
+            else if (idx == WATCH_TIMER) active_watch->fired = 1;
+            else active_watch->exited = 1;
+        } else if (kind == EV_PATH) {
+            path_trie_update();
+        } else if (kind == EV_FILTER) {
+            uint64_t finished;
+            if (read(filter_event_fd, &finished, sizeof(finished)) < 0) continue;
+        } else if (kind == EV_LIBRARY) {
+            uint64_t calls;
+            if (read(library_wake_fd, &calls, sizeof(calls)) < 0) continue;
+        }
+    }
+    return n;
+}
+
+int wait_with_deadline(Deadline *d, pid_t pid) {
+    int status;
+    while (!d->exited) run_events(-1);
+    waitpid(pid, &status, 0);
+    int timed_out = d->timed_out;
+    release_deadline(d);
+    if (timed_out == 2) return 128 + SIGKILL;
+    if (timed_out) return TIMEOUT_STATUS;
+    return status_code(status);
+}
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Hands the links to the relay thread; fg keeps it until the pipeline is
+// collected. Without a thread the shell relays them itself.
+void start_relay(PipeLink links[], int count) {
+    Relay *r = calloc(1, sizeof(Relay));
+    memcpy(r->links, links, sizeof(PipeLink) * count);
+    r->count = count;
+    r->err_fd = fcntl(2, F_DUPFD_CLOEXEC, 3);
+    if (pthread_create(&r->thread, NULL, relay_main, r) == 0) {
+        fg.relay = r;
+        return;
+    }
+    relay_pipeline(r);
+    close(r->err_fd);
+    free(r);
+}
+
+void* relay_main(void *arg) {
+    Relay *r = arg;
+    // A consumer that quits early must not take the shell down with it:
+    // SIGPIPE stays pending on this thread and the splice fails with EPIPE
+    sigset_t pipe_mask;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_mask, NULL);
+    relay_pipeline(r);
+    uint64_t one = 1;
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+    if (write(filter_event_fd, &one, sizeof(one)) < 0) perror("pipestat");
+    return NULL;
+}
+
+// Splices every link until its producer hits EOF, charging the time between
+// polls to whichever side the link is waiting on, then reports per link
+// throughput and which stage the pipeline is bound by.
+void relay_pipeline(Relay *r) {
+    PipeLink *links = r->links;
+    int count = r->count;
+    struct pollfd fds[MAX_STAGES];
+    int open_links = count;
+    long long start = now_ns(), last = start;
+    for (int i = 0; i < count; i++) {
+        fcntl(links[i].in_fd, F_SETFL, O_NONBLOCK);
+        fcntl(links[i].out_fd, F_SETFL, O_NONBLOCK);
+    }
+
+    while (open_links > 0) {
+        for (int i = 0; i < count; i++) {
+            fds[i].fd = links[i].in_fd < 0 ? -1 : links[i].waiting_out ? links[i].out_fd : links[i].in_fd;
+            fds[i].events = links[i].waiting_out ? POLLOUT : POLLIN;
+        }
+        if (poll(fds, count, -1) < 0 && errno != EINTR) break;
+        long long now = now_ns();
+        for (int i = 0; i < count; i++) {
+            PipeLink *l = &links[i];
+            if (l->in_fd < 0) continue;
+            int queued = 0;
+            ioctl(l->out_fd, FIONREAD, &queued);
+            l->queue_area += queued * (now - last);
+            if (l->waiting_out) l->wait_out_ns += now - last;
+            else l->wait_in_ns += now - last;
+            if (fds[i].revents == 0) continue;
+
+            while (1) {
+                ssize_t n = splice(l->in_fd, NULL, l->out_fd, NULL, 1 << 20,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0) {
+                    l->bytes += n;
+                    continue;
+                }
+                int avail = 0;
+                if (n < 0 && errno == EAGAIN) {
+                    ioctl(l->in_fd, FIONREAD, &avail);
+                    l->waiting_out = avail > 0;
+                } else if (n < 0 && errno == EINTR) {
+                    continue;
+                } else {
+                    // EOF from the producer, or the consumer went away
+                    close(l->in_fd);
+                    close(l->out_fd);
+                    l->in_fd = -1;
+                    open_links--;
+                }
+                break;
+            }
+        }
+        last = now;
+    }
+
+    double total = (now_ns() - start) / 1e9;
+    if (total <= 0) return;
+    for (int i = 0; i < count; i++) {
+        PipeLink *l = &links[i];
+        dprintf(r->err_fd, "pipestat: %s -> %s: %.1f MB, %.1f MB/s, producer wait %.0f%%, consumer wait %.0f%%, avg queue %.1f KB (%s-bound)\n",
+                l->from, l->to, l->bytes / 1e6, l->bytes / 1e6 / total,
+                l->wait_in_ns / 1e7 / total, l->wait_out_ns / 1e7 / total,
+                l->queue_area / (total * 1e9) / 1024,
+                consumer_share(l) > 0.5 ? "consumer" : "producer");
+    }
+    // A stage is the bottleneck when its input link waits on it and its
+    // output link waits for it
+    int slowest = 0;
+    double best = -1;
+    for (int st = 0; st <= count; st++) {
+        double score = (st > 0 ? consumer_share(&links[st - 1]) : 1)
+                     + (st < count ? 1 - consumer_share(&links[st]) : 1);
+        if (score > best) {
+            best = score;
+            slowest = st;
+        }
+    }
+    dprintf(r->err_fd, "pipestat: slowest stage: %s\n", slowest < count ? links[slowest].from : links[count - 1].to);
+}
+
+// Fraction of a link's waiting that was spent on a full consumer pipe
+double consumer_share(PipeLink *l) {
+    long long waited = l->wait_in_ns + l->wait_out_ns;
+    return waited > 0 ? (double)l->wait_out_ns / waited : 0;
+}
+
+void metrics_init() {
+    metrics = mmap(NULL, sizeof(Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        perror("metrics");
+        exit(1);
+    }
+}
+
+// Values below 2^HIST_SUB_BITS get their own bucket, above that every power
+// of two is split into 2^HIST_SUB_BITS equal buckets
+int hist_index(uint64_t v) {
+    if (v < (1 << HIST_SUB_BITS)) return v;
+    int msb = 63 - __builtin_clzll(v);
+    if (msb > HIST_MAX_BITS) return HIST_BUCKETS - 1;
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) - (1 << HIST_SUB_BITS));
+}
+
+// Highest value that lands in bucket idx
+uint64_t hist_value(int idx) {
+    if (idx < (1 << HIST_SUB_BITS)) return idx;
+    int shift = (idx >> HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)((1 << HIST_SUB_BITS) + (idx & ((1 << HIST_SUB_BITS) - 1))) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+void hist_record(Histogram *h, long long ns) {
+    if (ns < 0) ns = 0;
+    __atomic_fetch_add(&h->counts[hist_index(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while ((uint64_t)ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 1,
+                                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint64_t hist_percentile(Histogram *h, double p) {
+    uint64_t target = (uint64_t)(p * h->total + 0.999999);
+    uint64_t seen = 0;
+    if (target == 0) target = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) return hist_value(i) < h->max_ns ? hist_value(i) : h->max_ns;
+    }
+    return h->max_ns;
+}
+
+// Time between a command line arriving and its first stage starting
+void record_queue_wait() {
+    if (cmd_ready_ns == 0) return;
+    hist_record(&metrics->queue, now_ns() - cmd_ready_ns);
+    cmd_ready_ns = 0;
+}
+
+// stats | stats reset | stats export FILE [SECONDS]
+void stats_builtin(char* arglist[]) {
+    if (arglist[1] == NULL) {
+        printf("%-8s %8s %10s %10s %10s %10s\n", "", "count", "p50", "p90", "p99", "max");
+        print_hist(stdout, "launch", &metrics->launch);
+        print_hist(stdout, "wall", &metrics->wall);
+        print_hist(stdout, "parse", &metrics->parse);
+        print_hist(stdout, "queue", &metrics->queue);
+        printf("forks %lu  execs %lu  builtins %lu  failures %lu\n",
+               (unsigned long)metrics->forks, (unsigned long)metrics->execs,
+               (unsigned long)metrics->builtins, (unsigned long)metrics->failures);
+    } else if (strcmp(arglist[1], "reset") == 0) {
+        memset(metrics, 0, sizeof(Metrics));
+    } else if (strcmp(arglist[1], "export") == 0 && arglist[2] != NULL) {
+        free(metrics_path);
+        metrics_path = metrics_file(arglist[2]);
+        metrics_export(arglist[3] != NULL ? atoi(arglist[3]) : METRICS_INTERVAL);
+    } else {
+        printf("Usage: stats [reset | export FILE [SECONDS]]\n");
+    }
+}
+
+void print_hist(FILE *out, const char *name, Histogram *h) {
+    fprintf(out, "%-8s %8lu %8.3fms %8.3fms %8.3fms %8.3fms\n", name, (unsigned long)h->total,
+            hist_percentile(h, 0.5) / 1e6, hist_percentile(h, 0.9) / 1e6,
+            hist_percentile(h, 0.99) / 1e6, h->max_ns / 1e6);
+}
+
+// A relative name would follow the shell's cd, so its directory is
+// resolved now; the file itself may not exist yet
+char* metrics_file(const char *path) {
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) snprintf(dir, sizeof(dir), ".");
+    else snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    char *real = realpath(dir, NULL);
+    if (real == NULL) return strdup(path);
+    const char *base = slash != NULL ? slash + 1 : path;
+    char *full = malloc(strlen(real) + strlen(base) + 2);
+    sprintf(full, "%s/%s", strcmp(real, "/") == 0 ? "" : real, base);
+    free(real);
+    return full;
+}
+
+// Rewrites metrics_path every interval seconds from the event loop
+void metrics_export(int interval) {
+    if (interval <= 0) interval = METRICS_INTERVAL;
+    if (metrics_fd < 0) {
+        metrics_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_TAG(EV_METRICS, 0) };
+        epoll_ctl(loop_epfd, EPOLL_CTL_ADD, metrics_fd, &ev);
+    }
+    struct itimerspec its = { .it_interval = { interval, 0 }, .it_value = { interval, 0 } };
+    timerfd_settime(metrics_fd, 0, &its, NULL);
+    write_metrics();
+}
+
+// Prometheus text format for the node exporter textfile collector, written
+// to a temporary file and renamed so a scrape never sees a partial file
+void write_metrics() {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", metrics_path, getpid());
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) return;
+    struct { const char *name, *help; Histogram *h; } hists[] = {
+        { "shell_launch_seconds", "Fork to exec latency", &metrics->launch },
+        { "shell_command_seconds", "Command wall time", &metrics->wall },
+        { "shell_parse_seconds", "Parse time per pipeline stage", &metrics->parse },
+        { "shell_queue_seconds", "Command arrival to first stage start", &metrics->queue },
+    };
+    double quantiles[] = { 0.5, 0.9, 0.99 };
+    for (int i = 0; i < 4; i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", hists[i].name, hists[i].help, hists[i].name);
+        for (int q = 0; q < 3; q++) {
+            fprintf(out, "%s{quantile=\"%g\"} %.9f\n", hists[i].name, quantiles[q],
+                    hist_percentile(hists[i].h, quantiles[q]) / 1e9);
+        }
+        fprintf(out, "%s_sum %.9f\n%s_count %lu\n", hists[i].name, hists[i].h->sum_ns / 1e9,
+                hists[i].name, (unsigned long)hists[i].h->total);
+    }
+    struct { const char *name; uint64_t value; } counters[] = {
+        { "shell_forks_total", metrics->forks },
+        { "shell_execs_total", metrics->execs },
+        { "shell_builtins_total", metrics->builtins },
+        { "shell_failures_total", metrics->failures },
+    };
+    for (int i = 0; i < 4; i++) {
+        fprintf(out, "# TYPE %s counter\n%s %lu\n", counters[i].name, counters[i].name,
+                (unsigned long)counters[i].value);
+    }
+    if (fclose(out) == 0) rename(tmp, metrics_path);
+    else unlink(tmp);
+}
+
+// trace on FILE | trace off
+void trace_builtin(char* arglist[]) {
+    if (arglist[1] != NULL && strcmp(arglist[1], "on") == 0 && arglist[2] != NULL) {
+        trace_stop();
+        trace_start(arglist[2]);
+    } else if (arglist[1] != NULL && strcmp(arglist[1], "off") == 0) {
+        trace_stop();
+    } else {
+        printf("Usage: trace on FILE | trace off\n");
+    }
+}
+
+// Spans are written in the Chrome trace event (JSON array) format, which
+// Perfetto and chrome://tracing open directly
+int trace_start(char *path) {
+    trace_file = fopen(path, "w");
+    if (trace_file == NULL) {
+        perror("trace");
+        return 1;
+    }
+    trace_buf = mmap(NULL, sizeof(TraceBuffer), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (trace_buf == MAP_FAILED) {
+        perror("trace");
+        fclose(trace_file);
+        trace_file = NULL;
+        trace_buf = NULL;
+        return 1;
+    }
+    trace_owner = getpid();
+    trace_written = 0;
+    fprintf(trace_file, "[");
+    return 0;
+}
+
+void trace_stop() {
+    if (trace_buf == NULL || getpid() != trace_owner) return;
+    trace_flush();
+    if (trace_buf->dropped > 0) fprintf(stderr, "trace: %lu spans dropped\n", (unsigned long)trace_buf->dropped);
+    fprintf(trace_file, "\n]\n");
+    fclose(trace_file);
+    munmap(trace_buf, sizeof(TraceBuffer));
+    trace_buf = NULL;
+    trace_file = NULL;
+}
+
+// Safe from any process sharing the buffer; drops the span if it is full
+void trace_span(const char *name, const char *detail, long long start, pid_t pid, int job, int stage) {
+    if (trace_buf == NULL) return;
+    long long end = now_ns();
+    uint64_t idx = __atomic_load_n(&trace_buf->tail, __ATOMIC_RELAXED);
+    do {
+        if (idx - __atomic_load_n(&trace_buf->head, __ATOMIC_ACQUIRE) >= TRACE_CAP) {
+            __atomic_fetch_add(&trace_buf->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&trace_buf->tail, &idx, idx + 1, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    TraceSpan *sp = &trace_buf->spans[idx % TRACE_CAP];
+    strncpy(sp->name, name, sizeof(sp->name) - 1);
+    sp->name[sizeof(sp->name) - 1] = '\0';
+    strncpy(sp->detail, detail, sizeof(sp->detail) - 1);
+    sp->detail[sizeof(sp->detail) - 1] = '\0';
+    sp->start = start;
+    sp->dur = end - start;
+    sp->pid = pid;
+    sp->job = job;
+    sp->stage = stage;
+    __atomic_store_n(&sp->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+// Writes out every completed span in order, stopping at one still being filled
+void trace_flush() {
+    if (trace_buf == NULL || getpid() != trace_owner) return;
+    uint64_t head = trace_buf->head;
+    while (head < __atomic_load_n(&trace_buf->tail, __ATOMIC_ACQUIRE)) {
+        TraceSpan *sp = &trace_buf->spans[head % TRACE_CAP];
+        if (__atomic_load_n(&sp->seq, __ATOMIC_ACQUIRE) != head + 1) break;
+        fprintf(trace_file, "%s\n{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"cmd\":\"",
+                trace_written++ ? "," : "", sp->name, sp->start / 1e3, sp->dur / 1e3, trace_owner, sp->pid);
+        for (char *c = sp->detail; *c; c++) {
+            if (*c == '"' || *c == '\\') fputc('\\', trace_file);
+            if ((unsigned char)*c >= 0x20) fputc(*c, trace_file);
+        }
+        fprintf(trace_file, "\",\"pid\":%d,\"job\":%d,\"stage\":%d}}", sp->pid, sp->job, sp->stage);
+        head++;
+        __atomic_store_n(&trace_buf->head, head, __ATOMIC_RELEASE);
+    }
+    fflush(trace_file);
+}
+
+int foreground_done(Foreground *f) {
+    for (int i = 0; i < f->count; i++) {
+        if (f->deadlines[i] != NULL && !f->deadlines[i]->exited) return 0;
+        if (f->filters[i] != NULL && !__atomic_load_n(&f->filters[i]->done, __ATOMIC_ACQUIRE)) return 0;
+    }
+    return f->relay == NULL || __atomic_load_n(&f->relay->done, __ATOMIC_ACQUIRE);
+}
+
+// Waits for every stage, the pipeline's status is the last stage's. The
+// "<z" stage in front of a program counts as part of it: a corrupt or
+// truncated file fails the program's stage whatever the program returns.
+int wait_foreground(Foreground *f) {
+    int result = 0, inflate_failed = 0;
+    for (int i = 0; i < f->count; i++) {
+        long long t = now_ns();
+        int front = 0;
+        if (f->filters[i] != NULL) {
+            Filter *flt = f->filters[i];
+            while (!__atomic_load_n(&flt->done, __ATOMIC_ACQUIRE)) run_events(-1);
+            pthread_join(flt->thread, NULL);
+            result = flt->status;
+            front = flt->front;
+            free(flt);
+            f->filters[i] = NULL;
+        } else if (f->deadlines[i] != NULL) {
+            result = wait_with_deadline(f->deadlines[i], f->pids[i]);
+        } else {
+            int status;
+            waitpid(f->pids[i], &status, 0);
+            result = status_code(status);
+        }
+        trace_span("wait", "", t, f->pids[i], current_job, i);
+        if (front) {
+            inflate_failed = result != 0;
+        } else if (inflate_failed) {
+            if (result == 0) result = 1;
+            inflate_failed = 0;
+        }
+    }
+    if (f->relay != NULL) {
+        while (!__atomic_load_n(&f->relay->done, __ATOMIC_ACQUIRE)) run_events(-1);
+        pthread_join(f->relay->thread, NULL);
+        close(f->relay->err_fd);
+        free(f->relay);
+        f->relay = NULL;
+    }
+    f->count = 0;
+    if (f->arena != NULL) {
+        arena_free(f->arena);
+        free(f->arena);
+        f->arena = NULL;
+    }
+    return result;
+}
+
+// Builds a filter for cat, head, wc, grep -F or cut when every option is one
+// the in-process version implements and input is stdin (cat also takes
+// files); anything else (file operands, regex grep, unknown flags) runs the
+// real tool.
+Filter* filter_stage(char* arglist[]) {
+    Filter *f = calloc(1, sizeof(Filter));
+    int ok = 0;
+    char *name = arglist[0];
+    if ((f->copies = replica_count(name, &f->ordered)) > 0) {
+        f->kind = FILTER_REPLICA;
+        f->argv = arglist + 1;
+        ok = arglist[1] != NULL;
+    } else if (strcmp(name, "cat") == 0) {
+        f->kind = FILTER_CAT;
+        f->files = arglist + 1;
+        ok = 1;
+        for (int i = 1; arglist[i] != NULL; i++) {
+            if (arglist[i][0] == '-' && arglist[i][1] != '\0') ok = 0;
+        }
+    } else if (strcmp(name, "head") == 0) {
+        f->kind = FILTER_HEAD;
+        f->count = 10;
+        ok = 1;
+        for (int i = 1; arglist[i] != NULL && ok; i++) {
+            char *num = NULL;
+            // A trailing "-n" has no number to step onto
+            if (strcmp(arglist[i], "-n") == 0) num = arglist[i + 1] != NULL ? arglist[++i] : NULL;
+            else if (strncmp(arglist[i], "-n", 2) == 0) num = arglist[i] + 2;
+            else if (arglist[i][0] == '-') num = arglist[i] + 1;
+            char *end;
+            if (num == NULL || *num == '\0') {
+                ok = 0;
+            } else {
+                f->count = strtol(num, &end, 10);
+                if (*end != '\0' || f->count < 0) ok = 0;
+            }
+        }
+    } else if (strcmp(name, "wc") == 0) {
+        f->kind = FILTER_WC;
+        ok = 1;
+        for (int i = 1; arglist[i] != NULL && ok; i++) {
+            if (arglist[i][0] != '-' || arglist[i][1] == '\0') ok = 0;
+            for (char *c = arglist[i] + 1; ok && *c; c++) {
+                if (*c == 'l') f->flags |= WC_LINES;
+                else if (*c == 'w') f->flags |= WC_WORDS;
+                else if (*c == 'c') f->flags |= WC_BYTES;
+                else ok = 0;
+            }
+        }
+        if (f->flags == 0) f->flags = WC_LINES | WC_WORDS | WC_BYTES;
+    } else if (strcmp(name, "grep") == 0) {
+        int fixed = 0, i;
+        f->kind = FILTER_GREP;
+        ok = 1;
+        for (i = 1; arglist[i] != NULL && arglist[i][0] == '-' && ok; i++) {
+            for (char *c = arglist[i] + 1; ok && *c; c++) {
+                if (*c == 'F') fixed = 1;
+                else if (*c == 'v') f->flags |= GREP_INVERT;
+                else if (*c == 'c') f->flags |= GREP_COUNT;
+                else ok = 0;
+            }
+        }
+        f->pattern = arglist[i];
+        if (!fixed || f->pattern == NULL || f->pattern[0] == '\0' || arglist[i + 1] != NULL) ok = 0;
+        else f->pattern_len = strlen(f->pattern);
+    } else if (strcmp(name, "cut") == 0) {
+        char *list = NULL;
+        f->kind = FILTER_CUT;
+        f->delim = '\t';
+        ok = 1;
+        for (int i = 1; arglist[i] != NULL && ok; i++) {
+            char *a = arglist[i];
+            char *val = (a[0] == '-' && a[1] != '\0' && a[2] == '\0') ? arglist[++i] : a + 2;
+            if (a[0] != '-' || val == NULL) ok = 0;
+            else if (a[1] == 'd' && strlen(val) == 1) f->delim = val[0];
+            else if (a[1] == 'f' || a[1] == 'c') {
+                f->by_field = a[1] == 'f';
+                ok = list == NULL;
+                list = val;
+            } else ok = 0;
+        }
+        if (list == NULL || parse_list(f, list) != 0) ok = 0;
+    } else if (strcmp(name, "sort") == 0 && sort_collates_bytes()) {
+        f->kind = FILTER_SORT;
+        f->budget = SORT_BUDGET;
+        ok = 1;
+        int keys = 0;
+        for (int i = 1; ok && arglist[i] != NULL; i++) {
+            char *a = arglist[i];
+            if (a[0] != '-' || a[1] == '\0') ok = 0;
+            for (char *c = a + 1; ok && *c; c++) {
+                if (*c == 'n') f->flags |= SORT_NUMERIC;
+                else if (*c == 'r') f->flags |= SORT_REVERSE;
+                else if (*c == 'f') f->flags |= SORT_FOLD;
+                else if (*c == 'u') f->flags |= SORT_UNIQUE;
+                else if (*c == 's') f->flags |= SORT_STABLE;
+                else if (*c == 't' || *c == 'k' || *c == 'S') {
+                    char *val = c[1] != '\0' ? c + 1 : arglist[++i];
+                    if (val == NULL) ok = 0;
+                    else if (*c == 't') ok = strlen(val) == 1 && (f->delim = val[0]) != '\n';
+                    else if (*c == 'k') ok = keys++ == 0 && parse_sort_key(f, val) == 0;
+                    else ok = (long)(f->budget = parse_size(val)) > 0;
+                    break;
+                } else ok = 0;
+            }
+        }
+        if (!(f->key_flags & SORT_OWN)) f->key_flags |= f->flags & (SORT_NUMERIC | SORT_REVERSE | SORT_FOLD);
+    }
+    if (!ok) {
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+// cut's LIST: comma separated N, N-M, -M and N-
+int parse_list(Filter *f, char *list) {
+    char *p = list;
+    while (*p) {
+        char *end;
+        long lo = 1, hi;
+        if (*p != '-') {
+            lo = strtol(p, &end, 10);
+            if (end == p) return -1;
+            p = end;
+        }
+        hi = lo;
+        if (*p == '-') {
+            p++;
+            if (*p == ',' || *p == '\0') {
+                hi = 255;
+                if (f->pick_from == 0 || lo < f->pick_from) f->pick_from = lo;
+            } else {
+                hi = strtol(p, &end, 10);
+                if (end == p) return -1;
+                p = end;
+            }
+        }
+        if (lo < 1 || hi < lo || hi > 255) return -1;
+        for (long i = lo; i <= hi; i++) f->pick[i] = 1;
+        if (*p == ',') p++;
+        else if (*p != '\0') return -1;
+    }
+    return 0;
+}
+
+// Opens the stage's ends and starts its thread. in_fd is the upstream pipe
+// (0 for the shell's stdin) and out_pipe the downstream one (-1 for stdout).
+int start_filter(Filter *f, int in_fd, char *infile, char *outfile, int append, int out_pipe) {
+    // The thread closes its fds, so a cached one is handed over as a dup
+    int cached;
+    if (infile) {
+        if (in_fd != 0) close(in_fd);
+        in_fd = redir_open(infile, O_RDONLY, &cached);
+        if (in_fd >= 0 && cached) in_fd = fcntl(in_fd, F_DUPFD_CLOEXEC, 3);
+        if (in_fd < 0) perror("Error opening input file");
+    } else if (in_fd == 0) {
+        in_fd = fcntl(0, F_DUPFD_CLOEXEC, 3);
+    } else {
+        fcntl(in_fd, F_SETFD, FD_CLOEXEC);
+    }
+    if (out_pipe >= 0) {
+        f->out_fd = out_pipe;
+        fcntl(out_pipe, F_SETFD, FD_CLOEXEC);
+    } else if (outfile) {
+        f->out_fd = redir_open(outfile, append ? O_APPEND : O_TRUNC, &cached);
+        if (f->out_fd >= 0 && cached) f->out_fd = fcntl(f->out_fd, F_DUPFD_CLOEXEC, 3);
+        if (f->out_fd < 0) perror("Error opening output file");
+    } else {
+        // A dup, so server mode can restore its own stdout meanwhile
+        f->out_fd = fcntl(1, F_DUPFD_CLOEXEC, 3);
+    }
+    f->in_fd = in_fd;
+    if (f->in_fd < 0 || f->out_fd < 0 || pthread_create(&f->thread, NULL, filter_main, f) != 0) {
+        if (f->in_fd >= 0) close(f->in_fd);
+        if (f->out_fd >= 0) close(f->out_fd);
+        free(f);
+        return -1;
+    }
+    return 0;
+}
+
+void* filter_main(void *arg) {
+    Filter *f = arg;
+    // SIGPIPE stays pending on this thread instead of killing the shell, the
+    // write just fails with EPIPE
+    sigset_t pipe_mask;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_mask, NULL);
+
+    if (f->kind == FILTER_REPLICA) {
+        f->status = run_replicas(f->argv, f->copies, f->ordered, f->in_fd, f->out_fd);
+    } else if (f->kind == FILTER_CAT) {
+        run_cat(f);
+    } else {
+        // A large file behind "<" is read ahead through io_uring
+        struct stat st;
+        off_t pos = lseek(f->in_fd, 0, SEEK_CUR);
+        Ring *r = malloc(sizeof(Ring));
+        if (fstat(f->in_fd, &st) == 0 && S_ISREG(st.st_mode) && pos >= 0
+                && st.st_size - pos >= RING_MIN && ring_open(r, RING_DEPTH) == 0) {
+            r->base = pos;
+            r->end = st.st_size;
+            r->blocks = (r->end - r->base + RING_BUF - 1) / RING_BUF;
+            for (long k = 0; k < r->depth && k < r->blocks; k++) ring_read_block(r, f->in_fd, k, 0);
+            f->ring = r;
+        } else {
+            free(r);
+        }
+        if (f->inflate) f->gz = gz_open(f);
+
+        OutBuf *o = malloc(sizeof(OutBuf));
+        o->fd = f->out_fd;
+        o->failed = 0;
+        o->len = 0;
+        if (f->kind == FILTER_HEAD) run_head(f, o);
+        else if (f->kind == FILTER_WC) run_wc(f, o);
+        else if (f->kind == FILTER_INFLATE) run_inflate(f, o);
+        else if (f->kind == FILTER_SORT) run_sort(f, o);
+        else run_lines(f, o);
+        out_flush(o);
+        if (o->failed) f->status = 128 + SIGPIPE;
+        free(o);
+        if (f->ring != NULL) {
+            ring_close(f->ring);
+            free(f->ring);
+        }
+        if (f->gz != NULL) gz_close(f->gz);
+    }
+    if (f->in_fd >= 0) close(f->in_fd);
+    close(f->out_fd);
+
+    uint64_t one = 1;
+    __atomic_store_n(&f->done, 1, __ATOMIC_RELEASE);
+    if (write(filter_event_fd, &one, sizeof(one)) < 0) perror("filter");
+    return NULL;
+}
+
+// "@N" runs N copies in input order, "@Nu" merges as copies finish.
+// Returns N, or 0 when the word isn't one (a remote "@name" stage).
+int replica_count(char *word, int *ordered) {
+    if (word[0] != '@' || !isdigit((unsigned char)word[1])) return 0;
+    char *end;
+    long n = strtol(word + 1, &end, 10);
+    if (*end != '\0' && strcmp(end, "u") != 0) return 0;
+    *ordered = *end == '\0';
+    if (n < 1) n = 1;
+    return n < MAX_REPLICAS ? n : MAX_REPLICAS;
+}
+
+// Cuts in_fd into line-aligned chunks of about REPLICA_CHUNK, starts a
+// fresh copy of argv for each with at most copies running, and writes
+// their outputs to out_fd. In order, the oldest chunk's output streams
+// straight through while later ones are held; a finished copy keeps its
+// slot until its output is written, so at most copies outputs are held.
+// Returns the last failing copy's status.
+int run_replicas(char **argv, int copies, int ordered, int in_fd, int out_fd) {
+    Replica slots[MAX_REPLICAS];
+    memset(slots, 0, sizeof(slots));
+    uint64_t next_seq = 0, emit_seq = 0;
+    size_t acc_len = 0, acc_cap = REPLICA_CHUNK + FILTER_BUF;
+    char *acc = malloc(acc_cap);
+    int in_eof = 0, running = 0, failed = 0, status = 0;
+
+    while (!failed && (!in_eof || acc_len > 0 || running > 0)) {
+        int free_slot = -1;
+        for (int i = 0; i < copies && free_slot < 0; i++) if (slots[i].pid == 0) free_slot = i;
+
+        // A full chunk, or the tail at end of input, goes to a new copy
+        if (free_slot >= 0 && (acc_len >= REPLICA_CHUNK || (in_eof && acc_len > 0))) {
+            size_t cut = acc_len;
+            if (!in_eof) {
+                while (cut > 0 && acc[cut - 1] != '\n') cut--;
+                if (cut == 0) cut = acc_len;           // one huge line
+            }
+            // The buffer goes to the copy as is, only the partial line moves
+            Replica *r = &slots[free_slot];
+            r->input = acc;
+            r->in_len = cut;
+            r->in_off = 0;
+            acc = malloc(acc_cap);
+            memcpy(acc, r->input + cut, acc_len - cut);
+            acc_len -= cut;
+            r->seq = next_seq++;
+            if (replica_start(r, argv) < 0) {
+                free(r->input);
+                status = 127;
+                break;
+            }
+            running++;
+            continue;
+        }
+
+        struct pollfd fds[2 * MAX_REPLICAS + 1];
+        int who[2 * MAX_REPLICAS + 1], nfds = 0;
+        if (!in_eof && acc_len < REPLICA_CHUNK) {
+            fds[nfds] = (struct pollfd){ .fd = in_fd, .events = POLLIN };
+            who[nfds++] = -1;
+        }
+        for (int i = 0; i < copies; i++) {
+            if (slots[i].pid == 0 || slots[i].finished) continue;
+            if (slots[i].in >= 0) {
+                fds[nfds] = (struct pollfd){ .fd = slots[i].in, .events = POLLOUT };
+                who[nfds++] = i;
+            }
+            if (slots[i].out >= 0) {
+                fds[nfds] = (struct pollfd){ .fd = slots[i].out, .events = POLLIN };
+                who[nfds++] = i;
+            }
+        }
+        if (nfds == 0) break;
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int k = 0; k < nfds && !failed; k++) {
+            if (fds[k].revents == 0) continue;
+            if (who[k] < 0) {
+                ssize_t n = read(in_fd, acc + acc_len, acc_cap - acc_len);
+                if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+                if (n <= 0) in_eof = 1;
+                else acc_len += n;
+                continue;
+            }
+            Replica *r = &slots[who[k]];
+            if (fds[k].fd == r->in) {
+                ssize_t n = write(r->in, r->input + r->in_off, r->in_len - r->in_off);
+                if (n > 0) r->in_off += n;
+                // Done, or the copy stopped reading (head): either way it's fed
+                if (r->in_off == r->in_len || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                    close(r->in);
+                    r->in = -1;
+                    free(r->input);
+                    r->input = NULL;
+                }
+            } else {
+                replica_output(r, out_fd, !ordered ? 0 : r->seq == emit_seq, &failed);
+                if (r->out >= 0) continue;
+                int wstatus;
+                waitpid(r->pid, &wstatus, 0);
+                if (status_code(wstatus) != 0) status = status_code(wstatus);
+                r->finished = 1;
+                running--;
+            }
+        }
+
+        // Hand finished outputs on: the next ones in order, or any at all
+        int progress = 1;
+        while (progress && !failed) {
+            progress = 0;
+            for (int i = 0; i < copies; i++) {
+                Replica *r = &slots[i];
+                if (r->pid == 0 || (ordered && r->seq != emit_seq)) continue;
+                if (r->out_len > 0 && (ordered || r->finished)) {
+                    if (write_all(out_fd, r->output, r->out_len) != 0) failed = 1;
+                    r->out_len = 0;
+                }
+                if (!r->finished) continue;
+                free(r->output);
+                memset(r, 0, sizeof(*r));
+                if (ordered) emit_seq++;
+                progress = 1;
+            }
+        }
+    }
+
+    // Stopped early: the reader went away or a copy couldn't start
+    for (int i = 0; i < copies; i++) {
+        Replica *r = &slots[i];
+        if (r->pid == 0) continue;
+        if (!r->finished) {
+            kill(r->pid, SIGTERM);
+            waitpid(r->pid, NULL, 0);
+        }
+        if (r->in >= 0) close(r->in);
+        if (r->out >= 0) close(r->out);
+        free(r->input);
+        free(r->output);
+    }
+    free(acc);
+    return failed ? 128 + SIGPIPE : status;
+}
+
+// Starts one copy with pipes on both ends; the shell's ends don't block
+pid_t replica_start(Replica *r, char **argv) {
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) != 0) return -1;
+    if (pipe2(out, O_CLOEXEC) != 0) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], 0);
+    posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+    // The filter thread blocks SIGPIPE and server mode ignores it
+    posix_spawnattr_t attr;
+    sigset_t none, pipe_only;
+    sigemptyset(&none);
+    sigemptyset(&pipe_only);
+    sigaddset(&pipe_only, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &pipe_only);
+    char path[PATH_MAX];
+    int err = posix_spawnp(&r->pid, env_which(argv[0], path, sizeof(path)), &actions, &attr, argv, env_list());
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(in[0]);
+    close(out[1]);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+        close(in[1]);
+        close(out[0]);
+        r->pid = 0;
+        return -1;
+    }
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    r->in = in[1];
+    r->out = out[0];
+    return r->pid;
+}
+
+// Drains what the copy has written so far, straight to out_fd when its
+// chunk is the one being merged, otherwise into its buffer
+void replica_output(Replica *r, int out_fd, int direct, int *failed) {
+    char buf[FILTER_BUF];
+    while (1) {
+        ssize_t n = read(r->out, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return;
+        if (n <= 0) {
+            close(r->out);
+            r->out = -1;
+            return;
+        }
+        if (direct && r->out_len == 0) {
+            if (write_all(out_fd, buf, n) != 0) *failed = 1;
+            continue;
+        }
+        if (r->out_len + n > r->out_cap) {
+            r->out_cap = (r->out_len + n) * 2;
+            r->output = realloc(r->output, r->out_cap);
+        }
+        memcpy(r->output + r->out_len, buf, n);
+        r->out_len += n;
+    }
+}
+
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int zlib_load() {
+    if (zlib_state != 0) return zlib_state > 0 ? 0 : -1;
+    void *lib = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL);
+    zlib_state = -1;
+    if (lib == NULL) return -1;
+    zlib.init = (int (*)(z_stream*, int, const char*, int))dlsym(lib, "inflateInit2_");
+    zlib.inflate = (int (*)(z_stream*, int))dlsym(lib, "inflate");
+    zlib.reset = (int (*)(z_stream*))dlsym(lib, "inflateReset");
+    zlib.end = (int (*)(z_stream*))dlsym(lib, "inflateEnd");
+    if (zlib.init == NULL || zlib.inflate == NULL || zlib.reset == NULL || zlib.end == NULL) {
+        dlclose(lib);
+        return -1;
+    }
+    zlib_state = 1;
+    return 0;
+}
+
+// Reads the first block to look for the gzip magic
+GzReader* gz_open(Filter *f) {
+    GzReader *g = calloc(1, sizeof(GzReader));
+    ssize_t n;
+    while ((n = stage_read_raw(f, (char*)g->in, GZ_BUF)) < 0 && errno == EINTR) continue;
+    g->zs.next_in = g->in;
+    g->zs.avail_in = n > 0 ? n : 0;
+    g->eof = n <= 0;
+    // 16 + 15: gzip wrapper, largest window
+    g->plain = n < 2 || g->in[0] != 0x1f || g->in[1] != 0x8b
+        || zlib.init(&g->zs, 16 + MAX_WBITS, ZLIB_VERSION, sizeof(z_stream)) != Z_OK;
+    return g;
+}
+
+// Fills buf with at least one inflated byte, 0 at the end of the last
+// member. Bytes after it that don't start another member are ignored.
+ssize_t gz_read(Filter *f, char *buf, size_t len) {
+    GzReader *g = f->gz;
+    z_stream *zs = &g->zs;
+    if (g->plain && zs->avail_in == 0) return stage_read_raw(f, buf, len);
+    if (g->plain) {
+        size_t n = zs->avail_in < len ? zs->avail_in : len;
+        memcpy(buf, zs->next_in, n);
+        zs->next_in += n;
+        zs->avail_in -= n;
+        return n;
+    }
+    zs->next_out = (unsigned char*)buf;
+    zs->avail_out = len;
+    while (zs->avail_out == len) {
+        if (zs->avail_in == 0 && !g->eof) {
+            ssize_t n = stage_read_raw(f, (char*)g->in, GZ_BUF);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return -1;
+            g->eof = n == 0;
+            zs->next_in = g->in;
+            zs->avail_in = n;
+            continue;
+        }
+        if (g->member_end) {
+            if (zs->avail_in == 0) break;
+            if (zs->next_in[0] != 0x1f) {
+                zs->avail_in = 0;
+                g->eof = 1;
+                break;
+            }
+            zlib.reset(zs);
+            g->member_end = 0;
+        }
+        int r = zlib.inflate(zs, Z_NO_FLUSH);
+        if (r == Z_STREAM_END) g->member_end = 1;
+        else if (r == Z_BUF_ERROR && zs->avail_in == 0 && g->eof) return gz_fail(f, "unexpected end of file");
+        else if (r != Z_OK && r != Z_BUF_ERROR) return gz_fail(f, zs->msg != NULL ? zs->msg : "invalid data");
+    }
+    return len - zs->avail_out;
+}
+
+ssize_t gz_fail(Filter *f, const char *msg) {
+    fprintf(stderr, "<z: %s\n", msg);
+    f->status = 1;
+    errno = EIO;
+    return -1;
+}
+
+void gz_close(GzReader *g) {
+    if (!g->plain) zlib.end(&g->zs);
+    free(g);
+}
+
+// The inflated stream goes straight from zlib's output to the pipe
+void run_inflate(Filter *f, OutBuf *o) {
+    char *buf = malloc(GZ_BUF * 4);
+    ssize_t n;
+    while ((n = stage_read(f, buf, GZ_BUF * 4)) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            if (f->status == 0) perror("<z");
+            f->status = 1;
+            break;
+        }
+        if (write_all(o->fd, buf, n) != 0) {
+            o->failed = 1;
+            break;
+        }
+    }
+    free(buf);
+}
+
+// Copies whole lines until the count runs out, then closes the input right
+// away so the producer gets EPIPE instead of running to completion
+void run_head(Filter *f, OutBuf *o) {
+    char buf[FILTER_BUF];
+    long left = f->count;
+    while (left > 0 && !o->failed) {
+        ssize_t n = stage_read(f, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        const char *end = skip_lines(buf, n, &left);
+        out_write(o, buf, end != NULL ? (size_t)(end - buf) : (size_t)n);
+    }
+    close(f->in_fd);
+    f->in_fd = -1;
+}
+
+void run_wc(Filter *f, OutBuf *o) {
+    char buf[FILTER_BUF];
+    long lines = 0, words = 0, bytes = 0;
+    int in_word = 0;
+    while (1) {
+        ssize_t n = stage_read(f, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        bytes += n;
+        if (f->flags & WC_LINES) lines += count_newlines(buf, n);
+        if (f->flags & WC_WORDS) {
+            for (ssize_t i = 0; i < n; i++) {
+                unsigned char c = buf[i];
+                int space = c == ' ' || (c >= '\t' && c <= '\r');
+                if (!space && !in_word) words++;
+                in_word = !space;
+            }
+        }
+    }
+    // Same layout as coreutils for stdin: bare number alone, else width 7
+    char line[64];
+    int len = 0, single = f->flags == WC_LINES || f->flags == WC_WORDS || f->flags == WC_BYTES;
+    const char *fmt = single ? "%ld" : "%7ld";
+    if (f->flags & WC_LINES) len += snprintf(line + len, sizeof(line) - len, fmt, lines);
+    if (f->flags & WC_WORDS) len += snprintf(line + len, sizeof(line) - len, len ? " %7ld" : fmt, words);
+    if (f->flags & WC_BYTES) len += snprintf(line + len, sizeof(line) - len, len ? " %7ld" : fmt, bytes);
+    line[len++] = '\n';
+    out_write(o, line, len);
+}
+
+// grep and cut: reads blocks, hands over every complete line in one region
+// and carries the partial last line into the next read
+void run_lines(Filter *f, OutBuf *o) {
+    size_t cap = FILTER_BUF, len = 0;
+    char *buf = malloc(cap);
+    long matched = 0;
+    int eof = 0;
+    while (!eof && !o->failed) {
+        if (len == cap) buf = realloc(buf, cap *= 2);
+        ssize_t n = stage_read(f, buf + len, cap - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            eof = 1;
+            if (len > 0 && buf[len - 1] != '\n') {
+                if (len == cap) buf = realloc(buf, cap *= 2);
+                buf[len++] = '\n';
+            }
+        } else {
+            len += n;
+        }
+        char *last = memrchr(buf, '\n', len);
+        if (last == NULL) continue;
+        size_t region = last - buf + 1;
+        if (f->kind == FILTER_GREP) {
+            matched += grep_region(f, buf, region, o);
+        } else {
+            for (size_t pos = 0; pos < region; ) {
+                char *nl = memchr(buf + pos, '\n', region - pos);
+                cut_line(f, buf + pos, nl - (buf + pos), o);
+                pos = nl - buf + 1;
+            }
+        }
+        memmove(buf, buf + region, len - region);
+        len -= region;
+    }
+    free(buf);
+    if (f->kind == FILTER_GREP) {
+        if (f->flags & GREP_COUNT) {
+            char line[32];
+            out_write(o, line, snprintf(line, sizeof(line), "%ld\n", matched));
+        }
+        f->status = matched > 0 ? 0 : 1;
+    }
+}
+
+// Searches the whole region at once rather than line by line; lines between
+// hits are skipped (or copied in one piece for -v) without being looked at
+long grep_region(Filter *f, const char *p, size_t n, OutBuf *o) {
+    int invert = f->flags & GREP_INVERT, quiet = f->flags & GREP_COUNT;
+    long selected = 0;
+    size_t pos = 0;
+    while (pos < n) {
+        const char *hit = find_substr(p + pos, n - pos, f->pattern, f->pattern_len);
+        const char *end = p + n;
+        const char *start = end;
+        if (hit != NULL) {
+            const char *prev = memrchr(p + pos, '\n', hit - (p + pos));
+            start = prev != NULL ? prev + 1 : p + pos;
+            end = (const char*)memchr(hit, '\n', p + n - hit) + 1;
+        }
+        if (invert && start > p + pos) {
+            selected += count_newlines(p + pos, start - (p + pos));
+            if (!quiet) out_write(o, p + pos, start - (p + pos));
+        } else if (!invert && hit != NULL) {
+            selected++;
+            if (!quiet) out_write(o, start, end - start);
+        }
+        pos = end - p;
+    }
+    return selected;
+}
+
+void cut_line(Filter *f, const char *p, size_t n, OutBuf *o) {
+    int wrote = 0;
+    if (!f->by_field) {
+        for (size_t i = 0; i < n; i++) {
+            if ((i < 255 && f->pick[i + 1]) || (f->pick_from && (long)i + 1 >= f->pick_from)) {
+                out_write(o, p + i, 1);
+            }
+        }
+    } else if (memchr(p, f->delim, n) == NULL) {
+        // Lines without a delimiter pass through whole, as in coreutils
+        out_write(o, p, n);
+    } else {
+        const char *field = p, *end = p + n;
+        for (long i = 1; field <= end; i++) {
+            const char *d = memchr(field, f->delim, end - field);
+            if (d == NULL) d = end;
+            if ((i < 256 && f->pick[i]) || (f->pick_from && i >= f->pick_from)) {
+                if (wrote++) out_write(o, &f->delim, 1);
+                out_write(o, field, d - field);
+            }
+            field = d + 1;
+        }
+    }
+    out_write(o, "\n", 1);
+}
+
+// Newlines in p[0..n), 16 bytes per step where SSE2 is available
+size_t count_newlines(const char *p, size_t n) {
+    size_t count = 0, i = 0;
+#ifdef __SSE2__
+    __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+    }
+#endif
+    for (; i < n; i++) count += p[i] == '\n';
+    return count;
+}
+
+// Consumes up to *k lines from p[0..n). Returns the end of the k-th line, or
+// NULL with *k reduced by the lines seen when the block runs out first.
+const char* skip_lines(const char *p, size_t n, long *k) {
+    size_t i = 0;
+#ifdef __SSE2__
+    // Whole blocks short of the target are only counted
+    __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        int c = __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+        if (c >= *k) break;
+        *k -= c;
+    }
+#endif
+    for (; i < n; i++) {
+        if (p[i] == '\n' && --*k == 0) return p + i + 1;
+    }
+    return NULL;
+}
+
+// Fixed-string search. With SSE2, positions where both the first and the
+// last byte of the needle match are found 16 at a time and only those are
+// compared in full; the tail goes to memmem.
+const char* find_substr(const char *h, size_t n, const char *s, size_t m) {
+    if (m > n) return NULL;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(s[0]), last = _mm_set1_epi8(s[m - 1]);
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(h + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(h + i + m - 1));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(h + i + bit, s, m) == 0) return h + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return memmem(h + i, n - i, s, m);
+}
+
+void out_write(OutBuf *o, const char *p, size_t n) {
+    if (o->failed) return;
+    if (o->len + n > sizeof(o->buf)) out_flush(o);
+    if (n >= sizeof(o->buf)) {
+        while (n > 0 && !o->failed) {
+            ssize_t w = write(o->fd, p, n);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) o->failed = 1;
+            else p += w, n -= w;
+        }
+        return;
+    }
+    memcpy(o->buf + o->len, p, n);
+    o->len += n;
+}
+
+void out_flush(OutBuf *o) {
+    size_t off = 0;
+    while (off < o->len && !o->failed) {
+        ssize_t w = write(o->fd, o->buf + off, o->len - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) o->failed = 1;
+        else off += w;
+    }
+    o->len = 0;
+}
+
+// cat with no options: each operand ("-" is the stage input) is copied
+// straight to the output with bulk_copy()
+void run_cat(Filter *f) {
+    char *stdin_only[] = { "-", NULL };
+    char **files = f->files[0] != NULL ? f->files : stdin_only;
+    for (int i = 0; files[i] != NULL; i++) {
+        int fd = strcmp(files[i], "-") == 0 ? f->in_fd : open(files[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno));
+            f->status = 1;
+            continue;
+        }
+        int failed = bulk_copy(fd, f->out_fd) != 0;
+        int err = errno;
+        if (fd != f->in_fd) close(fd);
+        if (failed && err == EPIPE) {
+            f->status = 128 + SIGPIPE;
+            break;
+        } else if (failed) {
+            fprintf(stderr, "cat: %s: %s\n", files[i], strerror(err));
+            f->status = 1;
+        }
+    }
+}
+
+// sort: the input is read in chunks of up to f->budget bytes (index
+// included). Each chunk is cut into parts sorted on their own threads; a
+// chunk that doesn't end the input is merged into a run on a temporary
+// file. At the end the runs and the last chunk's parts are merged into
+// the output. Runs come first and parts keep input order, so equal lines
+// leave in input order when -s or -u ask for it.
+void run_sort(Filter *f, OutBuf *o) {
+    size_t cap = 1024 * 1024, len = 0, newlines = 0;
+    char *buf = malloc(cap);
+    int *runs = NULL, nruns = 0, eof = 0;
+    while (1) {
+        if (!eof && (newlines == 0 || len + newlines * sizeof(SortLine) < f->budget)) {
+            if (len == cap) {
+                cap = cap < f->budget && cap * 2 > f->budget ? f->budget : cap * 2;
+                buf = realloc(buf, cap);
+            }
+            ssize_t n = stage_read(f, buf + len, cap - len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                eof = 1;
+            } else {
+                newlines += count_newlines(buf + len, n);
+                len += n;
+            }
+            continue;
+        }
+
+        // Whole lines only, unless this is the end
+        size_t cut = len;
+        if (!eof) while (buf[cut - 1] != '\n') cut--;
+        SortLine *lines = malloc(sizeof(SortLine) * (newlines + 1));
+        size_t count = 0;
+        for (char *p = buf; p < buf + cut; count++) {
+            char *nl = memchr(p, '\n', buf + cut - p);
+            size_t n = nl != NULL ? (size_t)(nl - p) : (size_t)(buf + cut - p);
+            lines[count].s = p;
+            lines[count].len = n;
+            sort_key(f, &lines[count]);
+            p += n + 1;
+        }
+        SortSource *src = calloc(nruns + SORT_MAX_THREADS, sizeof(SortSource));
+        int parts = sort_parts(f, lines, count, src + nruns);
+
+        if (eof) {
+            for (int i = 0; i < nruns; i++) {
+                src[i].fd = runs[i];
+                src[i].cap = SORT_RUN_BUF;
+                src[i].buf = malloc(SORT_RUN_BUF);
+                lseek(runs[i], 0, SEEK_SET);
+            }
+            sort_merge(f, src, nruns + parts, o, f->flags & SORT_UNIQUE);
+            for (int i = 0; i < nruns; i++) {
+                free(src[i].buf);
+                close(runs[i]);
+            }
+            free(src);
+            free(lines);
+            break;
+        }
+
+        int fd = sort_tmpfile();
+        OutBuf *run = malloc(sizeof(OutBuf));
+        run->fd = fd;
+        run->failed = fd < 0;
+        run->len = 0;
+        if (fd >= 0) {
+            sort_merge(f, src + nruns, parts, run, 0);
+            out_flush(run);
+        }
+        int failed = run->failed;
+        free(run);
+        free(src);
+        free(lines);
+        if (failed) {
+            fprintf(stderr, "sort: cannot write a temporary file: %s\n", strerror(errno));
+            if (fd >= 0) close(fd);
+            f->status = 2;
+            for (int i = 0; i < nruns; i++) close(runs[i]);
+            break;
+        }
+        runs = realloc(runs, sizeof(int) * (nruns + 1));
+        runs[nruns++] = fd;
+        memmove(buf, buf + cut, len - cut);
+        len -= cut;
+        newlines = 0;
+    }
+    free(runs);
+    free(buf);
+}
+
+// Byte order is the collation of the C locale only; elsewhere the real
+// sort runs
+int sort_collates_bytes() {
+    const char *names[] = { "LC_ALL", "LC_COLLATE", "LANG" };
+    for (int i = 0; i < 3; i++) {
+        char *loc = env_get((char*)names[i]);
+        if (loc == NULL || *loc == '\0') continue;
+        return strcmp(loc, "C") == 0 || strcmp(loc, "POSIX") == 0 || strncmp(loc, "C.", 2) == 0;
+    }
+    return 1;
+}
+
+// -k N[,M] with n, r or f after either field; character positions and the
+// other modifiers are left to the real sort
+int parse_sort_key(Filter *f, char *spec) {
+    char *p;
+    f->key_from = strtol(spec, &p, 10);
+    if (p == spec || f->key_from < 1) return -1;
+    for (int part = 0; part < 2; part++) {
+        for (; *p == 'n' || *p == 'r' || *p == 'f'; p++) {
+            f->key_flags |= SORT_OWN | (*p == 'n' ? SORT_NUMERIC : *p == 'r' ? SORT_REVERSE : SORT_FOLD);
+        }
+        if (part == 1 || *p != ',') break;
+        char *to = p + 1;
+        f->key_to = strtol(to, &p, 10);
+        if (p == to || f->key_to < f->key_from) return -1;
+    }
+    return *p == '\0' ? 0 : -1;
+}
+
+// 100, 64K, 512M, 2G
+long parse_size(const char *text) {
+    char *end;
+    long n = strtol(text, &end, 10);
+    if (end == text || n <= 0) return -1;
+    if (*end == 'K' || *end == 'k') n <<= 10, end++;
+    else if (*end == 'M' || *end == 'm') n <<= 20, end++;
+    else if (*end == 'G' || *end == 'g') n <<= 30, end++;
+    return *end == '\0' ? n : -1;
+}
+
+// The key runs from the start of field key_from (its leading blanks too,
+// as in sort without -b) to the end of field key_to
+void sort_key(Filter *f, SortLine *l) {
+    if (f->key_from == 0) {
+        l->key = 0;
+        l->key_len = l->len;
+        l->prefix = sort_prefix(f, l);
+        return;
+    }
+    const char *s = l->s, *end = s + l->len, *p = s, *start = NULL, *stop = end;
+    for (int field = 1; ; field++) {
+        if (field == f->key_from) start = p;
+        const char *fend = p;
+        if (f->delim) {
+            fend = memchr(p, f->delim, end - p);
+            if (fend == NULL) fend = end;
+        } else {
+            while (fend < end && (*fend == ' ' || *fend == '\t')) fend++;
+            while (fend < end && *fend != ' ' && *fend != '\t') fend++;
+        }
+        if (field == f->key_to || fend == end) {
+            stop = fend;
+            break;
+        }
+        p = f->delim ? fend + 1 : fend;
+    }
+    if (start == NULL) start = end;
+    if (stop < start) stop = start;
+    l->key = start - s;
+    l->key_len = stop - start;
+    l->prefix = sort_prefix(f, l);
+}
+
+// Text: the first 8 key bytes, big-endian. Numbers: nonnegative bit, the
+// count of integer digits, then the first 12 digits at 4 bits each; a
+// negative number takes the complement. Numbers too long to count here
+// all get the same prefix.
+uint64_t sort_prefix(Filter *f, SortLine *l) {
+    const char *k = l->s + l->key;
+    uint64_t p = 0;
+    if (!(f->key_flags & SORT_NUMERIC)) {
+        for (uint32_t i = 0; i < 8; i++) {
+            unsigned char c = i < l->key_len ? (unsigned char)k[i] : 0;
+            p = p << 8 | (f->key_flags & SORT_FOLD ? toupper(c) : c);
+        }
+        return p;
+    }
+    SortNum n;
+    parse_number(k, l->key_len, &n);
+    if (n.ilen >= 0x7fff) {
+        p = 0x7fffULL << 48 | 0xffffffffffffULL;
+    } else {
+        p = (uint64_t)n.ilen << 48;
+        for (size_t i = 0; i < 12; i++) {
+            int d = i < n.ilen ? n.ip[i] - '0' : i - n.ilen < n.flen ? n.fp[i - n.ilen] - '0' : 0;
+            p |= (uint64_t)d << (44 - 4 * i);
+        }
+    }
+    return n.neg ? ~p & ~(1ULL << 63) : p | 1ULL << 63;
+}
+
+// Key first, then (unless -s or -u) the whole line as bytes
+int sort_compare(Filter *f, const SortLine *a, const SortLine *b, int last_resort) {
+    int kf = f->key_flags;
+    const char *ka = a->s + a->key, *kb = b->s + b->key;
+    int r;
+    if (a->prefix != b->prefix) r = a->prefix < b->prefix ? -1 : 1;
+    else if (kf & SORT_NUMERIC) r = compare_numeric(ka, a->key_len, kb, b->key_len);
+    else r = compare_text(ka, a->key_len, kb, b->key_len, kf & SORT_FOLD);
+    if (r != 0) return kf & SORT_REVERSE ? -r : r;
+    if (!last_resort || (f->flags & (SORT_UNIQUE | SORT_STABLE))) return 0;
+    r = compare_text(a->s, a->len, b->s, b->len, 0);
+    return f->flags & SORT_REVERSE ? -r : r;
+}
+
+// Whether y sorts strictly before x; different prefixes settle it here
+static inline int sort_before(Filter *f, const SortLine *y, const SortLine *x) {
+    if (x->prefix != y->prefix) return (y->prefix < x->prefix) != ((f->key_flags & SORT_REVERSE) != 0);
+    return sort_compare(f, y, x, 1) < 0;
+}
+
+// Stable merge sort, so equal lines keep their input order. tmp holds n / 2.
+void sort_lines(Filter *f, SortLine *a, size_t n, SortLine *tmp) {
+    if (n <= 16) {
+        for (size_t i = 1; i < n; i++) {
+            SortLine l = a[i];
+            size_t j = i;
+            for (; j > 0 && sort_before(f, &l, &a[j - 1]); j--) a[j] = a[j - 1];
+            a[j] = l;
+        }
+        return;
+    }
+    size_t half = n / 2;
+    sort_lines(f, a, half, tmp);
+    sort_lines(f, a + half, n - half, tmp);
+    if (!sort_before(f, &a[half], &a[half - 1])) return;
+    memcpy(tmp, a, sizeof(SortLine) * half);
+    size_t i = 0, j = half, k = 0;
+    while (i < half && j < n) a[k++] = sort_before(f, &a[j], &tmp[i]) ? a[j++] : tmp[i++];
+    while (i < half) a[k++] = tmp[i++];
+}
+
+int compare_text(const char *a, size_t alen, const char *b, size_t blen, int fold) {
+    size_t n = alen < blen ? alen : blen;
+    int r = 0;
+    if (!fold) {
+        r = memcmp(a, b, n);
+    } else {
+        for (size_t i = 0; i < n && r == 0; i++) r = toupper((unsigned char)a[i]) - toupper((unsigned char)b[i]);
+    }
+    if (r != 0) return r < 0 ? -1 : 1;
+    return alen < blen ? -1 : alen > blen;
+}
+
+// Numbers are compared digit by digit, so any length works
+int compare_numeric(const char *a, size_t alen, const char *b, size_t blen) {
+    SortNum x, y;
+    parse_number(a, alen, &x);
+    parse_number(b, blen, &y);
+    if (x.neg != y.neg) return x.neg ? -1 : 1;
+    int r = x.ilen != y.ilen ? (x.ilen < y.ilen ? -1 : 1) : memcmp(x.ip, y.ip, x.ilen);
+    if (r == 0) {
+        r = memcmp(x.fp, y.fp, x.flen < y.flen ? x.flen : y.flen);
+        if (r == 0) r = x.flen < y.flen ? -1 : x.flen > y.flen;
+    }
+    r = r < 0 ? -1 : r > 0;
+    return x.neg ? -r : r;
+}
+
+// Leading blanks, '-', digits, '.', digits; whatever follows is ignored and
+// no digits at all is 0
+void parse_number(const char *p, size_t len, SortNum *n) {
+    const char *end = p + len;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    n->neg = p < end && *p == '-';
+    p += n->neg;
+    while (p < end && *p == '0') p++;
+    n->ip = p;
+    while (p < end && isdigit((unsigned char)*p)) p++;
+    n->ilen = p - n->ip;
+    n->fp = p;
+    n->flen = 0;
+    if (p < end && *p == '.') {
+        n->fp = ++p;
+        while (p < end && isdigit((unsigned char)*p)) p++;
+        n->flen = p - n->fp;
+        while (n->flen > 0 && n->fp[n->flen - 1] == '0') n->flen--;
+    }
+    if (n->ilen == 0 && n->flen == 0) n->neg = 0;
+}
+
+void* sort_part(void *arg) {
+    SortPart *part = arg;
+    SortLine *tmp = malloc(sizeof(SortLine) * (part->count / 2 + 1));
+    sort_lines(part->f, part->lines, part->count, tmp);
+    free(tmp);
+    return NULL;
+}
+
+// Sorts the lines as up to one part per CPU, each on its own thread, and
+// returns the parts as merge sources
+int sort_parts(Filter *f, SortLine *lines, size_t count, SortSource *src) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int parts = count < SORT_PARALLEL_MIN || cpus < 1 ? 1 : cpus < SORT_MAX_THREADS ? cpus : SORT_MAX_THREADS;
+    SortPart part[SORT_MAX_THREADS];
+    pthread_t threads[SORT_MAX_THREADS];
+    int started[SORT_MAX_THREADS] = { 0 };
+    for (int i = 0; i < parts; i++) {
+        part[i].f = f;
+        part[i].lines = lines + count * i / parts;
+        part[i].count = count * (i + 1) / parts - count * i / parts;
+        if (i > 0) started[i] = pthread_create(&threads[i], NULL, sort_part, &part[i]) == 0;
+    }
+    sort_part(&part[0]);
+    for (int i = 1; i < parts; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else sort_part(&part[i]);
+    }
+    for (int i = 0; i < parts; i++) {
+        src[i].lines = part[i].lines;
+        src[i].count = part[i].count;
+        src[i].fd = -1;
+    }
+    return parts;
+}
+
+// Moves s->cur to the source's next line; 0 when it has none left
+int sort_source_next(Filter *f, SortSource *s) {
+    if (s->fd < 0) {
+        if (s->next == s->count) return 0;
+        s->cur = s->lines[s->next++];
+        return 1;
+    }
+    while (1) {
+        char *nl = memchr(s->buf + s->start, '\n', s->end - s->start);
+        if (nl != NULL) {
+            s->cur.s = s->buf + s->start;
+            s->cur.len = nl - s->cur.s;
+            s->start = nl - s->buf + 1;
+            sort_key(f, &s->cur);
+            return 1;
+        }
+        // Runs end every line with a newline
+        if (s->eof) return 0;
+        memmove(s->buf, s->buf + s->start, s->end - s->start);
+        s->end -= s->start;
+        s->start = 0;
+        if (s->end == s->cap) s->buf = realloc(s->buf, s->cap *= 2);
+        ssize_t n = read(s->fd, s->buf + s->end, s->cap - s->end);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) s->eof = 1;
+        else s->end += n;
+    }
+}
+
+// Heap order; ties go to the earlier source, which holds earlier input
+int sort_less(Filter *f, SortSource *src, int a, int b) {
+    int r = sort_compare(f, &src[a].cur, &src[b].cur, 1);
+    return r < 0 || (r == 0 && a < b);
+}
+
+// k-way merge through a binary heap of source indexes. With unique, a line
+// whose key equals the last one written is dropped.
+void sort_merge(Filter *f, SortSource *src, int n, OutBuf *o, int unique) {
+    int *heap = malloc(sizeof(int) * (n + 1)), size = 0;
+    for (int i = 0; i < n; i++) {
+        if (!sort_source_next(f, &src[i])) continue;
+        int at = size++;
+        while (at > 0 && sort_less(f, src, i, heap[(at - 1) / 2])) {
+            heap[at] = heap[(at - 1) / 2];
+            at = (at - 1) / 2;
+        }
+        heap[at] = i;
+    }
+    char *last = NULL;
+    size_t last_cap = 0;
+    SortLine prev;
+    int have_prev = 0;
+    while (size > 0 && !o->failed) {
+        SortLine *l = &src[heap[0]].cur;
+        if (!unique || !have_prev || sort_compare(f, &prev, l, 0) != 0) {
+            out_write(o, l->s, l->len);
+            out_write(o, "\n", 1);
+            if (unique) {
+                if (l->len > last_cap) last = realloc(last, last_cap = l->len * 2 + 64);
+                memcpy(last, l->s, l->len);
+                prev = *l;
+                prev.s = last;
+                have_prev = 1;
+            }
+        }
+        int top = heap[0];
+        if (!sort_source_next(f, &src[top])) top = heap[--size];
+        for (int at = 0; ; ) {
+            int child = 2 * at + 1;
+            if (child >= size) {
+                if (size > 0) heap[at] = top;
+                break;
+            }
+            if (child + 1 < size && sort_less(f, src, heap[child + 1], heap[child])) child++;
+            if (!sort_less(f, src, heap[child], top)) {
+                heap[at] = top;
+                break;
+            }
+            heap[at] = heap[child];
+            at = child;
+        }
+    }
+    free(last);
+    free(heap);
+}
+
+// Unnamed when the filesystem allows it, so nothing is left behind
+int sort_tmpfile() {
+    const char *dir = env_get("TMPDIR");
+    if (dir == NULL || *dir == '\0') dir = "/tmp";
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) return fd;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/shell-sortXXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd >= 0) unlink(path);
+    return fd;
+}
+
+// cp SRC DST, where DST may be a directory
+int cp_builtin(char* arglist[]) {
+    char target[PATH_MAX];
+    struct stat st, dst;
+    char *src = arglist[1];
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0 || fstat(in, &st) != 0) {
+        fprintf(stderr, "cp: %s: %s\n", src, strerror(errno));
+        if (in >= 0) close(in);
+        return 1;
+    }
+    // Checked before the target is touched: open() would truncate it
+    if (S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "cp: -r not specified; omitting directory '%s'\n", src);
+        close(in);
+        return 1;
+    }
+    snprintf(target, sizeof(target), "%s", arglist[2]);
+    if (stat(target, &dst) == 0 && S_ISDIR(dst.st_mode)) {
+        char *base = strrchr(src, '/');
+        snprintf(target, sizeof(target), "%s/%s", arglist[2], base != NULL ? base + 1 : src);
+    }
+    if (stat(target, &dst) == 0 && dst.st_dev == st.st_dev && dst.st_ino == st.st_ino) {
+        fprintf(stderr, "cp: %s and %s are the same file\n", src, target);
+        close(in);
+        return 1;
+    }
+    int out = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+    if (out < 0) {
+        fprintf(stderr, "cp: %s: %s\n", target, strerror(errno));
+        close(in);
+        return 1;
+    }
+    int status = 0;
+    if (bulk_copy(in, out) != 0) {
+        fprintf(stderr, "cp: %s: %s\n", target, strerror(errno));
+        status = 1;
+    }
+    close(in);
+    if (close(out) != 0) status = 1;
+    return status;
+}
+
+// read() for filter stages: inflated after "<z", otherwise straight from
+// the file
+ssize_t stage_read(Filter *f, char *buf, size_t len) {
+    return f->gz != NULL ? gz_read(f, buf, len) : stage_read_raw(f, buf, len);
+}
+
+// Served from the read-ahead ring when there is one
+ssize_t stage_read_raw(Filter *f, char *buf, size_t len) {
+    Ring *r = f->ring;
+    if (r == NULL) return read(f->in_fd, buf, len);
+    if (r->next >= r->blocks) return 0;
+    int slot = r->next % r->depth;
+    while (r->got[slot] < 0) {
+        int s, write, res;
+        if (ring_reap(r, &s, &write, &res) != 0) return -1;
+        if (res < 0) {
+            errno = -res;
+            return -1;
+        }
+        r->got[s] = res;
+    }
+    size_t n = r->got[slot] - r->done[slot];
+    if (n > len) n = len;
+    memcpy(buf, r->bufs + (size_t)slot * RING_BUF + r->done[slot], n);
+    r->done[slot] += n;
+    if (r->done[slot] == (size_t)r->got[slot]) {
+        // A short block means the file shrank underneath us
+        if (r->got[slot] < RING_BUF) r->blocks = r->next + 1;
+        r->next++;
+        if (r->next + r->depth - 1 < r->blocks) ring_read_block(r, f->in_fd, r->next + r->depth - 1, 0);
+    }
+    return n;
+}
+
+// Copies in_fd to out_fd until EOF. A large regular file goes through
+// io_uring with the queue depth sized to the file, otherwise (or where
+// io_uring is unavailable) copy_file_range, then sendfile, then read/write.
+// Returns -1 with errno set when the copy fails.
+int bulk_copy(int in_fd, int out_fd) {
+    struct stat in_st, out_st;
+    int regular = fstat(in_fd, &in_st) == 0 && S_ISREG(in_st.st_mode);
+    off_t pos = lseek(in_fd, 0, SEEK_CUR);
+    if (regular && pos >= 0 && in_st.st_size - pos >= RING_MIN && fstat(out_fd, &out_st) == 0) {
+        Ring r;
+        long blocks = (in_st.st_size - pos + RING_BUF - 1) / RING_BUF;
+        if (ring_open(&r, blocks < RING_DEPTH ? blocks : RING_DEPTH) == 0) {
+            // Positional writes may finish in any order, appends and pipes can't
+            off_t out_off = lseek(out_fd, 0, SEEK_CUR);
+            int stream = !S_ISREG(out_st.st_mode) || out_off < 0 || (fcntl(out_fd, F_GETFL) & O_APPEND);
+            r.base = pos;
+            r.end = in_st.st_size;
+            r.blocks = blocks;
+            int result = ring_copy(&r, in_fd, out_fd, out_off, stream);
+            int err = errno;
+            ring_close(&r);
+            lseek(in_fd, r.end, SEEK_SET);
+            if (!stream) lseek(out_fd, out_off + (r.end - r.base), SEEK_SET);
+            errno = err;
+            return result;
+        }
+    }
+
+    ssize_t n;
+    if (regular) {
+        while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0)) > 0) continue;
+        if (n == 0) return 0;
+        if (errno != EXDEV && errno != EINVAL && errno != EBADF && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+        while ((n = sendfile(out_fd, in_fd, NULL, 1 << 30)) > 0) continue;
+        if (n == 0) return 0;
+        if (errno != EINVAL && errno != ENOSYS) return -1;
+    }
+    char buf[FILTER_BUF];
+    while ((n = read(in_fd, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out_fd, buf + off, n - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) return -1;
+            off += w;
+        }
+    }
+    return 0;
+}
+
+// Sets up the rings and registers depth buffers of RING_BUF bytes. Fails
+// where io_uring is missing or disabled, callers fall back then.
+int ring_open(Ring *r, int depth) {
+    struct io_uring_params p;
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, depth * 2, &p);
+    if (r->fd < 0) return -1;
+    r->depth = depth;
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    r->bufs = mmap(NULL, (size_t)depth * RING_BUF, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED
+            || r->bufs == MAP_FAILED) {
+        ring_close(r);
+        return -1;
+    }
+
+    struct iovec iov[RING_DEPTH];
+    for (int i = 0; i < depth; i++) {
+        iov[i].iov_base = r->bufs + (size_t)i * RING_BUF;
+        iov[i].iov_len = RING_BUF;
+    }
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, depth) != 0) {
+        ring_close(r);
+        return -1;
+    }
+    char *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+// Closing the ring cancels whatever is still in flight
+void ring_close(Ring *r) {
+    if (r->fd >= 0) close(r->fd);
+    if (r->sq_map != NULL && r->sq_map != MAP_FAILED) munmap(r->sq_map, r->sq_map_size);
+    if (r->cq_map != NULL && r->cq_map != MAP_FAILED) munmap(r->cq_map, r->cq_map_size);
+    if (r->sqes != NULL && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+    if (r->bufs != NULL && r->bufs != MAP_FAILED) munmap(r->bufs, (size_t)r->depth * RING_BUF);
+    r->fd = -1;
+}
+
+// Queues a fixed-buffer read or write of len bytes at skip into the slot's
+// buffer. It's submitted by the next ring_reap().
+void ring_prep(Ring *r, int fd, int slot, size_t skip, size_t len, off_t off, int flags, int write) {
+    unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->flags = flags;
+    sqe->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)slot * RING_BUF + skip);
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = slot;
+    sqe->user_data = (uint64_t)slot << 1 | write;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+    r->inflight++;
+}
+
+// Submits anything queued and returns the next completion
+int ring_reap(Ring *r, int *slot, int *write, int *res) {
+    while (1) {
+        unsigned head = *r->cq_head;
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            *slot = cqe->user_data >> 1;
+            *write = cqe->user_data & 1;
+            *res = cqe->res;
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            r->inflight--;
+            return 0;
+        }
+        int n = syscall(__NR_io_uring_enter, r->fd, r->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0 && errno != EINTR) return -1;
+        if (n > 0) r->queued -= n;
+    }
+}
+
+void ring_read_block(Ring *r, int fd, long blk, int flags) {
+    int slot = blk % r->depth;
+    off_t off = r->base + (off_t)blk * RING_BUF;
+    r->blk[slot] = blk;
+    r->got[slot] = -1;
+    r->done[slot] = 0;
+    ring_prep(r, fd, slot, 0, r->end - off < RING_BUF ? r->end - off : RING_BUF, off, flags, 0);
+}
+
+// Moves [base, end) of in_fd to out_fd. Positional output gets a linked
+// read->write pair per block with every slot in flight. Pipes and appends
+// need their writes in order, so there the reads run ahead and a single
+// write is outstanding.
+int ring_copy(Ring *r, int in_fd, int out_fd, off_t out_off, int stream) {
+    long next_write = 0;
+    int writing = 0, failed = 0;
+    for (long k = 0; k < r->depth && k < r->blocks; k++) {
+        ring_read_block(r, in_fd, k, stream ? 0 : IOSQE_IO_LINK);
+        if (!stream) {
+            ring_prep(r, out_fd, k, 0, r->end - r->base - k * RING_BUF < RING_BUF
+                      ? r->end - r->base - k * RING_BUF : RING_BUF, out_off + k * RING_BUF, 0, 1);
+        }
+    }
+
+    while (r->inflight > 0) {
+        int slot, write, res;
+        if (ring_reap(r, &slot, &write, &res) != 0) return -1;
+        long blk = r->blk[slot];
+        off_t at = (off_t)blk * RING_BUF;
+        if (failed) continue;
+        if (res < 0 && res != -ECANCELED) {
+            failed = -res;
+            continue;
+        }
+
+        if (!write) {
+            off_t len = r->end - r->base - at;
+            r->got[slot] = res;
+            if (res < len && res < RING_BUF) {
+                // Short read: the file ended early
+                r->end = r->base + at + res;
+                r->blocks = blk + (res > 0);
+            }
+        } else if (res == -ECANCELED) {
+            // The short read above broke the link, write what it got
+            if (r->got[slot] > 0) ring_prep(r, out_fd, slot, 0, r->got[slot], out_off + at, 0, 1);
+            continue;
+        } else {
+            r->done[slot] += res;
+            if (r->done[slot] < (size_t)r->got[slot]) {
+                ring_prep(r, out_fd, slot, r->done[slot], r->got[slot] - r->done[slot],
+                          stream ? -1 : out_off + at + (off_t)r->done[slot], 0, 1);
+                continue;
+            }
+            // Block written, its slot takes the block depth further on
+            long k = blk + r->depth;
+            if (stream) {
+                writing = 0;
+                next_write++;
+            }
+            if (k < r->blocks) {
+                ring_read_block(r, in_fd, k, stream ? 0 : IOSQE_IO_LINK);
+                if (!stream) {
+                    off_t len = r->end - r->base - k * RING_BUF;
+                    ring_prep(r, out_fd, slot, 0, len < RING_BUF ? len : RING_BUF, out_off + k * RING_BUF, 0, 1);
+                }
+            }
+        }
+
+        if (stream && !writing && next_write < r->blocks) {
+            int s = next_write % r->depth;
+            if (r->blk[s] == next_write && r->got[s] > 0) {
+                ring_prep(r, out_fd, s, 0, r->got[s], -1, 0, 1);
+                writing = 1;
+            }
+        }
+    }
+    if (failed) {
+        errno = failed;
+        return -1;
+    }
+    return 0;
+}
+
+// Runs the event loop until fd is readable. Regular files can't be polled
+// and are always ready.
+void wait_for_input(int fd) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_TAG(EV_INPUT, 0) };
+    if (epoll_ctl(loop_epfd, EPOLL_CTL_ADD, fd, &ev) != 0) return;
+    input_ready = 0;
+    while (!input_ready) run_events(-1);
+    epoll_ctl(loop_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Resident mode: each SOCK_SEQPACKET message is one command line carrying
+// the client's stdin/stdout/stderr as SCM_RIGHTS, the reply is its status.
+int run_server(char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    unlink(path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+            || listen(listen_fd, 64) != 0) {
+        perror("server");
+        return 1;
+    }
+    for (int i = 0; i < 3; i++) saved_stdio[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+    server_cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    for (int i = 0; i < MAX_SESSIONS; i++) sessions[i].fd = -1;
+    signal(SIGPIPE, SIG_IGN);
+    server_mode = 1;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_TAG(EV_LISTEN, 0) };
+    epoll_ctl(loop_epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    while (1) {
+        run_events(-1);
+        server_collect();
+        trace_flush();
+    }
+}
+
+void server_accept() {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) return;
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        Session *sess = &sessions[i];
+        if (sess->fd != -1) continue;
+        memset(sess, 0, sizeof(*sess));
+        sess->fd = fd;
+        sess->state_fd = -1;
+        sess->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        sess->env = env_copy(environ);
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_TAG(EV_CLIENT, i) };
+        epoll_ctl(loop_epfd, EPOLL_CTL_ADD, fd, &ev);
+        return;
+    }
+    close(fd);
+}
+
+// The session's fd leaves the epoll set until the reply is sent, so a
+// command sent ahead waits in the socket instead of looking like a hangup
+void server_request(int idx) {
+    Session *sess = &sessions[idx];
+    // Messages keep their boundaries: peek at the full length first
+    ssize_t len = recv(sess->fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+    if (len < 0 && errno == EAGAIN) return;
+    char *cmd = malloc(len > 0 ? len + 1 : 1);
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { cmd, len > 0 ? len : 0 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t n = len <= 0 ? len : recvmsg(sess->fd, &msg, MSG_CMSG_CLOEXEC);
+    epoll_ctl(loop_epfd, EPOLL_CTL_DEL, sess->fd, NULL);
+    if (n <= 0) {
+        free(cmd);
+        session_close(sess);
+        return;
+    }
+    cmd[n] = '\0';
+    cmd_ready_ns = sess->started = now_ns();
+
+    // The control buffer is padded, so a fourth fd can still fit in it
+    int fds[4] = { -1, -1, -1, -1 }, nfds = 0;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm != NULL && cm->cmsg_type == SCM_RIGHTS) {
+        nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (nfds > 4) nfds = 4;
+        memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+    }
+    // Cut short, or more than stdin, stdout and stderr: a part of a
+    // command is never run
+    if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || nfds > 3) {
+        if (fds[2] >= 0) dprintf(fds[2], "server: malformed request, command not run\n");
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+        free(cmd);
+        sess->busy = 1;
+        sess->pending.count = 0;
+        sess->last_status = 2;
+        server_collect();
+        return;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] < 0) continue;
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+
+    session_enter(sess);
+    parse_and_execute(cmd);
+    free(cmd);
+    fflush(stdout);
+    fflush(stderr);
+    sess->pending = fg;
+    fg.count = 0;
+    fg.relay = NULL;
+    fg.arena = NULL;
+    sess->busy = 1;
+    session_leave(sess);
+
+    for (int i = 0; i < 3; i++) dup2(saved_stdio[i], i);
+    server_collect();
+}
+
+// Replies to every session whose foreground pipeline has finished
+void server_collect() {
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        Session *sess = &sessions[i];
+        if (sess->fd == -1 || !sess->busy || !foreground_done(&sess->pending)) continue;
+        if (sess->pending.count > 0) {
+            sess->last_status = wait_foreground(&sess->pending);
+            if (sess->last_status != 0) metrics->failures++;
+            hist_record(&metrics->wall, now_ns() - sess->started);
+        }
+        if (sess->state_fd >= 0) session_take_state(sess);
+        sess->busy = 0;
+        // A client that hung up meanwhile fails the send
+        if (send(sess->fd, &sess->last_status, sizeof(int), MSG_NOSIGNAL) < 0 || sess->exiting) {
+            session_close(sess);
+            continue;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_TAG(EV_CLIENT, i) };
+        epoll_ctl(loop_epfd, EPOLL_CTL_ADD, sess->fd, &ev);
+    }
+}
+
+// A script that runs only builtins which change variables or the cwd, or
+// print, and background jobs, with no $( ) or backquotes, never waits on
+// another process
+int script_in_process(Program *prog) {
+    for (int i = 0; i < prog->count; i++) {
+        Insn *in = &prog->code[i];
+        if (in->text != NULL && (strstr(in->text, "$(") != NULL || strchr(in->text, '`') != NULL)) return 0;
+        if (in->op == OP_SUBSHELL && !script_in_process(in->body)) return 0;
+        if (in->op != OP_CMD) continue;
+        size_t len = strlen(in->text);
+        while (len > 0 && (in->text[len - 1] == ' ' || in->text[len - 1] == '\t')) len--;
+        if (len > 0 && in->text[len - 1] == '&') continue;
+        if (!in->builtin || find_function(in->name) != NULL) return 0;
+        Builtin *b = find_builtin(in->name);
+        if (b == NULL || !(b->flags & BUILTIN_SCOPED)) return 0;
+    }
+    return 1;
+}
+
+// Any other script can loop and wait for as long as it likes, so it runs
+// in a forked copy of the session and the server or library thread goes
+// on serving the others. The caller is answered when the copy exits, and
+// what it changed (variables, exports, functions, cwd) is taken in then.
+// Background jobs it starts belong to the copy.
+void session_fork(Session *sess, Program *prog) {
+    int state_fd = memfd_create("session-state", MFD_CLOEXEC);
+    fflush(stdout);
+    pid_t pid = state_fd < 0 ? -1 : fork();
+    if (pid == 0) {
+        subshell_init();
+        run_program(prog);
+        fflush(stdout);
+        fflush(stderr);
+        session_send_state(sess, state_fd);
+        _exit(last_status);
+    }
+    if (pid < 0) {
+        // Run here instead, holding up the other sessions until it's done
+        if (state_fd >= 0) close(state_fd);
+        run_program(prog);
+        func_return = 0;
+        return;
+    }
+    metrics->forks++;
+    fg.pids[0] = pid;
+    fg.deadlines[0] = add_deadline(pid, -1, 0, 0, DL_FOREGROUND);
+    fg.filters[0] = NULL;
+    fg.count = 1;
+    fg.arena = NULL;
+    sess->state_fd = state_fd;
+}
+
+// Records of NUL-terminated fields after a tag: c cwd, x exit ran,
+// v name value global, e NAME=value, f name body. Functions are sent only
+// when the script (re)defined them; sess still has the table from before.
+void session_send_state(Session *sess, int fd) {
+    FILE *out = fdopen(fd, "w");
+    if (out == NULL) return;
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) fprintf(out, "c%s%c", cwd, 0);
+    fprintf(out, "x%d%c", session_exit, 0);
+    VarList list = { NULL };
+    var_each(vars, collect_var, &list);
+    for (int i = 0; i < list.count; i++) {
+        VarNode *v = list.leaves[i];
+        fprintf(out, "v%s%c%s%c%d%c", v->name, 0, v->value, 0, v->global, 0);
+    }
+    free(list.leaves);
+    for (char **e = shell_env; e != NULL && *e != NULL; e++) fprintf(out, "e%s%c", *e, 0);
+    for (int i = 0; i < function_count; i++) {
+        int same = 0;
+        for (int k = 0; k < sess->function_count; k++) {
+            if (sess->functions[k].body == functions[i].body) same = 1;
+        }
+        if (!same && functions[i].body->source != NULL) {
+            fprintf(out, "f%s%c%s%c", functions[i].name, 0, functions[i].body->source, 0);
+        }
+    }
+    fclose(out);
+}
+
+// Nothing sent means the copy was killed first, and the session stays as
+// it was
+void session_take_state(Session *sess) {
+    size_t len;
+    lseek(sess->state_fd, 0, SEEK_SET);
+    char *buf = read_all(sess->state_fd, &len);
+    close(sess->state_fd);
+    sess->state_fd = -1;
+    if (len == 0 || buf[len - 1] != '\0') {
+        free(buf);
+        return;
+    }
+    session_enter(sess);
+    var_unref(vars);
+    vars = NULL;
+    int env_count = 0;
+    char **env = malloc(sizeof(char*) * (len / 2 + 1));
+    for (char *p = buf, *end = buf + len; p < end; ) {
+        char tag = *p++;
+        char *a = p, *b = a + strlen(a) + 1, *c = b < end ? b + strlen(b) + 1 : end;
+        if (tag == 'c') {
+            if (chdir(a) != 0) perror("cd failed");
+            p = b;
+        } else if (tag == 'x') {
+            session_exit = atoi(a);
+            p = b;
+        } else if (tag == 'v' && c < end) {
+            set_var(a, b, atoi(c));
+            p = c + strlen(c) + 1;
+        } else if (tag == 'e') {
+            env[env_count++] = a;
+            p = b;
+        } else if (tag == 'f' && b < end) {
+            char *def = malloc(strlen(a) + strlen(b) + 4);
+            sprintf(def, "%s() %s", a, b);
+            Program *prog = compile(def);
+            int status = last_status;
+            if (!prog->error) run_program(prog);
+            last_status = status;
+            free_program(prog);
+            free(def);
+            p = c;
+        } else {
+            break;
+        }
+    }
+    env[env_count] = NULL;
+    env_free(shell_env);
+    shell_env = env_copy(env);
+    free(env);
+    free(buf);
+    session_leave(sess);
+}
+
+void session_enter(Session *sess) {
+    vars = sess->vars;
+    memcpy(history, sess->history, sizeof(history));
+    history_count = sess->history_count;
+    memcpy(functions, sess->functions, sizeof(functions));
+    function_count = sess->function_count;
+    shell_env = sess->env;
+    current_session = sess;
+    last_status = sess->last_status;
+    session_exit = 0;
+    fchdir(sess->cwd_fd);
+}
+
+void session_leave(Session *sess) {
+    sess->vars = vars;
+    vars = NULL;
+    memcpy(sess->history, history, sizeof(history));
+    sess->history_count = history_count;
+    memcpy(sess->functions, functions, sizeof(functions));
+    sess->function_count = function_count;
+    function_count = 0;
+    sess->env = shell_env;
+    shell_env = NULL;
+    current_session = NULL;
+    sess->last_status = last_status;
+    close(sess->cwd_fd);
+    sess->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (server_cwd_fd >= 0) fchdir(server_cwd_fd);
+    sess->exiting = session_exit;
+}
+
+// Its background jobs keep running and are dropped once reaped
+void session_free(Session *sess) {
+    var_unref(sess->vars);
+    for (int i = 0; i < sess->history_count; i++) free(sess->history[i]);
+    for (int i = 0; i < sess->function_count; i++) free(sess->functions[i].name);
+    env_free(sess->env);
+    close(sess->cwd_fd);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].pid == 0 || jobs[i].owner != sess) continue;
+        if (jobs[i].done) {
+            remove_job(jobs[i].pid);
+            continue;
+        }
+        jobs[i].owner = NULL;
+        jobs[i].disowned = 1;
+    }
+}
+
+void session_close(Session *sess) {
+    session_free(sess);
+    epoll_ctl(loop_epfd, EPOLL_CTL_DEL, sess->fd, NULL);
+    close(sess->fd);
+    sess->fd = -1;
+}
+
+// Embedded sessions go through the same swap as server sessions. Every
+// call is carried out on one library thread with its own cwd and fd table,
+// so a session's cd or a captured stdout never reaches the host's threads.
+// Like the server, it starts a command and goes back to its event loop;
+// the call returns once the pipeline or forked script is done.
+struct ShellSession {
+    Session sess;
+    pid_t spawned[MAX_JOBS];   // shell_spawn's copies not waited for yet, under library_lock
+    int spawned_count;
+};
+
+pthread_mutex_t library_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t library_cond = PTHREAD_COND_INITIALIZER;
+pthread_once_t library_once = PTHREAD_ONCE_INIT;
+LibraryCall *library_incoming = NULL;   // handed over, newest first
+int library_ready = 0;
+
+void library_init() {
+    library_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_t thread;
+    pthread_create(&thread, NULL, library_main, NULL);
+    pthread_detach(thread);
+    pthread_mutex_lock(&library_lock);
+    while (!library_ready) pthread_cond_wait(&library_cond, &library_lock);
+    pthread_mutex_unlock(&library_lock);
+}
+
+// What main does for the interactive shell, minus the spawn helper: the
+// host may not be small at this point. The forks and filter threads it
+// starts share its cwd and fds, not the host's.
+void* library_main(void *arg) {
+    (void)arg;
+    unshare(CLONE_FS | CLONE_FILES);
+    stdout = fdopen(STDOUT_FILENO, "w");
+    if (stdout == NULL) stdout = fopen("/dev/null", "w");
+    for (int i = 0; i < MAX_JOBS; i++) jobs[i].pidfd = -1;
+    event_loop_init();
+    metrics_init();
+    library_mode = 1;
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_TAG(EV_LIBRARY, 0) };
+    epoll_ctl(loop_epfd, EPOLL_CTL_ADD, library_wake_fd, &ev);
+    pthread_mutex_lock(&library_lock);
+    library_ready = 1;
+    pthread_cond_broadcast(&library_cond);
+    pthread_mutex_unlock(&library_lock);
+    LibraryCall *queue = NULL;   // in arrival order: not started, or waiting on a pipeline
+    while (1) {
+        pthread_mutex_lock(&library_lock);
+        LibraryCall *incoming = library_incoming;
+        library_incoming = NULL;
+        pthread_mutex_unlock(&library_lock);
+        LibraryCall **tail = &queue;
+        while (*tail != NULL) tail = &(*tail)->next;
+        for (LibraryCall *call = incoming, *before = NULL; call != NULL; call = before) {
+            before = call->next;
+            call->next = *tail;
+            *tail = call;
+        }
+
+        // A session runs one command at a time; calls on it wait their turn
+        for (LibraryCall **p = &queue; *p != NULL; ) {
+            LibraryCall *call = *p;
+            Session *sess = call->s != NULL ? &call->s->sess : NULL;
+            if (!call->started) {
+                if (sess != NULL && sess->busy) {
+                    p = &call->next;
+                    continue;
+                }
+                call->started = 1;
+                call->run(call);
+            }
+            if (call->run == library_run && sess->busy) {
+                if (!foreground_done(&sess->pending)) {
+                    p = &call->next;
+                    continue;
+                }
+                library_finish(call);
+            }
+            *p = call->next;
+            pthread_mutex_lock(&library_lock);
+            call->done = 1;
+            pthread_cond_broadcast(&library_cond);
+            pthread_mutex_unlock(&library_lock);
+        }
+        // Woken by a pipeline's process or thread, or by a new call
+        run_events(-1);
+    }
+    return NULL;
+}
+
+// Calls from any host thread
+void library_call(LibraryCall *call) {
+    pthread_once(&library_once, library_init);
+    call->out = -1;
+    pthread_mutex_lock(&library_lock);
+    call->next = library_incoming;
+    library_incoming = call;
+    uint64_t one = 1;
+    if (write(library_wake_fd, &one, sizeof(one)) < 0) perror("library");
+    while (!call->done) pthread_cond_wait(&library_cond, &library_lock);
+    pthread_mutex_unlock(&library_lock);
+}
+
+// Starts in the cwd the host had when it made the session
+void library_new(LibraryCall *call) {
+    ShellSession *s = calloc(1, sizeof(ShellSession));
+    s->sess.fd = -1;
+    s->sess.state_fd = -1;
+    s->sess.cwd_fd = open(call->name != NULL ? call->name : ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    s->sess.env = env_copy(environ);
+    call->s = s;
+}
+
+void library_free(LibraryCall *call) {
+    session_free(&call->s->sess);
+    free(call->s);
+}
+
+// With a buffer, stdout goes into a memfd for this call. A memfd rather
+// than a pipe: builtins write from this thread, so nothing could drain a
+// pipe while they run. Whatever the line started is left in the session's
+// pending foreground, as in server mode, for library_finish.
+void library_run(LibraryCall *call) {
+    Session *sess = &call->s->sess;
+    call->status = -1;
+    if (sess->exiting) return;
+    int saved = -1;
+    if (call->buf != NULL) {
+        call->out = memfd_create("shell-capture", MFD_CLOEXEC);
+        if (call->out < 0) return;
+        saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(call->out, STDOUT_FILENO);
+    }
+    session_enter(sess);
+    char *line = strdup(call->cmdline);
+    parse_and_execute(line);
+    free(line);
+    fflush(stdout);
+    fflush(stderr);
+    sess->pending = fg;
+    fg.count = 0;
+    fg.relay = NULL;
+    fg.arena = NULL;
+    sess->busy = 1;
+    session_leave(sess);
+    if (call->out < 0) return;
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    } else close(STDOUT_FILENO);
+}
+
+void library_finish(LibraryCall *call) {
+    Session *sess = &call->s->sess;
+    if (sess->pending.count > 0) sess->last_status = wait_foreground(&sess->pending);
+    if (sess->state_fd >= 0) session_take_state(sess);
+    sess->busy = 0;
+    call->status = sess->last_status;
+    if (call->out < 0) return;
+    struct stat st;
+    call->len = fstat(call->out, &st) == 0 ? st.st_size : 0;
+    size_t got = 0, want = call->len < call->cap ? call->len : call->cap;
+    while (got < want) {
+        ssize_t n = pread(call->out, call->buf + got, want - got, got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(call->out);
+}
+
+void library_spawn(LibraryCall *call) {
+    Session *sess = &call->s->sess;
+    call->pid = -1;
+    if (sess->exiting) return;
+    session_enter(sess);
+    fflush(stdout);
+    call->pid = fork();
+    if (call->pid == 0) {
+        subshell_init();
+        parse_and_execute(strdup(call->cmdline));
+        fflush(stdout);
+        fflush(stderr);
+        _exit(last_status);
+    }
+    session_leave(sess);
+}
+
+void library_get_var(LibraryCall *call) {
+    Session *sess = &call->s->sess;
+    VarNode *leaf = var_find(sess->vars, (char*)call->name);
+    shell_env = sess->env;
+    char *value = leaf != NULL ? leaf->value : env_get((char*)call->name);
+    shell_env = NULL;
+    call->copy = value != NULL ? strdup(value) : NULL;
+}
+
+void library_set_var(LibraryCall *call) {
+    session_enter(&call->s->sess);
+    set_var((char*)call->name, (char*)call->value, 0);
+    session_leave(&call->s->sess);
+}
+
+ShellSession* shell_session_new(void) {
+    char cwd[PATH_MAX];
+    LibraryCall call = { .run = library_new, .name = getcwd(cwd, sizeof(cwd)) };
+    library_call(&call);
+    return call.s;
+}
+
+void shell_session_free(ShellSession *s) {
+    if (s == NULL) return;
+    LibraryCall call = { .run = library_free, .s = s };
+    library_call(&call);
+}
+
+int shell_run(ShellSession *s, const char *cmdline) {
+    LibraryCall call = { .run = library_run, .s = s, .cmdline = cmdline };
+    library_call(&call);
+    return call.status;
+}
+
+int shell_capture(ShellSession *s, const char *cmdline, char *buf, size_t cap, size_t *len) {
+    LibraryCall call = { .run = library_run, .s = s, .cmdline = cmdline, .buf = buf, .cap = cap };
+    library_call(&call);
+    if (len != NULL) *len = call.len;
+    return call.status;
+}
+
+// The pidfd is opened here: the library thread's fds aren't the host's
+pid_t shell_spawn(ShellSession *s, const char *cmdline, int *pidfd) {
+    pthread_mutex_lock(&library_lock);
+    int full = s->spawned_count == MAX_JOBS;
+    pthread_mutex_unlock(&library_lock);
+    if (full) return -1;
+    LibraryCall call = { .run = library_spawn, .s = s, .cmdline = cmdline };
+    library_call(&call);
+    if (call.pid < 0) return -1;
+    pthread_mutex_lock(&library_lock);
+    s->spawned[s->spawned_count++] = call.pid;
+    pthread_mutex_unlock(&library_lock);
+    *pidfd = syscall(SYS_pidfd_open, call.pid, 0);
+    return call.pid;
+}
+
+// -1, leaving pidfd open, when pid isn't a copy s spawned
+int shell_wait(ShellSession *s, pid_t pid, int pidfd) {
+    int found = 0;
+    pthread_mutex_lock(&library_lock);
+    for (int i = 0; i < s->spawned_count; i++) {
+        if (s->spawned[i] != pid) continue;
+        s->spawned[i] = s->spawned[--s->spawned_count];
+        found = 1;
+        break;
+    }
+    pthread_mutex_unlock(&library_lock);
+    if (!found) return -1;
+    int status;
+    pid_t r = waitpid(pid, &status, 0);
+    if (pidfd >= 0) close(pidfd);
+    return r == pid ? status_code(status) : -1;
+}
+
+char* shell_get_var(ShellSession *s, const char *name) {
+    LibraryCall call = { .run = library_get_var, .s = s, .name = name };
+    library_call(&call);
+    return call.copy;
+}
+
+void shell_set_var(ShellSession *s, const char *name, const char *value) {
+    LibraryCall call = { .run = library_set_var, .s = s, .name = name, .value = value };
+    library_call(&call);
+}
+
+int connect_session(char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) return fd;
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+// Runs one command line on a server session, returns its status or -1
+int send_command(int fd, char *cmd, int fds[3]) {
+    int status;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { cmd, strlen(cmd) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, 3 * sizeof(int));
+    if (sendmsg(fd, &msg, 0) < 0 || recv(fd, &status, sizeof(status), 0) != sizeof(status)) return -1;
+    return status;
+}
+
+// Test client: runs each argument as one command line on a single session
+// and exits with the last status
+int run_client(char *path, char* cmds[], int count) {
+    int fd = connect_session(path);
+    if (fd < 0) {
+        perror("client");
+        return 1;
+    }
+    int status = 0;
+    int fds[3] = { 0, 1, 2 };
+    for (int i = 0; i < count; i++) {
+        if ((status = send_command(fd, cmds[i], fds)) < 0) {
+            fprintf(stderr, "client: connection closed\n");
+            return 1;
+        }
+    }
+    close(fd);
+    return status;
+}
+
+// record on FILE | record off
+void record_builtin(char* arglist[]) {
+    if (arglist[1] != NULL && strcmp(arglist[1], "on") == 0 && arglist[2] != NULL) {
+        if (record_file != NULL) fclose(record_file);
+        record_file = fopen(arglist[2], "w");
+        if (record_file == NULL) perror("record");
+        record_last = 0;
+    } else if (arglist[1] != NULL && strcmp(arglist[1], "off") == 0) {
+        if (record_file != NULL) fclose(record_file);
+        record_file = NULL;
+    } else {
+        printf("Usage: record on FILE | record off\n");
+    }
+}
+
+// One line per command: gap since the previous arrival in microseconds,
+// exit status, cwd and the command line, tab separated
+void record_command(char *cmd, char *cwd, long long arrived, int status) {
+    char *first = cmd + strspn(cmd, " \t");
+    size_t len = strcspn(first, " \t");
+    if (record_file == NULL || (len == 6 && strncmp(first, "record", 6) == 0)) return;
+    long gap = record_last == 0 ? 0 : (arrived - record_last) / 1000;
+    record_last = arrived;
+    fprintf(record_file, "%ld\t%d\t%s\t%s\n", gap, status, cwd, cmd);
+    fflush(record_file);
+}
+
+// final_version --replay FILE [--speed N|max] [--shells M]
+// Starts M resident shells (server mode) and replays the whole recording
+// against each of them at once, keeping the recorded gaps divided by N.
+int run_replay(int argc, char* argv[]) {
+    double speed = 1;
+    int shells = 1;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--speed") == 0) speed = strcmp(argv[i + 1], "max") == 0 ? 0 : atof(argv[i + 1]);
+        else if (strcmp(argv[i], "--shells") == 0) shells = atoi(argv[i + 1]);
+    }
+    if (shells < 1 || shells > MAX_REPLAY_SHELLS || speed < 0) {
+        fprintf(stderr, "Usage: --replay FILE [--speed N|max] [--shells 1-%d]\n", MAX_REPLAY_SHELLS);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[2], "r");
+    if (in == NULL) {
+        perror("replay");
+        return 1;
+    }
+    int count = 0, cap = 64;
+    ReplayEntry *entries = malloc(sizeof(ReplayEntry) * cap);
+    char line[PATH_MAX + MAX_LEN + 64];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char *gap = strtok(line, "\t"), *status = strtok(NULL, "\t");
+        char *cwd = strtok(NULL, "\t"), *cmd = strtok(NULL, "");
+        if (cmd == NULL || strcmp(cmd, "exit") == 0) continue;
+        if (count == cap) entries = realloc(entries, sizeof(ReplayEntry) * (cap *= 2));
+        entries[count].gap_us = atol(gap);
+        entries[count].status = atoi(status);
+        snprintf(entries[count].cwd, PATH_MAX, "%s", cwd);
+        snprintf(entries[count].cmd, MAX_LEN, "%s", cmd);
+        count++;
+    }
+    fclose(in);
+
+    ReplayStats *stats = mmap(NULL, sizeof(ReplayStats), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    pid_t servers[MAX_REPLAY_SHELLS], drivers[MAX_REPLAY_SHELLS];
+    char paths[MAX_REPLAY_SHELLS][64];
+    for (int i = 0; i < shells; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "/tmp/replay-%d-%d.sock", getpid(), i);
+        servers[i] = fork();
+        if (servers[i] == 0) {
+            execl("/proc/self/exe", "final_version", "--server", paths[i], (char*)NULL);
+            exit(1);
+        }
+    }
+
+    long long start = now_ns();
+    for (int i = 0; i < shells; i++) {
+        drivers[i] = fork();
+        if (drivers[i] == 0) {
+            replay_driver(paths[i], entries, count, speed, stats);
+            exit(0);
+        }
+    }
+    for (int i = 0; i < shells; i++) waitpid(drivers[i], NULL, 0);
+    double elapsed = (now_ns() - start) / 1e9;
+    for (int i = 0; i < shells; i++) {
+        kill(servers[i], SIGTERM);
+        waitpid(servers[i], NULL, 0);
+        unlink(paths[i]);
+    }
+
+    printf("replayed %lu commands on %d shells in %.3fs: %.1f commands/s\n",
+           (unsigned long)stats->commands, shells, elapsed, stats->commands / elapsed);
+    printf("%-8s %8s %10s %10s %10s %10s\n", "", "count", "p50", "p90", "p99", "max");
+    print_hist(stdout, "latency", &stats->latency);
+    printf("status mismatches %lu  errors %lu\n",
+           (unsigned long)stats->mismatches, (unsigned long)stats->errors);
+    free(entries);
+    return stats->errors > 0;
+}
+
+// Replays every entry on one session, following the recorded cwd
+void replay_driver(char *path, ReplayEntry *entries, int count, double speed, ReplayStats *stats) {
+    int fd = -1;
+    for (int tries = 0; fd < 0 && tries < 200; tries++) {
+        if ((fd = connect_session(path)) < 0) usleep(10000);
+    }
+    if (fd < 0) {
+        __atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    int devnull = open("/dev/null", O_RDWR);
+    int fds[3] = { devnull, devnull, devnull };
+    char cwd[PATH_MAX] = "", cd[4 * PATH_MAX + 8];
+    long long due = now_ns();
+    for (int i = 0; i < count; i++) {
+        if (speed > 0) {
+            due += (long long)(entries[i].gap_us * 1000 / speed);
+            long long wait = due - now_ns();
+            if (wait > 0) usleep(wait / 1000);
+        }
+        // The cwd belongs to the server's session, so it is changed there
+        // with a cd whose path is single-quoted, ' becoming '\''
+        if (entries[i].cwd[0] != '\0' && strcmp(cwd, entries[i].cwd) != 0) {
+            snprintf(cwd, sizeof(cwd), "%s", entries[i].cwd);
+            char *q = cd + sprintf(cd, "cd '");
+            for (char *c = cwd; *c != '\0'; c++) {
+                if (*c == '\'') q += sprintf(q, "'\\''");
+                else *q++ = *c;
+            }
+            strcpy(q, "'");
+            send_command(fd, cd, fds);
+        }
+        long long t = now_ns();
+        int status = send_command(fd, entries[i].cmd, fds);
+        if (status < 0) {
+            __atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        hist_record(&stats->latency, now_ns() - t);
+        __atomic_fetch_add(&stats->commands, 1, __ATOMIC_RELAXED);
+        if (status != entries[i].status) __atomic_fetch_add(&stats->mismatches, 1, __ATOMIC_RELAXED);
+    }
+    close(fd);
+}
+
+// worker add NAME ADDR | worker del NAME | worker (list with live load)
+void worker_builtin(char* arglist[]) {
+    if (arglist[1] == NULL) {
+        for (int i = 0; i < worker_count; i++) {
+            int load;
+            if (probe_worker(workers[i].addr, &load) == 0) {
+                printf("%s %s load %d\n", workers[i].name, workers[i].addr, load);
+            } else {
+                printf("%s %s down\n", workers[i].name, workers[i].addr);
+            }
+        }
+    } else if (strcmp(arglist[1], "add") == 0 && arglist[2] != NULL && arglist[3] != NULL) {
+        if (worker_count == MAX_WORKERS) {
+            printf("worker: too many workers\n");
+            return;
+        }
+        strncpy(workers[worker_count].name, arglist[2], sizeof(workers[0].name) - 1);
+        strncpy(workers[worker_count].addr, arglist[3], sizeof(workers[0].addr) - 1);
+        worker_count++;
+    } else if (strcmp(arglist[1], "del") == 0 && arglist[2] != NULL) {
+        for (int i = 0; i < worker_count; i++) {
+            if (strcmp(workers[i].name, arglist[2]) == 0) {
+                workers[i] = workers[--worker_count];
+                break;
+            }
+        }
+    } else {
+        printf("Usage: worker [add NAME ADDR | del NAME]\n");
+    }
+}
+
+// "host:port" is TCP, anything else a unix socket path
+int connect_addr(char *addr) {
+    char *colon = strrchr(addr, ':');
+    if (colon == NULL || strchr(addr, '/') != NULL) {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        strncpy(sun.sun_path, addr, sizeof(sun.sun_path) - 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&sun, sizeof(sun)) == 0) return fd;
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    char host[108];
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+int listen_addr(char *addr) {
+    char *colon = strrchr(addr, ':');
+    int fd;
+    if (colon == NULL || strchr(addr, '/') != NULL) {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        strncpy(sun.sun_path, addr, sizeof(sun.sun_path) - 1);
+        unlink(addr);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0) return -1;
+    } else {
+        char host[108];
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+        struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE }, *res;
+        if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &res) != 0) return -1;
+        fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        int ok = fd >= 0 && bind(fd, res->ai_addr, res->ai_addrlen) == 0;
+        freeaddrinfo(res);
+        if (!ok) return -1;
+    }
+    if (listen(fd, 64) != 0) return -1;
+    return fd;
+}
+
+int send_frame(int fd, int type, const void *buf, uint32_t len) {
+    char header[5];
+    header[0] = type;
+    memcpy(header + 1, &len, 4);
+    struct iovec iov[2] = { { header, 5 }, { (void*)buf, len } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    size_t want = 5 + len;
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n == (ssize_t)want) return 0;
+    if (n < 5) return -1;
+    // Short write on a stream socket, push out the rest of the payload
+    for (size_t done = n - 5; done < len; ) {
+        ssize_t m = send(fd, (char*)buf + done, len - done, MSG_NOSIGNAL);
+        if (m <= 0) return -1;
+        done += m;
+    }
+    return 0;
+}
+
+int recv_frame(int fd, int *type, char *buf, uint32_t *len) {
+    char header[5];
+    if (recv(fd, header, 5, MSG_WAITALL) != 5) return -1;
+    *type = header[0];
+    memcpy(len, header + 1, 4);
+    if (*len > FRAME_MAX) return -1;
+    if (*len > 0 && recv(fd, buf, *len, MSG_WAITALL) != (ssize_t)*len) return -1;
+    return 0;
+}
+
+// Reads a worker's LOAD greeting, -1 if it is unreachable
+int probe_worker(char *addr, int *load) {
+    int fd = connect_addr(addr);
+    if (fd < 0) return -1;
+    int type;
+    uint32_t len;
+    char buf[16];
+    int ok = recv_frame(fd, &type, buf, &len) == 0 && type == FRAME_LOAD && len == sizeof(int);
+    if (ok) memcpy(load, buf, sizeof(int));
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// Runs in the forked child in place of execvp() for "@name cmd" or "@ cmd".
+// Picks the named worker or the least loaded reachable one, relays its
+// stdout/stderr and exits with its status. A worker that dies before any
+// output was relayed is dropped and the command retried elsewhere.
+void remote_execute(char* arglist[]) {
+    // The words go as they are, the worker runs them without re-parsing
+    static char cmd[FRAME_MAX];
+    size_t cmd_len = 0;
+    char *name = arglist[0] + 1;
+    for (int i = 1; arglist[i] != NULL; i++) {
+        size_t n = strlen(arglist[i]) + 1;
+        if (cmd_len + n > sizeof(cmd)) {
+            fprintf(stderr, "@%s: command too long\n", name);
+            exit(255);
+        }
+        memcpy(cmd + cmd_len, arglist[i], n);
+        cmd_len += n;
+    }
+    int dead[MAX_WORKERS] = { 0 };
+    static char buf[FRAME_MAX];
+
+    for (int attempt = 0; attempt < worker_count + 2; attempt++) {
+        int fd = -1, best = -1, best_load = 0;
+        // Start at a different worker per dispatch so ties spread out
+        for (int k = 0; k < worker_count; k++) {
+            int i = (k + getpid()) % worker_count;
+            if (dead[i] || (*name != '\0' && strcmp(workers[i].name, name) != 0)) continue;
+            int c = connect_addr(workers[i].addr);
+            int type, load;
+            uint32_t len;
+            if (c < 0 || recv_frame(c, &type, buf, &len) != 0 || type != FRAME_LOAD) {
+                if (c >= 0) close(c);
+                if (*name == '\0') dead[i] = 1;
+                continue;
+            }
+            memcpy(&load, buf, sizeof(int));
+            if (fd < 0 || load < best_load) {
+                if (fd >= 0) close(fd);
+                fd = c;
+                best = i;
+                best_load = load;
+            } else {
+                close(c);
+            }
+        }
+        if (fd < 0) {
+            if (*name == '\0') break;
+            usleep(100000 << attempt);  // named worker may be restarting
+            continue;
+        }
+
+        int relayed = 0;
+        if (send_frame(fd, FRAME_CMD, cmd, cmd_len) == 0) {
+            int type;
+            uint32_t len;
+            while (recv_frame(fd, &type, buf, &len) == 0) {
+                if (type == FRAME_OUT || type == FRAME_ERR) {
+                    if (write(type == FRAME_OUT ? 1 : 2, buf, len) < 0) exit(1);
+                    relayed = 1;
+                } else if (type == FRAME_EXIT) {
+                    int status;
+                    memcpy(&status, buf, sizeof(int));
+                    exit(status);
+                }
+            }
+        }
+        close(fd);
+        fprintf(stderr, "@%s: lost worker %s\n", name, workers[best].name);
+        if (relayed) exit(255);
+        dead[best] = *name == '\0';
+    }
+    fprintf(stderr, "@%s: no worker available\n", name);
+    exit(255);
+}
+
+// Worker agent: greets every connection with its load and forks a handler
+// once a command frame starts arriving, so probes, which just read the
+// greeting and hang up, never count as load. ppoll() with SIGCHLD
+// unblocked keeps the running count exact.
+void worker_sigchld(int sig) {
+}
+
+int run_worker(char *addr) {
+    listen_fd = listen_addr(addr);
+    if (listen_fd < 0) {
+        perror("worker");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa = { .sa_handler = worker_sigchld };
+    sigaction(SIGCHLD, &sa, NULL);
+    sigset_t chld, old_mask;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old_mask);
+
+    struct pollfd fds[1 + MAX_SESSIONS];
+    int nfds = 1;
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    while (1) {
+        while (waitpid(-1, NULL, WNOHANG) > 0) worker_running--;
+        // With the table full the listen fd would stay readable and spin
+        fds[0].fd = nfds < 1 + MAX_SESSIONS ? listen_fd : -1;
+        if (ppoll(fds, nfds, NULL, &old_mask) <= 0) continue;
+        for (int i = nfds - 1; i >= 1; i--) {
+            if (fds[i].revents == 0) continue;
+            int conn = fds[i].fd;
+            fds[i] = fds[--nfds];
+            char type;
+            if (recv(conn, &type, 1, MSG_PEEK | MSG_DONTWAIT) != 1 || type != FRAME_CMD) {
+                close(conn);
+                continue;
+            }
+            pid_t pid = fork();
+            if (pid == 0) {
+                signal(SIGCHLD, SIG_DFL);
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                close(listen_fd);
+                worker_serve(conn);
+                exit(0);
+            }
+            if (pid > 0) worker_running++;
+            close(conn);
+        }
+        if (fds[0].revents && nfds < 1 + MAX_SESSIONS) {
+            int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn < 0) continue;
+            if (send_frame(conn, FRAME_LOAD, &worker_running, sizeof(int)) != 0) {
+                close(conn);
+                continue;
+            }
+            fds[nfds].fd = conn;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+    }
+}
+
+void worker_serve(int conn) {
+    static char buf[FRAME_MAX];
+    int type;
+    uint32_t len;
+    if (recv_frame(conn, &type, buf, &len) != 0 || type != FRAME_CMD || len == 0 || buf[len - 1] != '\0') return;
+    char **argv = malloc(sizeof(char*) * (len + 1));
+    int argc = 0;
+    for (char *p = buf; p < buf + len; p += strlen(p) + 1) argv[argc++] = p;
+    argv[argc] = NULL;
+
+    int out[2], err[2];
+    if (pipe(out) != 0 || pipe(err) != 0) return;
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_RDONLY);
+        dup2(devnull, 0);
+        dup2(out[1], 1);
+        dup2(err[1], 2);
+        close(devnull);
+        close(out[0]);
+        close(out[1]);
+        close(err[0]);
+        close(err[1]);
+        close(conn);
+        execvp(argv[0], argv);
+        perror("Command not found...");
+        exit(127);
+    }
+    free(argv);
+    close(out[1]);
+    close(err[1]);
+    struct pollfd fds[2] = { { .fd = out[0], .events = POLLIN }, { .fd = err[0], .events = POLLIN } };
+    int open_fds = 2;
+    while (open_fds > 0 && poll(fds, 2, -1) >= 0) {
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd < 0 || fds[i].revents == 0) continue;
+            ssize_t n = read(fds[i].fd, buf, FRAME_MAX);
+            if (n <= 0) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open_fds--;
+            } else if (send_frame(conn, i == 0 ? FRAME_OUT : FRAME_ERR, buf, n) != 0) {
+                kill(pid, SIGTERM);
+                return;
+            }
+        }
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    int code = status_code(status);
+    send_frame(conn, FRAME_EXIT, &code, sizeof(int));
+}
+
+// The spawn helper is forked at startup, before history, variables, traces
+// and caches grow, and launches every plain command from then on. It
+// clones with CLONE_PARENT, so the command is still the shell's child and
+// waitpid(), pidfds and deadlines work on it as on a forked one.
+void spawn_helper_start() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) return;
+    pid_t shell = getpid();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != shell) _exit(0);
+        close(loop_epfd);
+        close(timer_fd);
+        close(filter_event_fd);
+        spawn_helper_main(sv[1]);
+        _exit(0);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        return;
+    }
+    spawn_fd = sv[0];
+}
+
+// Serves requests until the shell closes its end
+void spawn_helper_main(int sock) {
+    static char buf[SPAWN_MSG];
+    // ^C at the terminal is for the commands, not the helper
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    while (1) {
+        char control[CMSG_SPACE(sizeof(int) * 4)];
+        struct iovec iov = { buf, sizeof(buf) };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                              .msg_controllen = sizeof(control) };
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        int fds[4], nfds = 0;
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        if (c != NULL && c->cmsg_type == SCM_RIGHTS) {
+            nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(c), sizeof(int) * nfds);
+        }
+        spawn_helper_request(sock, buf, n, fds, nfds);
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+    }
+}
+
+void spawn_helper_request(int sock, char *buf, ssize_t len, int *fds, int nfds) {
+    SpawnRequest req;
+    SpawnReply reply = { -1, EINVAL };
+    int pidfd = -1;
+    memcpy(&req, buf, sizeof(req));
+    char *argv[req.argc + 1], *envp[req.envc + 1];
+    char *p = buf + sizeof(req), *end = buf + len;
+    for (int i = 0; i < req.argc + req.envc && p < end; i++) {
+        if (i < req.argc) argv[i] = p;
+        else envp[i - req.argc] = p;
+        p += strlen(p) + 1;
+    }
+    argv[req.argc] = NULL;
+    envp[req.envc] = NULL;
+    char *path = NULL;
+    if (req.resolved && p < end) {
+        path = p;
+        p += strlen(p) + 1;
+    }
+
+    if (nfds == 4 && p <= end) {
+        // CLONE_PARENT takes the helper's own exit signal, SIGCHLD
+        struct clone_args args = { .flags = CLONE_PARENT | CLONE_PIDFD, .pidfd = (uint64_t)(uintptr_t)&pidfd };
+        pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid == 0) {
+            for (int i = 0; i < 3; i++) dup2(fds[i], i);
+            if (fchdir(fds[3]) != 0) _exit(1);
+            if (req.new_pgrp) setpgid(0, 0);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGPIPE, SIG_DFL);
+            hist_record(&metrics->launch, now_ns() - req.fork_start);
+            __atomic_fetch_add(&metrics->execs, 1, __ATOMIC_RELAXED);
+            // execvpe searches getenv("PATH"), which is the helper's own
+            // from startup unless the shell's environment replaces it
+            environ = envp;
+            // The path went stale or needs /bin/sh: the usual search
+            if (path != NULL) execve(path, argv, envp);
+            execvpe(argv[0], argv, envp);
+            perror("Command not found...");
+            _exit(1);
+        }
+        reply.pid = pid;
+        reply.err = pid < 0 ? errno : 0;
+    }
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &reply, sizeof(reply) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (pidfd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &pidfd, sizeof(int));
+    }
+    sendmsg(sock, &msg, 0);
+    if (pidfd >= 0) close(pidfd);
+}
+
+// Opens the stage's redirections here and hands the rest to the helper.
+// -1 means fork instead, which also reports a redirection that fails.
+pid_t spawn_stage(char **arglist, int in_fd, char *infile, char *outfile, int append, int out_fd, int new_pgrp, int *pidfd) {
+    int fds[3] = { in_fd, out_fd >= 0 ? out_fd : 1, 2 };
+    int opened[2] = { -1, -1 };
+    int cached;
+    if (infile != NULL) {
+        if ((fds[0] = redir_open(infile, O_RDONLY, &cached)) < 0) return -1;
+        if (!cached) opened[0] = fds[0];
+    }
+    if (outfile != NULL) {
+        if ((fds[1] = redir_open(outfile, append ? O_APPEND : O_TRUNC, &cached)) < 0) {
+            if (opened[0] >= 0) close(opened[0]);
+            return -1;
+        }
+        if (!cached) opened[1] = fds[1];
+    }
+    pid_t pid = zygote_spawn(arglist, fds, new_pgrp, pidfd);
+    for (int i = 0; i < 2; i++) if (opened[i] >= 0) close(opened[i]);
+    return pid;
+}
+
+// how is O_RDONLY for <, O_TRUNC for > and O_APPEND for >>. With the cache
+// on, < and >> fds on regular files stay open across commands: a hit costs
+// one stat of the path instead of an open and a close, and catches a file
+// that was renamed, unlinked or replaced since. *cached says the fd belongs
+// to the cache and must not be closed.
+int redir_open(char *path, int how, int *cached) {
+    int flags = how == O_RDONLY ? O_RDONLY : O_WRONLY | O_CREAT | how;
+    *cached = 0;
+    if (fd_cache_limit == 0 || how == O_TRUNC || (how == O_RDONLY && !fd_cache_inputs)) {
+        return open(path, flags | O_CLOEXEC, 0644);
+    }
+    struct stat st;
+    for (int i = 0; i < fd_cache_count; i++) {
+        FdEntry *e = &fd_cache[i];
+        if (e->how != how || strcmp(e->path, path) != 0) continue;
+        if (stat(path, &st) != 0 || st.st_dev != e->dev || st.st_ino != e->ino) {
+            fd_cache_drop(i);
+            break;
+        }
+        // Two stages reading the same file need offsets of their own
+        if (how == O_RDONLY && e->stamp == fd_cache_stamp) return open(path, flags | O_CLOEXEC);
+        if (how == O_RDONLY) lseek(e->fd, 0, SEEK_SET);
+        e->used = ++fd_cache_clock;
+        e->stamp = fd_cache_stamp;
+        e->hits++;
+        *cached = 1;
+        return e->fd;
+    }
+
+    int fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return fd;
+    fd_cache_misses++;
+    fd_cache_trim(fd_cache_limit - 1);
+    fd_cache[fd_cache_count++] = (FdEntry){ strdup(path), how, fd, st.st_dev, st.st_ino,
+                                            ++fd_cache_clock, fd_cache_stamp, 0 };
+    *cached = 1;
+    return fd;
+}
+
+void fd_cache_drop(int i) {
+    close(fd_cache[i].fd);
+    free(fd_cache[i].path);
+    fd_cache[i] = fd_cache[--fd_cache_count];
+}
+
+// Closes the least recently used fds until at most keep are left
+void fd_cache_trim(int keep) {
+    while (fd_cache_count > keep) {
+        int oldest = 0;
+        for (int i = 1; i < fd_cache_count; i++) {
+            if (fd_cache[i].used < fd_cache[oldest].used) oldest = i;
+        }
+        fd_cache_drop(oldest);
+    }
+}
+
+// fdcache [N]: lists the redirection fds kept open, or keeps at most N
+// (0 closes them all and turns the cache off)
+int builtin_fdcache(char* arglist[]) {
+    if (arglist[1] == NULL) {
+        printf("limit %d, %lld opened\n", fd_cache_limit, fd_cache_misses);
+        for (int i = 0; i < fd_cache_count; i++) {
+            FdEntry *e = &fd_cache[i];
+            printf("%4d %-2s %8lld hits  %s\n", e->fd, e->how == O_APPEND ? ">>" : "<", e->hits, e->path);
+        }
+        return 0;
+    }
+    char *end;
+    long n = strtol(arglist[1], &end, 10);
+    if (*end != '\0' || n < 0 || n > FD_CACHE_MAX) {
+        fprintf(stderr, "fdcache: limit must be 0-%d\n", FD_CACHE_MAX);
+        return 2;
+    }
+    fd_cache_limit = n;
+    fd_cache_trim(fd_cache_limit);
+    return 0;
+}
+
+pid_t zygote_spawn(char **argv, int fds[3], int new_pgrp, int *pidfd) {
+    static char buf[SPAWN_MSG];
+    // A resolved path saves the helper's child execvp's failed tries
+    char path[PATH_MAX];
+    char *resolved = path_resolve(argv[0], path, sizeof(path), 0);
+    SpawnRequest req = { 0, 0, new_pgrp, fork_start, resolved != NULL };
+    size_t len = sizeof(req);
+    for (int pass = 0; pass < 2; pass++) {
+        char **list = pass == 0 ? argv : env_list();
+        for (int i = 0; list[i] != NULL; i++) {
+            size_t n = strlen(list[i]) + 1;
+            if (len + n > sizeof(buf)) return -1;
+            memcpy(buf + len, list[i], n);
+            len += n;
+            if (pass == 0) req.argc++;
+            else req.envc++;
+        }
+    }
+    if (resolved != NULL) {
+        size_t n = strlen(resolved) + 1;
+        if (len + n > sizeof(buf)) return -1;
+        memcpy(buf + len, resolved, n);
+        len += n;
+    }
+    memcpy(buf, &req, sizeof(req));
+
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd < 0) return -1;
+    int sent[4] = { fds[0], fds[1], fds[2], cwd };
+    char control[CMSG_SPACE(sizeof(sent))];
+    struct iovec iov = { buf, len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                          .msg_controllen = sizeof(control) };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(sent));
+    memcpy(CMSG_DATA(c), sent, sizeof(sent));
+    ssize_t n = sendmsg(spawn_fd, &msg, 0);
+    close(cwd);
+    if (n < 0) {
+        // The helper is gone, fork from here on
+        close(spawn_fd);
+        spawn_fd = -1;
+        return -1;
+    }
+
+    SpawnReply reply;
+    char rcontrol[CMSG_SPACE(sizeof(int))];
+    struct iovec riov = { &reply, sizeof(reply) };
+    struct msghdr rmsg = { .msg_iov = &riov, .msg_iovlen = 1, .msg_control = rcontrol,
+                           .msg_controllen = sizeof(rcontrol) };
+    do {
+        n = recvmsg(spawn_fd, &rmsg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n != sizeof(reply)) {
+        close(spawn_fd);
+        spawn_fd = -1;
+        return -1;
+    }
+    c = CMSG_FIRSTHDR(&rmsg);
+    *pidfd = -1;
+    if (c != NULL && c->cmsg_type == SCM_RIGHTS) memcpy(pidfd, CMSG_DATA(c), sizeof(int));
+    return reply.pid;
 }
 
 int execute(char* arglist[], int background) {
+    if (arglist[0][0] == '@') remote_execute(arglist);
+    trace_span("exec", arglist[0], child_start, getpid(), current_job, current_stage);
+    hist_record(&metrics->launch, now_ns() - fork_start);
+    __atomic_fetch_add(&metrics->execs, 1, __ATOMIC_RELAXED);
+    environ = env_list();
     execvp(arglist[0], arglist);
     perror("Command not found...");
     exit(1);
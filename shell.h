@@ -0,0 +1,43 @@
+// Embedding API for final_version.c, built as a library with
+//   gcc -DSHELL_LIBRARY -fPIC -shared final_version.c -o libshell.so
+// Each session keeps its own variables, functions, exported environment,
+// background jobs, history, cwd and last status. Calls may come from any
+// thread and are carried out on a library thread with its own cwd and fd
+// table, which start as the host's at the first call. A call that runs
+// programs waits for them without holding that thread, so other sessions
+// go on meanwhile; a script that runs programs does so in a forked copy of
+// the session, whose changes are taken back when it ends. The host's cwd,
+// environment and fds are never changed.
+#ifndef SHELL_H
+#define SHELL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct ShellSession ShellSession;
+
+ShellSession* shell_session_new(void);
+void shell_session_free(ShellSession *s);
+
+// Runs one command line (or script) to completion, returns its status, or
+// -1 once the session has run exit
+int shell_run(ShellSession *s, const char *cmdline);
+
+// Same, with stdout going into buf. *len gets the full output size, which
+// may exceed cap; only the first cap bytes are stored.
+int shell_capture(ShellSession *s, const char *cmdline, char *buf, size_t cap, size_t *len);
+
+// Starts the command line in a forked copy of the session and returns its
+// pid, with a pidfd the caller can poll for completion. Changes it makes
+// to variables or the cwd stay in the copy.
+pid_t shell_spawn(ShellSession *s, const char *cmdline, int *pidfd);
+
+// Reaps a command s spawned, closes its pidfd and returns its status; -1
+// for a pid s didn't spawn
+int shell_wait(ShellSession *s, pid_t pid, int pidfd);
+
+// A malloc'd copy of the value, NULL if unset; the caller frees it
+char* shell_get_var(ShellSession *s, const char *name);
+void shell_set_var(ShellSession *s, const char *name, const char *value);
+
+#endif
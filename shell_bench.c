@@ -0,0 +1,80 @@
+// Per-call cost of the embedded shell against system() and popen()
+//   gcc -DSHELL_LIBRARY -fPIC -shared final_version.c -o libshell.so
+//   gcc shell_bench.c -L. -lshell -Wl,-rpath,. -o shell_bench
+//   ./shell_bench [iterations]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include "shell.h"
+
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void report(const char *what, long long sys_us, long long lib_us, int n) {
+    printf("%-22s system %8.1f us   library %8.1f us   %5.1fx\n", what,
+           (double)sys_us / n, (double)lib_us / n, lib_us > 0 ? (double)sys_us / lib_us : 0.0);
+}
+
+int main(int argc, char* argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 2000;
+    ShellSession *s = shell_session_new();
+    char buf[256];
+    size_t len;
+
+    // An external program: one exec instead of sh plus the program
+    long long t = now_us();
+    for (int i = 0; i < n; i++) system("/bin/true");
+    long long sys_us = now_us() - t;
+    t = now_us();
+    for (int i = 0; i < n; i++) shell_run(s, "/bin/true");
+    report("/bin/true", sys_us, now_us() - t, n);
+
+    // Builtins and assignments never leave the process
+    t = now_us();
+    for (int i = 0; i < n; i++) system("x=1; cd /tmp");
+    sys_us = now_us() - t;
+    t = now_us();
+    for (int i = 0; i < n; i++) shell_run(s, "x=1; cd /tmp");
+    report("x=1; cd /tmp", sys_us, now_us() - t, n);
+
+    // Output read back by the caller
+    t = now_us();
+    for (int i = 0; i < n; i++) {
+        FILE *p = popen("echo hello", "r");
+        while (fgets(buf, sizeof(buf), p) != NULL);
+        pclose(p);
+    }
+    sys_us = now_us() - t;
+    t = now_us();
+    for (int i = 0; i < n; i++) shell_capture(s, "echo hello", buf, sizeof(buf), &len);
+    report("echo hello (captured)", sys_us, now_us() - t, n);
+
+    // Several commands in flight, waited on through their pidfds
+    int pidfds[8];
+    pid_t pids[8];
+    for (int i = 0; i < 8; i++) pids[i] = shell_spawn(s, "sleep 0.1", &pidfds[i]);
+    t = now_us();
+    int left = 8;
+    while (left > 0) {
+        struct pollfd pfd[8];
+        for (int i = 0; i < 8; i++) pfd[i] = (struct pollfd){ pidfds[i], POLLIN, 0 };
+        poll(pfd, 8, -1);
+        for (int i = 0; i < 8; i++) {
+            if (pidfds[i] < 0 || !(pfd[i].revents & POLLIN)) continue;
+            shell_wait(s, pids[i], pidfds[i]);
+            pidfds[i] = -1;
+            left--;
+        }
+    }
+    printf("8 spawned sleeps done in %.1f ms\n", (now_us() - t) / 1000.0);
+
+    shell_session_free(s);
+    return 0;
+}
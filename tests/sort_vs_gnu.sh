@@ -0,0 +1,59 @@
+#!/bin/sh
+# The shell's own sort stage must order lines exactly as GNU sort does
+# under LC_ALL=C. PATH is pointed nowhere inside the shell, so a case that
+# fell back to the real sort would fail instead of passing by default.
+#   gcc final_version.c -o final_version && tests/sort_vs_gnu.sh ./final_version
+shell=${1:-./final_version}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+export LC_ALL=C
+
+# Mixed case, duplicates, ties on the key, signs, decimals, blank and
+# missing fields; large enough that -S 1K has to merge runs
+awk 'BEGIN {
+    split("apple Apple banana BANANA cherry apple  date Elder fig", w, " ")
+    for (i = 0; i < 3000; i++) {
+        n = (i * 7919) % 211 - 100
+        printf "%s:%d:%s %d.%d\n", w[i % 9 + 1], n, w[(i * 3) % 9 + 1], (i * 31) % 17, i % 10
+    }
+    print ""; print ":"; print "x"; print "-0:0"; print "  lead:5"; print "1e3:+7"
+}' > "$dir/in"
+
+fail=0
+while read -r opts; do
+    printf 'export PATH=/nonexistent\nsort %s < %s/in > %s/ours\n' "$opts" "$dir" "$dir" \
+        | "$shell" > /dev/null 2>&1
+    eval "sort $opts" < "$dir/in" > "$dir/gnu"
+    if cmp -s "$dir/ours" "$dir/gnu"; then
+        echo "ok   sort $opts"
+    else
+        echo "FAIL sort $opts"
+        fail=1
+    fi
+done <<'EOF'
+-n
+-r
+-u
+-f
+-s
+-nr
+-fu
+-ru
+-t : -k 2n
+-t : -k 2nr
+-t : -k 2,2n
+-t : -k 2,2n -s
+-t : -k 1,1f
+-t : -k 1,1f -u
+-t : -k 3
+-t : -k 3,3r -n
+-k 2
+-k 2n
+-k 2,2nr
+-k 1,1 -s -r
+-S 1K
+-S 1K -n
+-S 1K -t : -k 2,2n -s
+-S 1K -fu
+EOF
+exit $fail
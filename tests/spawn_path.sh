@@ -0,0 +1,21 @@
+#!/bin/sh
+# A program found only through a PATH exported inside the shell must run,
+# both through the spawn helper and with it turned off.
+#   gcc final_version.c -o final_version && tests/spawn_path.sh ./final_version
+shell=${1:-./final_version}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+mkdir "$dir/bin"
+printf '#!/bin/sh\necho mytool-ran\n' > "$dir/bin/mytool"
+chmod +x "$dir/bin/mytool"
+
+fail=0
+for helper in on off; do
+    if [ $helper = off ]; then export SHELL_NO_SPAWN_HELPER=1; fi
+    out=$(printf 'export PATH=%s/bin:$PATH\nmytool\n' "$dir" | "$shell" 2>&1)
+    case $out in
+    *mytool-ran*) echo "ok   helper $helper" ;;
+    *) echo "FAIL helper $helper: $out"; fail=1 ;;
+    esac
+done
+exit $fail